@@ -0,0 +1,57 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_BENCH_ALLOCATION_COUNTER_H
+#define STARTEAR_BENCH_ALLOCATION_COUNTER_H
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+namespace Startear {
+
+// The number of calls to global operator new in this process. It is counted
+// by the replaced operators which are linked into startear_bench.
+uint64_t allocationCount();
+
+// Reports allocations per iteration of the benchmark, which are counted since
+// the construction.
+class AllocationCounter {
+ public:
+  AllocationCounter() : start_(allocationCount()) {}
+
+  void report(benchmark::State& state) const {
+    state.counters["allocs/iter"] = benchmark::Counter(
+        static_cast<double>(allocationCount() - start_),
+        benchmark::Counter::kAvgIterations);
+  }
+
+ private:
+  uint64_t start_;
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_BENCH_ALLOCATION_COUNTER_H
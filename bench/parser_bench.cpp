@@ -0,0 +1,131 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "allocation_counter.h"
+#include "ast.h"
+#include "compiler.h"
+#include "parser.h"
+#include "tokenizer.h"
+
+namespace Startear {
+namespace {
+// Builds a script which has the given number of functions.
+std::string makeParserScript(size_t functions) {
+  std::string script;
+  for (size_t i = 0; i < functions; ++i) {
+    script += "fn f" + std::to_string(i) + "(a, b) {\n";
+    script += "  let c = a * 2 + b / 3 - (a - b) * 4;\n";
+    script += "  let d = c < 10 && a >= b || c == 0;\n";
+    script += "  if (c != d) {\n";
+    script += "    let e = f0(c, d);\n";
+    script += "  }\n";
+    script += "  return c;\n";
+    script += "}\n";
+  }
+  return script;
+}
+
+void BM_Parse(benchmark::State& state) {
+  Tokenizer tokenizer(makeParserScript(state.range(0)));
+  const auto& tokens = tokenizer.scanTokens();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    Parser parser(tokens);
+    auto ast = parser.parse();
+    if (ast == nullptr) {
+      state.SkipWithError("failed to parse");
+      break;
+    }
+    benchmark::DoNotOptimize(ast.get());
+  }
+  allocations.report(state);
+  state.counters["tokens/s"] = benchmark::Counter(
+      static_cast<double>(tokens.size()) * state.iterations(),
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Parse)->Arg(16)->Arg(1024);
+
+// Compile latency through AST.
+void BM_ParseAndEmit(benchmark::State& state) {
+  Tokenizer tokenizer(makeParserScript(state.range(0)));
+  const auto& tokens = tokenizer.scanTokens();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    Parser parser(tokens);
+    auto ast = parser.parse();
+    StartearVMInstructionEmitter emitter;
+    ast->accept(emitter);
+    benchmark::DoNotOptimize(emitter.emit().code().data());
+  }
+  allocations.report(state);
+  state.counters["tokens/s"] = benchmark::Counter(
+      static_cast<double>(tokens.size()) * state.iterations(),
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_ParseAndEmit)->Arg(16)->Arg(1024);
+
+// Emission only. AST is built once and visited on each iteration.
+void BM_Emit(benchmark::State& state) {
+  Tokenizer tokenizer(makeParserScript(state.range(0)));
+  Parser parser(tokenizer.scanTokens());
+  auto ast = parser.parse();
+  if (ast == nullptr) {
+    state.SkipWithError("failed to parse");
+    return;
+  }
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    StartearVMInstructionEmitter emitter;
+    ast->accept(emitter);
+    benchmark::DoNotOptimize(emitter.emit().code().data());
+  }
+  allocations.report(state);
+}
+BENCHMARK(BM_Emit)->Arg(16)->Arg(1024);
+
+void BM_CompileSinglePass(benchmark::State& state) {
+  Tokenizer tokenizer(makeParserScript(state.range(0)));
+  const auto& tokens = tokenizer.scanTokens();
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    Compiler compiler(tokens);
+    if (!compiler.compile()) {
+      state.SkipWithError("failed to compile");
+      break;
+    }
+    benchmark::DoNotOptimize(compiler.program().code().data());
+  }
+  allocations.report(state);
+  state.counters["tokens/s"] = benchmark::Counter(
+      static_cast<double>(tokens.size()) * state.iterations(),
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_CompileSinglePass)->Arg(16)->Arg(1024);
+}  // namespace
+}  // namespace Startear
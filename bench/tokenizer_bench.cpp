@@ -0,0 +1,72 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "allocation_counter.h"
+#include "tokenizer.h"
+
+namespace Startear {
+namespace {
+// Builds a script of roughly size bytes which mixes all token kinds.
+std::string makeScript(size_t size) {
+  static constexpr std::string_view chunk =
+      "fn fibonacci(number) {\n"
+      "  // returns nth fibonacci number\n"
+      "  if (number < 2) { return number; }\n"
+      "  return fibonacci(number - 1) + fibonacci(number - 2);\n"
+      "}\n"
+      "let formatted_result = fibonacci(25) * 1.5 / 3;\n"
+      "print(\"result of the calculation\");\n"
+      "for (let index = 0; index <= 1000; index = index + 1) {}\n";
+  std::string script;
+  script.reserve(size + chunk.size());
+  while (script.size() < size) {
+    script += chunk;
+  }
+  return script;
+}
+
+void BM_Tokenize(benchmark::State& state) {
+  const auto script = makeScript(state.range(0));
+  size_t tokens = 0;
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    Tokenizer tokenizer(script);
+    auto& result = tokenizer.scanTokens();
+    tokens += result.size();
+    benchmark::DoNotOptimize(result.data());
+  }
+  allocations.report(state);
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          script.size());
+  state.counters["tokens/s"] =
+      benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Tokenize)->Arg(1 << 12)->Arg(1 << 20)->Arg(1 << 24);
+}  // namespace
+}  // namespace Startear
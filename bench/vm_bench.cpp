@@ -0,0 +1,328 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+
+#include <optional>
+#include <string>
+
+#include "allocation_counter.h"
+#include "ast.h"
+#include "parser.h"
+#include "register_program.h"
+#include "register_vm.h"
+#include "tokenizer.h"
+#include "vm_impl.h"
+
+namespace Startear {
+namespace {
+// Scripts store their result on `r` of main, so that each run is checked.
+// There is no loop statement, so that loops are written as recursion.
+
+// Recursive fibonacci, which the Fibonacchi test is meant to compute.
+std::string fibScript(size_t n) {
+  return fmt::format(R"(
+fn fib(n) {{
+  if (n < 2) {{
+    return n;
+  }}
+  let a = fib(n - 1);
+  let b = fib(n - 2);
+  let c = a + b;
+  return c;
+}}
+fn main() {{
+  let r = fib({});
+}}
+)",
+                     n);
+}
+
+double fibExpected(size_t n) {
+  return n < 2 ? n : fibExpected(n - 1) + fibExpected(n - 2);
+}
+
+// Straight line arithmetic dominates each iteration.
+std::string arithmeticScript(size_t n) {
+  return fmt::format(R"(
+fn loop(n, acc) {{
+  if (n == 0) {{
+    return acc;
+  }}
+  let a = n * 3 + 1;
+  let b = a - n / 2;
+  let c = a * b - (a + b) * 2;
+  let d = c / 4 + a - b;
+  let e = acc + d - c / 4 - a + b + 1;
+  let next = loop(n - 1, e);
+  return next;
+}}
+fn main() {{
+  let r = loop({}, 0);
+}}
+)",
+                     n);
+}
+
+// Compare and branch on every few instructions.
+std::string branchScript(size_t n) {
+  return fmt::format(R"(
+fn loop(n, acc) {{
+  if (n == 0) {{
+    return acc;
+  }}
+  let x = acc;
+  if (n < 100) {{
+    x = x + 1;
+  }}
+  if (n > 50) {{
+    x = x + 2;
+  }}
+  if (n == 7) {{
+    x = x + 3;
+  }}
+  if (n >= 20) {{
+    x = x + 4;
+  }}
+  if (n <= 30) {{
+    x = x + 5;
+  }}
+  if (n != 3) {{
+    x = x + 6;
+  }}
+  let next = loop(n - 1, x);
+  return next;
+}}
+fn main() {{
+  let r = loop({}, 0);
+}}
+)",
+                     n);
+}
+
+// Small functions which are called many times per iteration.
+std::string callScript(size_t n) {
+  return fmt::format(R"(
+fn inc(x) {{
+  let y = x + 1;
+  return y;
+}}
+fn add(x, y) {{
+  let z = x + y;
+  return z;
+}}
+fn loop(n, acc) {{
+  if (n == 0) {{
+    return acc;
+  }}
+  let a = inc(acc);
+  let b = inc(a);
+  let c = add(a, b);
+  let e = inc(n);
+  let d = add(c, e);
+  let next = loop(n - 1, d - c - a);
+  return next;
+}}
+fn main() {{
+  let r = loop({}, 0);
+}}
+)",
+                     n);
+}
+
+// The deepest script recurses 1000 times, which needs far less than the
+// default stack. Smaller stack keeps VM construction out of the profile.
+constexpr size_t bench_stack_size = 1 << 14;
+constexpr int loop_depth = 1000;
+
+// Passes of the front end. The default one runs none of them, so that each
+// pass is measured against it.
+struct Pipeline {
+  bool fold_{false};
+  bool fuse_{false};
+  std::optional<InlineOptions> inlining_;
+};
+
+// The front end of startear_main.
+Pipeline shippedPipeline() { return Pipeline{true, true, InlineOptions()}; }
+
+const Program& compile(std::string script,
+                       StartearVMInstructionEmitter& emitter,
+                       const Pipeline& pipeline = Pipeline()) {
+  Tokenizer tokenizer(std::move(script));
+  Parser parser(tokenizer.scanTokens());
+  auto ast = parser.parse();
+  STARTEAR_ASSERT(ast != nullptr);
+  if (pipeline.fold_) {
+    ConstantFoldingVisitor folder;
+    ast->accept(folder);
+  }
+  ast->accept(emitter);
+  return emitter.emit(pipeline.fuse_, pipeline.inlining_);
+}
+
+// Runs the script on the stack VM. Result of the first run is compared to the
+// expected one if it is given. Functions are compiled on each run if jit is
+// true, so that the time includes compilation.
+void runStackVM(benchmark::State& state, const std::string& script,
+                std::optional<double> expected, bool jit = false,
+                const Pipeline& pipeline = Pipeline()) {
+  StartearVMInstructionEmitter emitter;
+  // VM takes mutable program.
+  auto program = compile(script, emitter, pipeline);
+  uint64_t instructions = 0;
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    VMImpl vm(program, bench_stack_size);
+    vm.useJIT(jit);
+    vm.start();
+    instructions += vm.executedInstructions();
+    if (expected) {
+      auto r = vm.peekLocalVariable("r");
+      if (!r || r->getDouble() != expected) {
+        state.SkipWithError("unexpected result");
+        break;
+      }
+      expected.reset();
+    }
+  }
+  allocations.report(state);
+  // Instructions are counted only by VM which is built with STARTEAR_VM_COUNT.
+  if (!VMImpl::countsInstructions()) {
+    return;
+  }
+  state.counters["instructions"] = benchmark::Counter(
+      static_cast<double>(instructions), benchmark::Counter::kAvgIterations);
+  state.counters["instr/s"] = benchmark::Counter(
+      static_cast<double>(instructions), benchmark::Counter::kIsRate);
+}
+
+void BM_StackVMFib(benchmark::State& state) {
+  runStackVM(state, fibScript(state.range(0)), fibExpected(state.range(0)));
+}
+BENCHMARK(BM_StackVMFib)->Arg(10)->Arg(20);
+
+void BM_StackVMArithmetic(benchmark::State& state) {
+  runStackVM(state, arithmeticScript(loop_depth), std::nullopt);
+}
+BENCHMARK(BM_StackVMArithmetic);
+
+void BM_StackVMBranch(benchmark::State& state) {
+  runStackVM(state, branchScript(loop_depth), std::nullopt);
+}
+BENCHMARK(BM_StackVMBranch);
+
+void BM_StackVMCall(benchmark::State& state) {
+  runStackVM(state, callScript(loop_depth), std::nullopt);
+}
+BENCHMARK(BM_StackVMCall);
+
+void BM_StackVMCallInlined(benchmark::State& state) {
+  runStackVM(state, callScript(loop_depth), std::nullopt, false,
+             Pipeline{false, false, InlineOptions()});
+}
+BENCHMARK(BM_StackVMCallInlined);
+
+// Scripts compiled as startear_main does, with folding, inlining and
+// superinstructions.
+void BM_StackVMFibShipped(benchmark::State& state) {
+  runStackVM(state, fibScript(state.range(0)), fibExpected(state.range(0)),
+             false, shippedPipeline());
+}
+BENCHMARK(BM_StackVMFibShipped)->Arg(10)->Arg(20);
+
+void BM_StackVMArithmeticShipped(benchmark::State& state) {
+  runStackVM(state, arithmeticScript(loop_depth), std::nullopt, false,
+             shippedPipeline());
+}
+BENCHMARK(BM_StackVMArithmeticShipped);
+
+void BM_StackVMBranchShipped(benchmark::State& state) {
+  runStackVM(state, branchScript(loop_depth), std::nullopt, false,
+             shippedPipeline());
+}
+BENCHMARK(BM_StackVMBranchShipped);
+
+void BM_StackVMCallShipped(benchmark::State& state) {
+  runStackVM(state, callScript(loop_depth), std::nullopt, false,
+             shippedPipeline());
+}
+BENCHMARK(BM_StackVMCallShipped);
+
+void BM_JITFib(benchmark::State& state) {
+  runStackVM(state, fibScript(state.range(0)), fibExpected(state.range(0)),
+             true);
+}
+BENCHMARK(BM_JITFib)->Arg(10)->Arg(20)->Arg(25);
+
+void BM_JITFibShipped(benchmark::State& state) {
+  runStackVM(state, fibScript(state.range(0)), fibExpected(state.range(0)),
+             true, shippedPipeline());
+}
+BENCHMARK(BM_JITFibShipped)->Arg(10)->Arg(20)->Arg(25);
+
+void BM_JITArithmetic(benchmark::State& state) {
+  runStackVM(state, arithmeticScript(loop_depth), std::nullopt, true);
+}
+BENCHMARK(BM_JITArithmetic);
+
+void BM_JITBranch(benchmark::State& state) {
+  runStackVM(state, branchScript(loop_depth), std::nullopt, true);
+}
+BENCHMARK(BM_JITBranch);
+
+void BM_JITCall(benchmark::State& state) {
+  runStackVM(state, callScript(loop_depth), std::nullopt, true);
+}
+BENCHMARK(BM_JITCall);
+
+// Same fibonacci on the register VM for comparison.
+void BM_RegisterVMFib(benchmark::State& state) {
+  StartearVMInstructionEmitter emitter;
+  RegisterProgram program;
+  if (!program.lower(compile(fibScript(state.range(0)), emitter))) {
+    state.SkipWithError("failed to lower");
+    return;
+  }
+  std::optional<double> expected = fibExpected(state.range(0));
+  AllocationCounter allocations;
+  for (auto _ : state) {
+    RegisterVM vm(program, bench_stack_size);
+    vm.start();
+    if (expected) {
+      auto r = vm.peekLocalVariable("r");
+      if (!r || r->getDouble() != expected) {
+        state.SkipWithError("unexpected result");
+        break;
+      }
+      expected.reset();
+    }
+  }
+  allocations.report(state);
+}
+BENCHMARK(BM_RegisterVMFib)->Arg(10)->Arg(20);
+}  // namespace
+}  // namespace Startear
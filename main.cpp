@@ -1,23 +1,79 @@
 #include <iostream>
 #include <fstream>
+#include <optional>
 #include <vector>
 
+#include "ast.h"
+#include "bytecode_file.h"
+#include "parser.h"
 #include "startear_assert.h"
 #include "tokenizer.h"
+#include "vm_impl.h"
 
-void run(const std::string& code) {
-    Unimplemented();
+// Parser pulls tokens from the tokenizer while the script is being read.
+std::optional<Startear::Program> compile(Startear::Tokenizer& tokenizer) {
+    Startear::Parser parser(tokenizer);
+    auto ast = parser.parse();
+    if (!ast) {
+        return std::nullopt;
+    }
+    Startear::ConstantFoldingVisitor folder;
+    ast->accept(folder);
+    Startear::StartearVMInstructionEmitter emitter;
+    ast->accept(emitter);
+    // Scripts are written as small helper functions. Superinstructions are
+    // fused after they are inlined.
+    const auto& program = emitter.emit(true, Startear::InlineOptions());
+    // Undefined names have been reported by the linker.
+    if (!program.linked()) {
+        return std::nullopt;
+    }
+    return program;
+}
+
+void execute(Startear::Program& program) {
+    Startear::VMImpl vm(program);
+    vm.start();
+}
+
+// Compiled bytecode is cached next to the script, e.g. fib.st -> fib.stbc.
+std::string cachePath(const std::string& fileName) {
+    const std::string extension = ".st";
+    if (fileName.size() > extension.size() &&
+        fileName.compare(fileName.size() - extension.size(), extension.size(), extension) == 0) {
+        return fileName + "bc";
+    }
+    return fileName + ".stbc";
 }
 
 void runFile(const std::string& fileName) {
-    std::ifstream ifs(fileName);
-    if (!ifs) {
-        std::cerr << "Failed to open " << fileName << std::endl;
+    // "-" reads the script from standard input, e.g. pipe.
+    if (fileName == "-") {
+        Startear::Tokenizer tokenizer(std::cin);
+        if (auto program = compile(tokenizer)) {
+            execute(*program);
+        }
+        return;
+    }
+    // The script is mapped, so that it is hashed and tokenized without copy.
+    auto tokenizer = Startear::Tokenizer::fromFile(fileName);
+    if (!tokenizer) {
+        return;
+    }
+    // Skip the front end while the script is unchanged.
+    auto hash = Startear::BytecodeFile::hashSource(*tokenizer->source());
+    auto cache = cachePath(fileName);
+    if (auto program = Startear::BytecodeFile::load(cache, hash)) {
+        execute(*program);
+        return;
+    }
+    auto program = compile(*tokenizer);
+    if (!program) {
         return;
     }
-    std::string code;
-    ifs >> code;
-    run(code);
+    // Failure to write the cache is not fatal, e.g. read-only directory.
+    Startear::BytecodeFile::write(*program, hash, cache);
+    execute(*program);
 }
 
 void startRepl() {
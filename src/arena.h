@@ -0,0 +1,118 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_ARENA_H
+#define STARTEAR_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "startear_assert.h"
+
+namespace Startear {
+
+// Deleter of objects on Arena. It releases nothing, since the arena destroys
+// all of its objects at once.
+struct ArenaDelete {
+  template <class T>
+  void operator()(T*) const {}
+};
+
+template <class T>
+using ArenaPtr = std::unique_ptr<T, ArenaDelete>;
+
+// Bump allocator which places objects in a few contiguous blocks. Objects are
+// destroyed in reverse order of construction when the arena is destroyed.
+class Arena {
+ public:
+  static constexpr size_t default_block_size = 1 << 16;
+
+  explicit Arena(size_t block_size = default_block_size)
+      : block_size_(block_size) {}
+  ~Arena() {
+    for (auto* finalizer = finalizers_; finalizer != nullptr;
+         finalizer = finalizer->next_) {
+      finalizer->destroy_(finalizer->object_);
+    }
+  }
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  template <class T, class... Args>
+  ArenaPtr<T> make(Args&&... args) {
+    auto* object = new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      // Finalizers are linked on the arena itself, not to allocate elsewhere.
+      auto* finalizer = new (allocate(sizeof(Finalizer), alignof(Finalizer)))
+          Finalizer{[](void* p) { static_cast<T*>(p)->~T(); }, object,
+                    finalizers_};
+      finalizers_ = finalizer;
+    }
+    return ArenaPtr<T>(object);
+  }
+
+  void* allocate(size_t size, size_t align) {
+    STARTEAR_ASSERT(align <= alignof(std::max_align_t));
+    auto offset = (used_ + align - 1) & ~(align - 1);
+    if (blocks_.empty() || offset + size > capacity_) {
+      // Large objects get a dedicated block.
+      capacity_ = std::max(block_size_, size);
+      blocks_.emplace_back(new std::byte[capacity_]);
+      offset = 0;
+    }
+    used_ = offset + size;
+    allocated_ += size;
+    return blocks_.back().get() + offset;
+  }
+
+  size_t blockCount() const { return blocks_.size(); }
+  // Total bytes of objects, excluding padding and unused tail of blocks.
+  size_t allocatedBytes() const { return allocated_; }
+
+ private:
+  struct Finalizer {
+    void (*destroy_)(void*);
+    void* object_;
+    Finalizer* next_;
+  };
+
+  size_t block_size_;
+  std::vector<std::unique_ptr<std::byte[]>> blocks_;
+  // Bytes used and capacity of the last block.
+  size_t used_{0};
+  size_t capacity_{0};
+  size_t allocated_{0};
+  Finalizer* finalizers_{nullptr};
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_ARENA_H
@@ -25,10 +25,149 @@
 
 #include "ast.h"
 
+#include <charconv>
+
 #include "fmt/format.h"
 
 namespace Startear {
 
+namespace {
+double toNumber(std::string_view lexeme) {
+  double number = 0;
+  auto result =
+      std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), number);
+  STARTEAR_ASSERT(result.ec == std::errc());
+  return number;
+}
+
+std::optional<double> evaluate(OPCode op, double lhs, double rhs) {
+  switch (op) {
+    case OPCode::OP_ADD:
+      return lhs + rhs;
+    case OPCode::OP_SUB:
+      return lhs - rhs;
+    case OPCode::OP_MUL:
+      return lhs * rhs;
+    case OPCode::OP_DIV:
+      return lhs / rhs;
+    case OPCode::OP_EQUAL:
+      return lhs == rhs;
+    case OPCode::OP_BANG_EQUAL:
+      return lhs != rhs;
+    case OPCode::OP_LESS_EQUAL:
+      return lhs <= rhs;
+    case OPCode::OP_GREATER_EQUAL:
+      return lhs >= rhs;
+    case OPCode::OP_LESS:
+      return lhs < rhs;
+    case OPCode::OP_GREATER:
+      return lhs > rhs;
+    case OPCode::OP_AND:
+    case OPCode::OP_OR:
+      // VM rejects logical operation on non boolean left operand. Leave it to
+      // the runtime to report that. Right operand is the result as is unless
+      // the left one decides it.
+      if (lhs != 0 && lhs != 1) {
+        return std::nullopt;
+      }
+      if (op == OPCode::OP_AND) {
+        return lhs == 0 ? 0 : rhs;
+      }
+      return lhs == 1 ? 1 : rhs;
+    default:
+      return std::nullopt;
+  }
+}
+}  // namespace
+
+std::optional<double> ASTNode::foldBinary(OPCode op, ASTNode& lhs,
+                                          ASTNode& rhs) {
+  auto l = lhs.fold();
+  auto r = rhs.fold();
+  if (l.has_value() && r.has_value()) {
+    constant_ = evaluate(op, *l, *r);
+    return constant_;
+  }
+  // Expressions don't have any side effect, so that the operand can be
+  // dropped safely. The kept operand must be arithmetic, otherwise the runtime
+  // check that it is a number would be dropped, e.g. `s * 1` for nil s.
+  // x + 0 is not simplified, because -0 + 0 is +0.
+  switch (op) {
+    case OPCode::OP_ADD:
+    case OPCode::OP_SUB:
+    case OPCode::OP_MUL:
+    case OPCode::OP_DIV:
+      arithmetic_ = true;
+      break;
+    default:
+      break;
+  }
+  switch (op) {
+    case OPCode::OP_SUB:
+      // x - x is not folded into 0, because it is NaN if x is infinite.
+      if (r == 0.0 && lhs.arithmetic_) {
+        simplified_ = &lhs;
+      }
+      break;
+    case OPCode::OP_MUL:
+      if (l == 1.0 && rhs.arithmetic_) {
+        simplified_ = &rhs;
+      } else if (r == 1.0 && lhs.arithmetic_) {
+        simplified_ = &lhs;
+      }
+      break;
+    case OPCode::OP_DIV:
+      if (r == 1.0 && lhs.arithmetic_) {
+        simplified_ = &lhs;
+      }
+      break;
+    // Only the left operand decides the result. Otherwise, the runtime check
+    // that it is boolean would be dropped, e.g. `x && 0`.
+    case OPCode::OP_AND:
+      if (l == 0.0) {
+        constant_ = 0;
+      }
+      break;
+    case OPCode::OP_OR:
+      if (l == 1.0) {
+        constant_ = 1;
+      }
+      break;
+    default:
+      break;
+  }
+  return constant_;
+}
+
+std::optional<double> ASTNode::foldWrapped(ASTNode& operand) {
+  constant_ = operand.fold();
+  arithmetic_ = operand.arithmetic_;
+  return constant_;
+}
+
+std::optional<FlatAST::NodeIndex> ASTNode::flattenFolded(FlatAST& ast) {
+  if (constant_.has_value()) {
+    return ast.addNumber(*constant_);
+  }
+  if (simplified_ != nullptr) {
+    return simplified_->flatten(ast);
+  }
+  return std::nullopt;
+}
+
+bool ASTNode::selfFolded(Program& program) {
+  if (constant_.has_value()) {
+    program.addInst(OPCode::OP_PUSH,
+                    {std::make_pair(Value::Category::Literal, *constant_)});
+    return true;
+  }
+  if (simplified_ != nullptr) {
+    simplified_->self(program);
+    return true;
+  }
+  return false;
+}
+
 std::string PrimaryExpression::toString() {
   if (expr_ != nullptr) {
     return fmt::format("{}", expr_->toString());
@@ -49,11 +188,10 @@ void PrimaryExpression::self(Program& program) {
     if (token_->type() == TokenType::NUMBER) {
       program.addInst(OPCode::OP_PUSH,
                       {std::make_pair(Value::Category::Literal,
-                                      std::stod(token_->lexeme()))});
+                                      toNumber(token_->lexeme()))});
     } else if (token_->type() == TokenType::IDENTIFIER) {
-      program.addInst(
-          OPCode::OP_LOAD_LOCAL,
-          {std::make_pair(Value::Category::Variable, token_->lexeme())});
+      program.addInst(OPCode::OP_LOAD_SLOT,
+                      {program.findLocalSlot(token_->lexeme())});
     } else {
       NOT_REACHED;
     }
@@ -62,6 +200,30 @@ void PrimaryExpression::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex PrimaryExpression::flatten(FlatAST& ast) {
+  if (expr_ != nullptr) {
+    return static_cast<ASTNode*>(expr_.get())->flatten(ast);
+  }
+  STARTEAR_ASSERT(token_ != nullptr);
+  if (token_->type() == TokenType::NUMBER) {
+    return ast.addNumber(toNumber(token_->lexeme()));
+  } else if (token_->type() == TokenType::IDENTIFIER) {
+    return ast.addNode(FlatAST::Kind::Identifier,
+                       ast.internName(token_->lexeme()));
+  }
+  NOT_REACHED;
+}
+
+std::optional<double> PrimaryExpression::fold() {
+  if (expr_ != nullptr) {
+    return foldWrapped(*expr_);
+  }
+  if (token_ != nullptr && token_->type() == TokenType::NUMBER) {
+    return toNumber(token_->lexeme());
+  }
+  return std::nullopt;
+}
+
 void UnaryExpression::accept(IASTNodeVisitor& visitor) { visitor.visit(*this); }
 
 std::string UnaryExpression::toString() {
@@ -75,6 +237,9 @@ std::string UnaryExpression::toString() {
 }
 
 void UnaryExpression::self(Program& program) {
+  if (selfFolded(program)) {
+    return;
+  }
   if (primary_expr_ != nullptr) {
     static_cast<ASTNode*>(primary_expr_.get())->self(program);
   } else if (unary_expr_ != nullptr && !token_->lexeme().empty()) {
@@ -84,6 +249,29 @@ void UnaryExpression::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex UnaryExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
+  }
+  if (primary_expr_ != nullptr) {
+    return static_cast<ASTNode*>(primary_expr_.get())->flatten(ast);
+  }
+  STARTEAR_ASSERT(unary_expr_ != nullptr && !token_->lexeme().empty());
+  auto operand = static_cast<ASTNode*>(unary_expr_.get())->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Unary,
+                     static_cast<uint32_t>(token_->type()), {operand});
+}
+
+std::optional<double> UnaryExpression::fold() {
+  if (primary_expr_ != nullptr) {
+    return foldWrapped(*primary_expr_);
+  }
+  // Negation and not are emitted as the operand itself for now, so that
+  // folding them would change the result. Only the operand is folded.
+  static_cast<ASTNode*>(unary_expr_.get())->fold();
+  return std::nullopt;
+}
+
 std::string MultiplicationExpression::toString() {
   if (unary_left_expr_ != nullptr && right_expr_ != nullptr) {
     return fmt::format("({} {} {})", token_->lexeme(),
@@ -104,12 +292,17 @@ void MultiplicationExpression::accept(IASTNodeVisitor& visitor) {
 }
 
 void MultiplicationExpression::self(Program& program) {
+  if (selfFolded(program)) {
+    return;
+  }
   if (unary_left_expr_ != nullptr && right_expr_ != nullptr) {
     static_cast<ASTNode*>(unary_left_expr_.get())->self(program);
     static_cast<ASTNode*>(right_expr_.get())->self(program);
+    program.addInst(opcodeFromToken(token_->type()));
   } else if (mul_left_expr_ != nullptr && right_expr_ != nullptr) {
     static_cast<ASTNode*>(mul_left_expr_.get())->self(program);
     static_cast<ASTNode*>(right_expr_.get())->self(program);
+    program.addInst(opcodeFromToken(token_->type()));
   } else if (unary_left_expr_ != nullptr) {
     static_cast<ASTNode*>(unary_left_expr_.get())->self(program);
   } else {
@@ -117,6 +310,34 @@ void MultiplicationExpression::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex MultiplicationExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
+  }
+  ASTNode* lhs = unary_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(unary_left_expr_.get())
+                     : static_cast<ASTNode*>(mul_left_expr_.get());
+  STARTEAR_ASSERT(lhs != nullptr);
+  if (right_expr_ == nullptr) {
+    return lhs->flatten(ast);
+  }
+  auto left = lhs->flatten(ast);
+  auto right = static_cast<ASTNode*>(right_expr_.get())->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Binary,
+                     static_cast<uint32_t>(opcodeFromToken(token_->type())),
+                     {left, right});
+}
+
+std::optional<double> MultiplicationExpression::fold() {
+  if (right_expr_ == nullptr) {
+    return foldWrapped(*unary_left_expr_);
+  }
+  ASTNode* lhs = unary_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(unary_left_expr_.get())
+                     : static_cast<ASTNode*>(mul_left_expr_.get());
+  return foldBinary(opcodeFromToken(token_->type()), *lhs, *right_expr_);
+}
+
 std::string AdditionExpression::toString() {
   if (add_left_expr_ != nullptr && right_expr_ != nullptr) {
     return fmt::format("({} {} {})", token_->lexeme(),
@@ -137,6 +358,9 @@ void AdditionExpression::accept(IASTNodeVisitor& visitor) {
 }
 
 void AdditionExpression::self(Program& program) {
+  if (selfFolded(program)) {
+    return;
+  }
   if (add_left_expr_ != nullptr && right_expr_ != nullptr) {
     static_cast<ASTNode*>(add_left_expr_.get())->self(program);
     static_cast<ASTNode*>(right_expr_.get())->self(program);
@@ -152,6 +376,34 @@ void AdditionExpression::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex AdditionExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
+  }
+  ASTNode* lhs = add_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(add_left_expr_.get())
+                     : static_cast<ASTNode*>(mul_left_expr_.get());
+  STARTEAR_ASSERT(lhs != nullptr);
+  if (right_expr_ == nullptr) {
+    return lhs->flatten(ast);
+  }
+  auto left = lhs->flatten(ast);
+  auto right = static_cast<ASTNode*>(right_expr_.get())->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Binary,
+                     static_cast<uint32_t>(opcodeFromToken(token_->type())),
+                     {left, right});
+}
+
+std::optional<double> AdditionExpression::fold() {
+  if (right_expr_ == nullptr) {
+    return foldWrapped(*mul_left_expr_);
+  }
+  ASTNode* lhs = add_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(add_left_expr_.get())
+                     : static_cast<ASTNode*>(mul_left_expr_.get());
+  return foldBinary(opcodeFromToken(token_->type()), *lhs, *right_expr_);
+}
+
 std::string ComparisonExpression::toString() {
   if (cmp_left_expr_ != nullptr && right_expr_ != nullptr) {
     return fmt::format("({} {} {})", token_->lexeme(),
@@ -172,6 +424,9 @@ void ComparisonExpression::accept(IASTNodeVisitor& visitor) {
 }
 
 void ComparisonExpression::self(Program& program) {
+  if (selfFolded(program)) {
+    return;
+  }
   if (cmp_left_expr_ != nullptr && right_expr_ != nullptr) {
     static_cast<ASTNode*>(cmp_left_expr_.get())->self(program);
     static_cast<ASTNode*>(right_expr_.get())->self(program);
@@ -188,6 +443,34 @@ void ComparisonExpression::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex ComparisonExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
+  }
+  ASTNode* lhs = cmp_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(cmp_left_expr_.get())
+                     : static_cast<ASTNode*>(add_left_expr_.get());
+  STARTEAR_ASSERT(lhs != nullptr);
+  if (right_expr_ == nullptr) {
+    return lhs->flatten(ast);
+  }
+  auto left = lhs->flatten(ast);
+  auto right = static_cast<ASTNode*>(right_expr_.get())->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Binary,
+                     static_cast<uint32_t>(opcodeFromToken(token_->type())),
+                     {left, right});
+}
+
+std::optional<double> ComparisonExpression::fold() {
+  if (right_expr_ == nullptr) {
+    return foldWrapped(*add_left_expr_);
+  }
+  ASTNode* lhs = cmp_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(cmp_left_expr_.get())
+                     : static_cast<ASTNode*>(add_left_expr_.get());
+  return foldBinary(opcodeFromToken(token_->type()), *lhs, *right_expr_);
+}
+
 std::string EqualityExpression::toString() {
   if (eql_left_expr_ != nullptr && right_expr_ != nullptr) {
     return fmt::format("({} {} {})", token_->lexeme(),
@@ -208,6 +491,9 @@ void EqualityExpression::accept(IASTNodeVisitor& visitor) {
 }
 
 void EqualityExpression::self(Program& program) {
+  if (selfFolded(program)) {
+    return;
+  }
   if (eql_left_expr_ != nullptr && right_expr_ != nullptr) {
     static_cast<ASTNode*>(eql_left_expr_.get())->self(program);
     static_cast<ASTNode*>(right_expr_.get())->self(program);
@@ -224,21 +510,82 @@ void EqualityExpression::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex EqualityExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
+  }
+  ASTNode* lhs = eql_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(eql_left_expr_.get())
+                     : static_cast<ASTNode*>(cmp_left_expr_.get());
+  STARTEAR_ASSERT(lhs != nullptr);
+  if (right_expr_ == nullptr) {
+    return lhs->flatten(ast);
+  }
+  auto left = lhs->flatten(ast);
+  auto right = static_cast<ASTNode*>(right_expr_.get())->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Binary,
+                     static_cast<uint32_t>(opcodeFromToken(token_->type())),
+                     {left, right});
+}
+
+std::optional<double> EqualityExpression::fold() {
+  if (right_expr_ == nullptr) {
+    return foldWrapped(*cmp_left_expr_);
+  }
+  ASTNode* lhs = eql_left_expr_ != nullptr
+                     ? static_cast<ASTNode*>(eql_left_expr_.get())
+                     : static_cast<ASTNode*>(cmp_left_expr_.get());
+  return foldBinary(opcodeFromToken(token_->type()), *lhs, *right_expr_);
+}
+
 void AndLogicExpression::self(Program& program) {
-  if (eql_left_expr_ != nullptr && eql_right_expr_ != nullptr) {
-    static_cast<ASTNode*>(eql_left_expr_.get())->self(program);
-    static_cast<ASTNode*>(eql_right_expr_.get())->self(program);
-  } else if (eql_left_expr_ != nullptr && and_logic_right_expr_ != nullptr) {
-    static_cast<ASTNode*>(eql_left_expr_.get())->self(program);
-    static_cast<ASTNode*>(and_logic_right_expr_.get())->self(program);
-  } else if (eql_left_expr_ != nullptr) {
-    static_cast<ASTNode*>(eql_left_expr_.get())->self(program);
-  } else {
+  if (selfFolded(program)) {
+    return;
+  }
+  if (eql_left_expr_ == nullptr) {
     NOT_REACHED;
   }
-  if (token_ != nullptr) {
-    program.addInst(OPCode::OP_AND);
+  static_cast<ASTNode*>(eql_left_expr_.get())->self(program);
+  ASTNode* rhs = eql_right_expr_ != nullptr
+                     ? static_cast<ASTNode*>(eql_right_expr_.get())
+                     : static_cast<ASTNode*>(and_logic_right_expr_.get());
+  if (token_ == nullptr || rhs == nullptr) {
+    return;
+  }
+  // Right operand is skipped if the left one is false.
+  auto label_end = program.getIndexedLabel();
+  program.addInst(OPCode::OP_JUMP_IF_FALSE_OR_POP,
+                  {std::make_pair(Value::Category::Literal, label_end)});
+  rhs->self(program);
+  program.addLabel(label_end);
+}
+
+FlatAST::NodeIndex AndLogicExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
   }
+  STARTEAR_ASSERT(eql_left_expr_ != nullptr);
+  auto left = static_cast<ASTNode*>(eql_left_expr_.get())->flatten(ast);
+  ASTNode* rhs = eql_right_expr_ != nullptr
+                     ? static_cast<ASTNode*>(eql_right_expr_.get())
+                     : static_cast<ASTNode*>(and_logic_right_expr_.get());
+  if (rhs == nullptr) {
+    return left;
+  }
+  auto right = rhs->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Binary,
+                     static_cast<uint32_t>(OPCode::OP_AND), {left, right});
+}
+
+std::optional<double> AndLogicExpression::fold() {
+  auto* lhs = static_cast<ASTNode*>(eql_left_expr_.get());
+  ASTNode* rhs = eql_right_expr_ != nullptr
+                     ? static_cast<ASTNode*>(eql_right_expr_.get())
+                     : static_cast<ASTNode*>(and_logic_right_expr_.get());
+  if (token_ == nullptr || rhs == nullptr) {
+    return foldWrapped(*lhs);
+  }
+  return foldBinary(OPCode::OP_AND, *lhs, *rhs);
 }
 
 std::string AndLogicExpression::toString() {
@@ -263,20 +610,56 @@ void AndLogicExpression::accept(IASTNodeVisitor& visitor) {
 }
 
 void OrLogicExpression::self(Program& program) {
-  if (and_logic_left_expr_ != nullptr && and_logic_right_expr_ != nullptr) {
-    static_cast<ASTNode*>(and_logic_left_expr_.get())->self(program);
-    static_cast<ASTNode*>(and_logic_right_expr_.get())->self(program);
-  } else if (and_logic_left_expr_ != nullptr && or_logic_expr_ != nullptr) {
-    static_cast<ASTNode*>(and_logic_left_expr_.get())->self(program);
-    static_cast<ASTNode*>(or_logic_expr_.get())->self(program);
-  } else if (and_logic_left_expr_ != nullptr) {
-    static_cast<ASTNode*>(and_logic_left_expr_.get())->self(program);
-  } else {
+  if (selfFolded(program)) {
+    return;
+  }
+  if (and_logic_left_expr_ == nullptr) {
     NOT_REACHED;
   }
-  if (token_ != nullptr) {
-    program.addInst(OPCode::OP_OR);
+  static_cast<ASTNode*>(and_logic_left_expr_.get())->self(program);
+  ASTNode* rhs = and_logic_right_expr_ != nullptr
+                     ? static_cast<ASTNode*>(and_logic_right_expr_.get())
+                     : static_cast<ASTNode*>(or_logic_expr_.get());
+  if (token_ == nullptr || rhs == nullptr) {
+    return;
+  }
+  // Right operand is skipped if the left one is true.
+  auto label_end = program.getIndexedLabel();
+  program.addInst(OPCode::OP_JUMP_IF_TRUE_OR_POP,
+                  {std::make_pair(Value::Category::Literal, label_end)});
+  rhs->self(program);
+  program.addLabel(label_end);
+}
+
+FlatAST::NodeIndex OrLogicExpression::flatten(FlatAST& ast) {
+  if (auto folded = flattenFolded(ast)) {
+    return *folded;
+  }
+  STARTEAR_ASSERT(and_logic_left_expr_ != nullptr);
+  auto left = static_cast<ASTNode*>(and_logic_left_expr_.get())->flatten(ast);
+  ASTNode* rhs = and_logic_right_expr_ != nullptr
+                     ? static_cast<ASTNode*>(and_logic_right_expr_.get())
+                     : static_cast<ASTNode*>(or_logic_expr_.get());
+  if (rhs == nullptr) {
+    return left;
+  }
+  auto right = rhs->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Binary,
+                     static_cast<uint32_t>(OPCode::OP_OR), {left, right});
+}
+
+std::optional<double> OrLogicExpression::fold() {
+  auto* lhs = static_cast<ASTNode*>(and_logic_left_expr_.get());
+  ASTNode* rhs = and_logic_right_expr_ != nullptr
+                     ? static_cast<ASTNode*>(and_logic_right_expr_.get())
+                     : static_cast<ASTNode*>(or_logic_expr_.get());
+  if (lhs == nullptr) {
+    return std::nullopt;
+  }
+  if (token_ == nullptr || rhs == nullptr) {
+    return foldWrapped(*lhs);
   }
+  return foldBinary(OPCode::OP_OR, *lhs, *rhs);
 }
 
 std::string OrLogicExpression::toString() {
@@ -308,6 +691,12 @@ void BasicExpression::self(Program& program) {
   static_cast<ASTNode*>(expr_.get())->self(program);
 }
 
+FlatAST::NodeIndex BasicExpression::flatten(FlatAST& ast) {
+  return static_cast<ASTNode*>(expr_.get())->flatten(ast);
+}
+
+std::optional<double> BasicExpression::fold() { return foldWrapped(*expr_); }
+
 std::string LetStatement::toString() {
   if (basic_expr_ != nullptr) {
     return fmt::format("{} -> {}", token_->lexeme(), basic_expr_->toString());
@@ -325,8 +714,25 @@ void LetStatement::self(Program& program) {
   } else if (func_call_ != nullptr) {
     static_cast<ASTNode*>(func_call_.get())->self(program);
   }
-  program.addInst(OPCode::OP_STORE_LOCAL,
-                  {std::make_pair(Value::Category::Literal, token_->lexeme())});
+  program.addInst(OPCode::OP_STORE_SLOT,
+                  {program.resolveLocalSlot(token_->lexeme())});
+}
+
+FlatAST::NodeIndex LetStatement::flatten(FlatAST& ast) {
+  auto value = basic_expr_ != nullptr
+                   ? static_cast<ASTNode*>(basic_expr_.get())->flatten(ast)
+                   : static_cast<ASTNode*>(func_call_.get())->flatten(ast);
+  return ast.addNode(FlatAST::Kind::Let, ast.internName(token_->lexeme()),
+                     {value});
+}
+
+std::optional<double> LetStatement::fold() {
+  if (basic_expr_ != nullptr) {
+    static_cast<ASTNode*>(basic_expr_.get())->fold();
+  } else if (func_call_ != nullptr) {
+    static_cast<ASTNode*>(func_call_.get())->fold();
+  }
+  return std::nullopt;
 }
 
 void FunctionCall::accept(IASTNodeVisitor& visitor) { visitor.visit(*this); }
@@ -339,6 +745,22 @@ void FunctionCall::self(Program& program) {
                                                    token_->lexeme())});
 }
 
+FlatAST::NodeIndex FunctionCall::flatten(FlatAST& ast) {
+  std::vector<FlatAST::NodeIndex> args;
+  for (const auto& stmt : statements_) {
+    args.emplace_back(static_cast<ASTNode*>(stmt.get())->flatten(ast));
+  }
+  return ast.addNode(FlatAST::Kind::Call, ast.internName(token_->lexeme()),
+                     args);
+}
+
+std::optional<double> FunctionCall::fold() {
+  for (const auto& stmt : statements_) {
+    static_cast<ASTNode*>(stmt.get())->fold();
+  }
+  return std::nullopt;
+}
+
 std::string FunctionCall::toString() {
   std::string str;
   str += fmt::format("{} (", token_->lexeme());
@@ -355,21 +777,39 @@ void FunctionDeclaration::accept(IASTNodeVisitor& visitor) {
 }
 
 void FunctionDeclaration::self(Program& program) {
-  std::vector<size_t> argname_ptrs;
+  std::vector<std::string> arg_names;
   for (const auto& arg : args_) {
-    Value v(Value::Category::Variable, arg->lexeme());
-    const auto v_ptr = program.addValue(v);
-    argname_ptrs.emplace_back(v_ptr);
+    arg_names.emplace_back(arg->lexeme());
   }
-  program.addFunction(name_->lexeme(), argname_ptrs);
-  // Just to add return instruction when there is no statement in this function.
-  if (statements_.size() == 0) {
+  program.addFunction(std::string(name_->lexeme()), arg_names);
+  for (const auto& stmt : statements_) {
+    static_cast<ASTNode*>(stmt.get())->self(program);
+  }
+  // Execution must not fall through into the code placed after this function.
+  if (statements_.empty() ||
+      !dynamic_cast<ReturnDeclaration*>(statements_.back().get())) {
     program.addInst(OPCode::OP_RETURN);
-    return;
+  }
+}
+
+FlatAST::NodeIndex FunctionDeclaration::flatten(FlatAST& ast) {
+  std::vector<FlatAST::NodeIndex> children;
+  for (const auto& arg : args_) {
+    children.emplace_back(
+        ast.addNode(FlatAST::Kind::Param, ast.internName(arg->lexeme())));
   }
   for (const auto& stmt : statements_) {
-    static_cast<ASTNode*>(stmt.get())->self(program);
+    children.emplace_back(stmt->flatten(ast));
   }
+  return ast.addNode(FlatAST::Kind::Function,
+                     ast.internName(name_->lexeme()), children);
+}
+
+std::optional<double> FunctionDeclaration::fold() {
+  for (const auto& stmt : statements_) {
+    stmt->fold();
+  }
+  return std::nullopt;
 }
 
 std::string FunctionDeclaration::toString() {
@@ -378,7 +818,8 @@ std::string FunctionDeclaration::toString() {
     if (i == args_.size() - 1) {
       func_name += args_[i]->lexeme();
     } else {
-      func_name += args_[i]->lexeme() + ", ";
+      func_name += args_[i]->lexeme();
+      func_name += ", ";
     }
   }
   func_name += ") ->\n";
@@ -401,15 +842,27 @@ void ReturnDeclaration::self(Program& program) {
     program.addInst(
         OPCode::OP_PUSH,
         {std::make_pair(Value::Category::Literal,
-                        std::stod(std::get<PrimaryPtr>(token_)->lexeme()))});
+                        toNumber(std::get<PrimaryPtr>(token_)->lexeme()))});
   } else if (std::holds_alternative<NormalPtr>(token_)) {  // Identifier
-    program.addInst(OPCode::OP_LOAD_LOCAL,
-                    {std::make_pair(Value::Category::Variable,
-                                    std::get<NormalPtr>(token_)->lexeme())});
+    program.addInst(
+        OPCode::OP_LOAD_SLOT,
+        {program.findLocalSlot(std::get<NormalPtr>(token_)->lexeme())});
   }
   program.addInst(OPCode::OP_RETURN);
 }
 
+FlatAST::NodeIndex ReturnDeclaration::flatten(FlatAST& ast) {
+  FlatAST::NodeIndex value;
+  if (std::holds_alternative<PrimaryPtr>(token_)) {  // Number
+    value = ast.addNumber(toNumber(std::get<PrimaryPtr>(token_)->lexeme()));
+  } else {  // Identifier
+    value = ast.addNode(
+        FlatAST::Kind::Identifier,
+        ast.internName(std::get<NormalPtr>(token_)->lexeme()));
+  }
+  return ast.addNode(FlatAST::Kind::Return, 0, {value});
+}
+
 std::string ReturnDeclaration::toString() {
   return std::visit(
       [](auto& token) -> std::string {
@@ -421,6 +874,15 @@ std::string ReturnDeclaration::toString() {
 void IfStatement::accept(IASTNodeVisitor& visitor) { visitor.visit(*this); }
 
 void IfStatement::self(Program& program) {
+  // Constant condition doesn't require any branch.
+  if (constant_.has_value()) {
+    if (*constant_ != 0) {
+      for (const auto& stmt : statements_) {
+        static_cast<ASTNode*>(stmt.get())->self(program);
+      }
+    }
+    return;
+  }
   static_cast<ASTNode*>(eql_expr_.get())->self(program);
   std::string label_if_entry = program.getIndexedLabel();
   std::string label_not_if_entry = program.getIndexedLabel();
@@ -437,6 +899,32 @@ void IfStatement::self(Program& program) {
   program.addLabel(label_not_if_entry);
 }
 
+FlatAST::NodeIndex IfStatement::flatten(FlatAST& ast) {
+  std::vector<FlatAST::NodeIndex> children;
+  // Constant condition is flattened into block without branch.
+  if (constant_.has_value()) {
+    if (*constant_ != 0) {
+      for (const auto& stmt : statements_) {
+        children.emplace_back(stmt->flatten(ast));
+      }
+    }
+    return ast.addNode(FlatAST::Kind::Block, 0, children);
+  }
+  children.emplace_back(static_cast<ASTNode*>(eql_expr_.get())->flatten(ast));
+  for (const auto& stmt : statements_) {
+    children.emplace_back(stmt->flatten(ast));
+  }
+  return ast.addNode(FlatAST::Kind::If, 0, children);
+}
+
+std::optional<double> IfStatement::fold() {
+  constant_ = static_cast<ASTNode*>(eql_expr_.get())->fold();
+  for (const auto& stmt : statements_) {
+    stmt->fold();
+  }
+  return std::nullopt;
+}
+
 std::string IfStatement::toString() {
   std::string program;
   program += fmt::format("if ({})\n", eql_expr_->toString());
@@ -463,6 +951,33 @@ void ProgramDeclaration::self(Program& program) {
   }
 }
 
+FlatAST::NodeIndex ProgramDeclaration::flatten(FlatAST& ast) {
+  std::vector<FlatAST::NodeIndex> children;
+  for (const auto& g_var : global_variable_) {
+    children.emplace_back(static_cast<ASTNode*>(g_var.get())->flatten(ast));
+  }
+  for (const auto& f : functions_) {
+    children.emplace_back(static_cast<ASTNode*>(f.get())->flatten(ast));
+  }
+  for (const auto& expr : expressions_) {
+    children.emplace_back(static_cast<ASTNode*>(expr.get())->flatten(ast));
+  }
+  return ast.addNode(FlatAST::Kind::Block, 0, children);
+}
+
+std::optional<double> ProgramDeclaration::fold() {
+  for (const auto& g_var : global_variable_) {
+    static_cast<ASTNode*>(g_var.get())->fold();
+  }
+  for (const auto& f : functions_) {
+    static_cast<ASTNode*>(f.get())->fold();
+  }
+  for (const auto& expr : expressions_) {
+    static_cast<ASTNode*>(expr.get())->fold();
+  }
+  return std::nullopt;
+}
+
 std::string ProgramDeclaration::toString() {
   std::string program;
   for (const auto& g_var : global_variable_) {
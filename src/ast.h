@@ -26,9 +26,12 @@
 #ifndef STARTEAR_ALL_AST_H
 #define STARTEAR_ALL_AST_H
 
+#include <optional>
 #include <queue>
 #include <variant>
 
+#include "arena.h"
+#include "flat_ast.h"
 #include "program.h"
 #include "tokenizer.h"
 
@@ -38,7 +41,7 @@ class IASTNodeVisitor;
 
 class ASTNode {
  public:
-  using ASTNodePtr = std::unique_ptr<ASTNode>;
+  using ASTNodePtr = ArenaPtr<ASTNode>;
 
   virtual ~ASTNode() = default;
 
@@ -48,6 +51,32 @@ class ASTNode {
   virtual void accept(IASTNodeVisitor& visitor) = 0;
 
   virtual std::string toString() = 0;
+
+  // Append this subtree to the flat representation, and return the index.
+  virtual FlatAST::NodeIndex flatten(FlatAST& ast) = 0;
+
+  // Fold constant subexpressions under this node. It returns the value if
+  // this node itself is evaluated to constant number.
+  virtual std::optional<double> fold() { return std::nullopt; }
+
+ protected:
+  // Fold binary expression, or simplify it into either of operands on
+  // identities like x * 1. Operands must be side-effect free.
+  std::optional<double> foldBinary(OPCode op, ASTNode& lhs, ASTNode& rhs);
+  // Fold the node which consists of only one operand, e.g. the addition
+  // without right operand.
+  std::optional<double> foldWrapped(ASTNode& operand);
+  // Emit the folded value or simplified operand instead of this node. It
+  // returns false if this node is not folded.
+  bool selfFolded(Program& program);
+  // Flattening counterpart of selfFolded.
+  std::optional<FlatAST::NodeIndex> flattenFolded(FlatAST& ast);
+
+  std::optional<double> constant_;
+  ASTNode* simplified_{nullptr};
+  // The value is always a number, e.g. a + b, whose operands are checked by
+  // VM. It is known after fold().
+  bool arithmetic_{false};
 };
 
 using ASTNodePtr = ASTNode::ASTNodePtr;
@@ -66,18 +95,37 @@ class ASTPrintVisitor : public IASTNodeVisitor {
   }
 };
 
+// Fold constant subexpressions and constant conditions of if statement. It
+// should visit the tree before the emitter.
+class ConstantFoldingVisitor : public IASTNodeVisitor {
+ public:
+  void visit(ASTNode& node) override { node.fold(); }
+};
+
 class StartearVMInstructionEmitter : public IASTNodeVisitor {
  public:
   void visit(ASTNode& node) override { node.self(program_); }
 
-  const Program& emit() { return program_; }
+  // Small functions are inlined if inlining is given, and superinstructions
+  // are fused before linking if fuse is true.
+  const Program& emit(bool fuse = false,
+                      std::optional<InlineOptions> inlining = std::nullopt) {
+    if (inlining.has_value() && !program_.linked()) {
+      program_.inlineFunctions(*inlining);
+    }
+    if (fuse && !program_.linked()) {
+      program_.fuseSuperinstructions();
+    }
+    program_.link();
+    return program_;
+  }
 
  private:
   Program program_;
 };
 
 class BasicExpression;
-using BasicExpressionPtr = std::unique_ptr<BasicExpression>;
+using BasicExpressionPtr = ArenaPtr<BasicExpression>;
 
 class PrimaryExpression : public ASTNode {
  public:
@@ -89,6 +137,8 @@ class PrimaryExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -96,11 +146,11 @@ class PrimaryExpression : public ASTNode {
   BasicExpressionPtr expr_;
 };
 
-using PrimaryExpressionPtr = std::unique_ptr<PrimaryExpression>;
+using PrimaryExpressionPtr = ArenaPtr<PrimaryExpression>;
 
 class UnaryExpression : public ASTNode {
  public:
-  using UnaryExpressionPtr = std::unique_ptr<UnaryExpression>;
+  using UnaryExpressionPtr = ArenaPtr<UnaryExpression>;
 
   UnaryExpression(UnaryPtr token, UnaryExpressionPtr expr)
       : token_(std::move(token)), unary_expr_(std::move(expr)) {}
@@ -109,6 +159,8 @@ class UnaryExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -121,7 +173,7 @@ using UnaryExpressionPtr = UnaryExpression::UnaryExpressionPtr;
 
 class MultiplicationExpression : public ASTNode {
  public:
-  using MultiplicationExpressionPtr = std::unique_ptr<MultiplicationExpression>;
+  using MultiplicationExpressionPtr = ArenaPtr<MultiplicationExpression>;
   MultiplicationExpression(UnaryExpressionPtr left_expr)
       : unary_left_expr_(std::move(left_expr)) {}
   MultiplicationExpression(MultiplicationPtr token,
@@ -140,6 +192,8 @@ class MultiplicationExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -154,7 +208,7 @@ using MultiplicationExpressionPtr =
 
 class AdditionExpression : public ASTNode {
  public:
-  using AdditionExpressionPtr = std::unique_ptr<AdditionExpression>;
+  using AdditionExpressionPtr = ArenaPtr<AdditionExpression>;
   AdditionExpression(MultiplicationExpressionPtr left_expr)
       : mul_left_expr_(std::move(left_expr)) {}
   AdditionExpression(AdditionPtr token, MultiplicationExpressionPtr left_expr,
@@ -171,6 +225,8 @@ class AdditionExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -184,7 +240,7 @@ using AdditionExpressionPtr = AdditionExpression::AdditionExpressionPtr;
 
 class ComparisonExpression : public ASTNode {
  public:
-  using ComparisonExpressionPtr = std::unique_ptr<ComparisonExpression>;
+  using ComparisonExpressionPtr = ArenaPtr<ComparisonExpression>;
   ComparisonExpression(AdditionExpressionPtr left_expr)
       : add_left_expr_(std::move(left_expr)) {}
   ComparisonExpression(ComparePtr token, AdditionExpressionPtr left_expr,
@@ -201,6 +257,8 @@ class ComparisonExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -214,7 +272,7 @@ using ComparisonExpressionPtr = ComparisonExpression::ComparisonExpressionPtr;
 
 class EqualityExpression : public ASTNode {
  public:
-  using EqualityExpressionPtr = std::unique_ptr<EqualityExpression>;
+  using EqualityExpressionPtr = ArenaPtr<EqualityExpression>;
   EqualityExpression(ComparisonExpressionPtr left_expr)
       : cmp_left_expr_(std::move(left_expr)) {}
   EqualityExpression(EqualityPtr token, ComparisonExpressionPtr left_expr,
@@ -231,6 +289,8 @@ class EqualityExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -244,7 +304,7 @@ using EqualityExpressionPtr = EqualityExpression::EqualityExpressionPtr;
 
 class AndLogicExpression : public ASTNode {
  public:
-  using AndLogicExpressionPtr = std::unique_ptr<AndLogicExpression>;
+  using AndLogicExpressionPtr = ArenaPtr<AndLogicExpression>;
   AndLogicExpression(EqualityExpressionPtr left_expr) : eql_left_expr_(std::move(left_expr)) {}
   AndLogicExpression(EqualityPtr token, EqualityExpressionPtr left_expr,
                      EqualityExpressionPtr right_expr)
@@ -257,6 +317,8 @@ class AndLogicExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -270,7 +332,7 @@ using AndLogicExpressionPtr = AndLogicExpression::AndLogicExpressionPtr;
 
 class OrLogicExpression : public ASTNode {
  public:
-  using OrLogicExpressionPtr = std::unique_ptr<OrLogicExpression>;
+  using OrLogicExpressionPtr = ArenaPtr<OrLogicExpression>;
   OrLogicExpression(AndLogicExpressionPtr left_expr)
       : and_logic_left_expr_(std::move(left_expr)) {}
   OrLogicExpression(EqualityPtr token, AndLogicExpressionPtr left_expr,
@@ -278,12 +340,17 @@ class OrLogicExpression : public ASTNode {
       : token_(std::move(token)),
         and_logic_left_expr_(std::move(left_expr)),
         and_logic_right_expr_(std::move(right_expr)) {}
-  OrLogicExpression(EqualityPtr token, AndLogicExpressionPtr left_expr, OrLogicExpressionPtr right_expr)
-   : token_(std::move(token)), and_logic_right_expr_(std::move(left_expr)), or_logic_expr_(std::move(right_expr)) {}
+  OrLogicExpression(EqualityPtr token, AndLogicExpressionPtr left_expr,
+                    OrLogicExpressionPtr right_expr)
+      : token_(std::move(token)),
+        and_logic_left_expr_(std::move(left_expr)),
+        or_logic_expr_(std::move(right_expr)) {}
 
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -302,6 +369,8 @@ class BasicExpression : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -316,6 +385,8 @@ class FunctionCall : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -323,7 +394,7 @@ class FunctionCall : public ASTNode {
   TokenPtr token_;
 };
 
-using FunctionCallPtr = std::unique_ptr<FunctionCall>;
+using FunctionCallPtr = ArenaPtr<FunctionCall>;
 
 class LetStatement : public ASTNode {
  public:
@@ -335,6 +406,8 @@ class LetStatement : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -343,7 +416,7 @@ class LetStatement : public ASTNode {
   TokenPtr token_;
 };
 
-using LetStatementPtr = std::unique_ptr<LetStatement>;
+using LetStatementPtr = ArenaPtr<LetStatement>;
 
 class ReturnDeclaration : public ASTNode {
  public:
@@ -353,13 +426,14 @@ class ReturnDeclaration : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
   std::string toString() override;
 
  private:
   std::variant<PrimaryPtr, NormalPtr> token_;
 };
 
-using ReturnDeclarationPtr = std::unique_ptr<ReturnDeclaration>;
+using ReturnDeclarationPtr = ArenaPtr<ReturnDeclaration>;
 
 class FunctionDeclaration : public ASTNode {
  public:
@@ -372,6 +446,8 @@ class FunctionDeclaration : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -380,7 +456,7 @@ class FunctionDeclaration : public ASTNode {
   std::vector<ASTNodePtr> statements_;
 };
 
-using FunctionDeclarationPtr = std::unique_ptr<FunctionDeclaration>;
+using FunctionDeclarationPtr = ArenaPtr<FunctionDeclaration>;
 
 class IfStatement : public ASTNode {
  public:
@@ -391,6 +467,8 @@ class IfStatement : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  public:
@@ -398,7 +476,7 @@ class IfStatement : public ASTNode {
   std::vector<ASTNodePtr> statements_;
 };
 
-using IfStatementPtr = std::unique_ptr<IfStatement>;
+using IfStatementPtr = ArenaPtr<IfStatement>;
 
 class ProgramDeclaration : public ASTNode {
  public:
@@ -414,6 +492,8 @@ class ProgramDeclaration : public ASTNode {
   // ASTNode
   void accept(IASTNodeVisitor& visitor) override;
   void self(Program& program) override;
+  FlatAST::NodeIndex flatten(FlatAST& ast) override;
+  std::optional<double> fold() override;
   std::string toString() override;
 
  private:
@@ -425,7 +505,7 @@ class ProgramDeclaration : public ASTNode {
   std::vector<BasicExpressionPtr> expressions_;
 };
 
-using ProgramDeclarationPtr = std::unique_ptr<ProgramDeclaration>;
+using ProgramDeclarationPtr = ArenaPtr<ProgramDeclaration>;
 
 OPCode opcodeFromToken(TokenType token);
 
@@ -0,0 +1,488 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bytecode_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+namespace Startear {
+
+namespace {
+size_t alignSection(size_t offset) { return (offset + 7) & ~size_t{7}; }
+
+template <class T>
+void appendRecord(std::string& image, const T& record) {
+  image.append(reinterpret_cast<const char*>(&record), sizeof(T));
+}
+
+template <class T>
+T readRecord(std::string_view image, size_t offset) {
+  T record;
+  memcpy(&record, image.data() + offset, sizeof(T));
+  return record;
+}
+
+// Returns true if count records of size fit in the image from offset.
+bool fits(std::string_view image, uint64_t offset, uint64_t count,
+          size_t size) {
+  return offset <= image.size() && count <= (image.size() - offset) / size;
+}
+
+// Deduplicated NUL terminated strings.
+class StringSection {
+ public:
+  uint64_t add(std::string_view s) {
+    auto [itr, inserted] = offsets_.try_emplace(std::string(s), data_.size());
+    if (inserted) {
+      data_.append(s);
+      data_.push_back('\0');
+    }
+    return itr->second;
+  }
+  const std::string& data() const { return data_; }
+
+ private:
+  std::string data_;
+  std::unordered_map<std::string, uint64_t> offsets_;
+};
+
+bool isValueOperand(OPCode code, size_t i) {
+  switch (code) {
+    case OPCode::OP_PUSH:
+    case OPCode::OP_PRINT:
+      return true;
+    case OPCode::OP_ADD_SLOT_CONST:
+      return i == 1;
+    case OPCode::OP_PUSH_STORE:
+      return i == 0;
+    default:
+      return false;
+  }
+}
+
+bool isSlotOperand(OPCode code, size_t i) {
+  switch (code) {
+    case OPCode::OP_LOAD_SLOT:
+    case OPCode::OP_STORE_SLOT:
+    case OPCode::OP_ADD_SLOT_CONST:
+      return i == 0;
+    case OPCode::OP_PUSH_STORE:
+      return i == 1;
+    default:
+      return false;
+  }
+}
+
+bool isTargetOperand(OPCode code, size_t i) {
+  switch (code) {
+    case OPCode::OP_BRANCH:
+    case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+    case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+      return true;
+    case OPCode::OP_COMPARE_BRANCH:
+      return i != 0;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+uint64_t BytecodeFile::hashSource(std::string_view source) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto c : source) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+std::optional<std::string> BytecodeFile::serialize(const Program& program,
+                                                   uint64_t source_hash) {
+  if (!program.linked()) {
+    return std::nullopt;
+  }
+  StringSection strings;
+  std::vector<uint64_t> values;
+  std::vector<StringConstantRecord> string_constants;
+  for (size_t i = 0; i < program.valueCount(); ++i) {
+    const auto& value = program.valueData()[i];
+    if (auto s = value.getString()) {
+      values.emplace_back(Value(value.category()).bits());
+      string_constants.emplace_back(StringConstantRecord{i, strings.add(*s)});
+    } else {
+      values.emplace_back(value.bits());
+    }
+  }
+  std::vector<uint64_t> symbols;
+  std::vector<FunctionRecord> functions;
+  for (const auto& function : program.registered_function_.functions_) {
+    functions.emplace_back(FunctionRecord{strings.add(function.name_),
+                                          function.pc_, function.arity_,
+                                          symbols.size(),
+                                          function.locals_.size()});
+    for (const auto& local : function.locals_) {
+      symbols.emplace_back(strings.add(local));
+    }
+  }
+  std::vector<LabelRecord> labels;
+  for (const auto& [name, pc] : program.labels_) {
+    labels.emplace_back(LabelRecord{strings.add(name), pc});
+  }
+  // Labels are sorted to make the image deterministic.
+  std::sort(labels.begin(), labels.end(),
+            [](const auto& lhs, const auto& rhs) { return lhs.name_ < rhs.name_; });
+
+  Header header{};
+  memcpy(header.magic_, magic, sizeof(magic));
+  header.version_ = version;
+  header.source_hash_ = source_hash;
+  std::string image(alignSection(sizeof(Header)), '\0');
+  const auto begin_section = [&image](uint64_t& offset) {
+    image.resize(alignSection(image.size()), '\0');
+    offset = image.size();
+  };
+  begin_section(header.code_offset_);
+  header.code_size_ = program.codeSize();
+  // Instructions which VM has quickened are written as generic ones.
+  for (size_t pc = 0; pc < program.codeSize();) {
+    Instruction instr(program.codeData() + pc);
+    image.push_back(static_cast<char>(genericOpcode(instr.opcode())));
+    image.append(reinterpret_cast<const char*>(program.codeData()) + pc + 1,
+                 instr.length() - 1);
+    pc += instr.length();
+  }
+  begin_section(header.values_offset_);
+  header.value_count_ = values.size();
+  for (const auto& bits : values) {
+    appendRecord(image, bits);
+  }
+  begin_section(header.string_constants_offset_);
+  header.string_constant_count_ = string_constants.size();
+  for (const auto& record : string_constants) {
+    appendRecord(image, record);
+  }
+  begin_section(header.strings_offset_);
+  header.strings_size_ = strings.data().size();
+  image.append(strings.data());
+  begin_section(header.symbols_offset_);
+  header.symbol_count_ = symbols.size();
+  for (const auto& symbol : symbols) {
+    appendRecord(image, symbol);
+  }
+  begin_section(header.functions_offset_);
+  header.function_count_ = functions.size();
+  for (const auto& record : functions) {
+    appendRecord(image, record);
+  }
+  begin_section(header.labels_offset_);
+  header.label_count_ = labels.size();
+  for (const auto& record : labels) {
+    appendRecord(image, record);
+  }
+  memcpy(image.data(), &header, sizeof(Header));
+  return image;
+}
+
+bool BytecodeFile::write(const Program& program, uint64_t source_hash,
+                         const std::string& path) {
+  auto image = serialize(program, source_hash);
+  if (!image.has_value()) {
+    return false;
+  }
+  // Readers never see the file which is partially written.
+  auto temporary = path + ".tmp";
+  {
+    std::ofstream ofs(temporary, std::ios::binary | std::ios::trunc);
+    if (!ofs.write(image->data(), image->size())) {
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+  return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+std::optional<Program> BytecodeFile::deserialize(std::string_view image,
+                                                 uint64_t source_hash) {
+  Program program;
+  if (!restore(image, source_hash, nullptr, program)) {
+    return std::nullopt;
+  }
+  return program;
+}
+
+std::optional<Program> BytecodeFile::load(const std::string& path,
+                                          uint64_t source_hash) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return std::nullopt;
+  }
+  size_t size = st.st_size;
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return std::nullopt;
+  }
+  // The mapping is released here unless the program borrows it.
+  std::shared_ptr<const void> owner(
+      mapped, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+  Program program;
+  if (!restore(std::string_view(static_cast<const char*>(mapped), size),
+               source_hash, std::move(owner), program)) {
+    return std::nullopt;
+  }
+  return program;
+}
+
+bool BytecodeFile::restore(std::string_view image, uint64_t source_hash,
+                           std::shared_ptr<const void> owner,
+                           Program& program) {
+  if (image.size() < sizeof(Header)) {
+    return false;
+  }
+  auto header = readRecord<Header>(image, 0);
+  if (memcmp(header.magic_, magic, sizeof(magic)) != 0 ||
+      header.version_ != version || header.source_hash_ != source_hash) {
+    return false;
+  }
+  if (!fits(image, header.code_offset_, header.code_size_, 1) ||
+      !fits(image, header.values_offset_, header.value_count_,
+            sizeof(uint64_t)) ||
+      !fits(image, header.string_constants_offset_,
+            header.string_constant_count_, sizeof(StringConstantRecord)) ||
+      !fits(image, header.strings_offset_, header.strings_size_, 1) ||
+      !fits(image, header.symbols_offset_, header.symbol_count_,
+            sizeof(uint64_t)) ||
+      !fits(image, header.functions_offset_, header.function_count_,
+            sizeof(FunctionRecord)) ||
+      !fits(image, header.labels_offset_, header.label_count_,
+            sizeof(LabelRecord)) ||
+      header.values_offset_ % alignof(Value) != 0) {
+    return false;
+  }
+  auto strings = image.substr(header.strings_offset_, header.strings_size_);
+  if (!strings.empty() && strings.back() != '\0') {
+    return false;
+  }
+  const auto string_at = [&strings](uint64_t offset) {
+    return offset < strings.size()
+               ? std::optional<std::string_view>(strings.data() + offset)
+               : std::nullopt;
+  };
+
+  // Values must not carry pointers of other process.
+  const auto value_at = [&image, &header](uint64_t i) {
+    return readRecord<Value>(image, header.values_offset_ + i * sizeof(Value));
+  };
+  for (uint64_t i = 0; i < header.value_count_; ++i) {
+    if (value_at(i).type() == Value::SupportedTypes::String) {
+      return false;
+    }
+  }
+  std::unordered_map<uint64_t, std::string_view> string_constants;
+  for (uint64_t i = 0; i < header.string_constant_count_; ++i) {
+    auto record = readRecord<StringConstantRecord>(
+        image, header.string_constants_offset_ +
+                   i * sizeof(StringConstantRecord));
+    auto s = string_at(record.string_);
+    if (!s || record.index_ >= header.value_count_ ||
+        value_at(record.index_).type() != Value::SupportedTypes::None ||
+        !string_constants.emplace(record.index_, *s).second) {
+      return false;
+    }
+  }
+
+  auto& registry = program.registered_function_;
+  for (uint64_t id = 0; id < header.function_count_; ++id) {
+    auto record = readRecord<FunctionRecord>(
+        image, header.functions_offset_ + id * sizeof(FunctionRecord));
+    auto name = string_at(record.name_);
+    if (!name || record.pc_ >= header.code_size_ ||
+        record.first_local_ > header.symbol_count_ ||
+        record.local_count_ > header.symbol_count_ - record.first_local_ ||
+        record.arity_ > record.local_count_) {
+      return false;
+    }
+    std::vector<std::string> locals;
+    for (uint64_t i = 0; i < record.local_count_; ++i) {
+      auto local = string_at(readRecord<uint64_t>(
+          image, header.symbols_offset_ +
+                     (record.first_local_ + i) * sizeof(uint64_t)));
+      if (!local) {
+        return false;
+      }
+      locals.emplace_back(*local);
+    }
+    registry.pc_id_.emplace(record.pc_, id);
+    registry.name_id_.emplace(std::string(*name), id);
+    registry.functions_.emplace_back(Program::FunctionMetadata{
+        std::string(*name), id, record.pc_, record.arity_, locals});
+  }
+  for (uint64_t i = 0; i < header.label_count_; ++i) {
+    auto record = readRecord<LabelRecord>(
+        image, header.labels_offset_ + i * sizeof(LabelRecord));
+    auto name = string_at(record.name_);
+    if (!name || record.pc_ > header.code_size_) {
+      return false;
+    }
+    program.labels_.emplace(std::string(*name), record.pc_);
+  }
+
+  // VM trusts operands, so that they are validated before execution.
+  const auto* code =
+      reinterpret_cast<const uint8_t*>(image.data() + header.code_offset_);
+  bool reads_string_constant = false;
+  std::optional<OPCode> last;
+  // Program counters where instruction starts.
+  std::vector<bool> boundaries(header.code_size_, false);
+  for (size_t pc = 0; pc < header.code_size_;) {
+    if (code[pc] >= static_cast<uint8_t>(OPCode::OPCODE_SIZE)) {
+      return false;
+    }
+    Instruction instr(code + pc);
+    if (instr.length() > header.code_size_ - pc) {
+      return false;
+    }
+    if (instr.opcode() == OPCode::OP_COMPARE_BRANCH &&
+        !isComparison(static_cast<OPCode>(instr.operand(0)))) {
+      return false;
+    }
+    for (size_t i = 0; i < instr.operandSize(); ++i) {
+      auto operand = instr.operand(i);
+      if (isValueOperand(instr.opcode(), i)) {
+        if (operand >= header.value_count_) {
+          return false;
+        }
+        reads_string_constant |= string_constants.count(operand) != 0;
+      }
+      if ((isTargetOperand(instr.opcode(), i) &&
+           operand >= header.code_size_) ||
+          ((instr.opcode() == OPCode::OP_CALL ||
+            instr.opcode() == OPCode::OP_TAIL_CALL) &&
+           operand >= header.function_count_)) {
+        return false;
+      }
+    }
+    boundaries[pc] = true;
+    last = instr.opcode();
+    pc += instr.length();
+  }
+  // Linked program is terminated by the sentinel.
+  if (last != OPCode::OP_HALT) {
+    return false;
+  }
+  // Slots are checked against the frame of function which executes them.
+  // Instructions are owned by the function which reaches them from its entry,
+  // and each of them must be reached only by one function. Others, e.g. top
+  // level statements, are never executed.
+  std::vector<std::optional<size_t>> owners(header.code_size_);
+  for (const auto& function : registry.functions_) {
+    std::vector<size_t> worklist{function.pc_};
+    while (!worklist.empty()) {
+      auto pc = worklist.back();
+      worklist.pop_back();
+      // Targets must not land in the middle of instruction.
+      if (!boundaries[pc]) {
+        return false;
+      }
+      Instruction instr(code + pc);
+      // The sentinel is shared, and it has no operands.
+      if (instr.opcode() == OPCode::OP_HALT) {
+        continue;
+      }
+      if (owners[pc].has_value()) {
+        if (*owners[pc] != function.id_) {
+          return false;
+        }
+        continue;
+      }
+      owners[pc] = function.id_;
+      for (size_t i = 0; i < instr.operandSize(); ++i) {
+        if (isSlotOperand(instr.opcode(), i) &&
+            instr.operand(i) >= function.locals_.size()) {
+          return false;
+        }
+      }
+      const auto next = pc + instr.length();
+      switch (instr.opcode()) {
+        case OPCode::OP_RETURN:
+          break;
+        case OPCode::OP_BRANCH:
+          worklist.emplace_back(instr.operand(0));
+          worklist.emplace_back(instr.operand(1));
+          break;
+        case OPCode::OP_COMPARE_BRANCH:
+          worklist.emplace_back(instr.operand(1));
+          worklist.emplace_back(instr.operand(2));
+          break;
+        case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+        case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+          worklist.emplace_back(instr.operand(0));
+          worklist.emplace_back(next);
+          break;
+        default:
+          // The last instruction is the sentinel, so that next one exists.
+          worklist.emplace_back(next);
+          break;
+      }
+    }
+  }
+  program.linked_ = true;
+
+  const auto* values =
+      reinterpret_cast<const Value*>(image.data() + header.values_offset_);
+  if (owner && !reads_string_constant) {
+    program.image_ = std::make_shared<const Program::Image>(Program::Image{
+        std::move(owner), code, header.code_size_, values,
+        header.value_count_});
+    return true;
+  }
+  program.code_.assign(code, code + header.code_size_);
+  for (uint64_t i = 0; i < header.value_count_; ++i) {
+    auto value = value_at(i);
+    if (auto itr = string_constants.find(i); itr != string_constants.end()) {
+      value = Value(value.category(), itr->second);
+    }
+    program.values_.emplace_back(value);
+    program.value_index_.emplace(value.bits(), i);
+  }
+  return true;
+}
+
+}  // namespace Startear
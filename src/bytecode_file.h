@@ -0,0 +1,133 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_BYTECODE_FILE_H
+#define STARTEAR_BYTECODE_FILE_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "program.h"
+
+namespace Startear {
+
+// Serialized linked program, which is cached in .stbc file to skip the front
+// end. The image consists of the header and 8 byte aligned sections in host
+// byte order.
+//
+// | Header | code | values | string constants | strings | symbols |
+// | functions | labels |
+//
+// Code and values are laid out as VM executes them, so that the mapped image
+// is executed in place without relocation. Its pages are shared by all of
+// processes which run the same script through the page cache.
+//
+// Values are raw Value words. String is a process local pointer, so that
+// string constant is left as None of the same category on the value section
+// and listed on the string constant section instead. Program which reads
+// string constants is copied into the process on loading.
+//
+// Strings of string constants and functions are stored as offsets into the
+// string section, where each of them is terminated by NUL.
+class BytecodeFile {
+ public:
+  static constexpr char magic[4] = {'S', 'T', 'B', 'C'};
+  // Bump this whenever the layout, the instruction set or the representation
+  // of Value changes.
+  static constexpr uint32_t version = 5;
+
+  struct Header {
+    char magic_[4];
+    uint32_t version_;
+    // Hash of the source which the program is compiled from.
+    uint64_t source_hash_;
+    uint64_t code_offset_;
+    uint64_t code_size_;
+    uint64_t values_offset_;
+    uint64_t value_count_;
+    uint64_t string_constants_offset_;
+    uint64_t string_constant_count_;
+    uint64_t strings_offset_;
+    uint64_t strings_size_;
+    uint64_t symbols_offset_;
+    uint64_t symbol_count_;
+    uint64_t functions_offset_;
+    uint64_t function_count_;
+    uint64_t labels_offset_;
+    uint64_t label_count_;
+  };
+
+  struct StringConstantRecord {
+    // Index on the value section.
+    uint64_t index_;
+    uint64_t string_;
+  };
+
+  struct FunctionRecord {
+    uint64_t name_;
+    uint64_t pc_;
+    uint64_t arity_;
+    // Range of local variable names on the symbol section.
+    uint64_t first_local_;
+    uint64_t local_count_;
+  };
+
+  struct LabelRecord {
+    uint64_t name_;
+    uint64_t pc_;
+  };
+
+  // FNV-1a hash of the source.
+  static uint64_t hashSource(std::string_view source);
+
+  // Returns std::nullopt if the program is not linked. write() fails in that
+  // case, and the file is left untouched.
+  static std::optional<std::string> serialize(const Program& program,
+                                              uint64_t source_hash);
+  static bool write(const Program& program, uint64_t source_hash,
+                    const std::string& path);
+
+  // Returns std::nullopt if the image is broken, is written by other version,
+  // or is compiled from other source.
+  static std::optional<Program> deserialize(std::string_view image,
+                                            uint64_t source_hash);
+  // Map the file read-only. Returned program executes the mapped image in
+  // place, and keeps the mapping alive until all of its copies are destroyed.
+  static std::optional<Program> load(const std::string& path,
+                                     uint64_t source_hash);
+
+ private:
+  // Validate the image and restore program from it. Code and values are
+  // borrowed from the image if owner is given, otherwise copied.
+  static bool restore(std::string_view image, uint64_t source_hash,
+                      std::shared_ptr<const void> owner, Program& program);
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_BYTECODE_FILE_H
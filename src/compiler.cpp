@@ -0,0 +1,325 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "compiler.h"
+
+#include <fmt/format.h>
+
+#include <charconv>
+#include <iostream>
+
+#include "ast.h"
+
+namespace Startear {
+
+namespace {
+double toNumber(std::string_view lexeme) {
+  double number = 0;
+  auto result =
+      std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), number);
+  STARTEAR_ASSERT(result.ec == std::errc());
+  return number;
+}
+}  // namespace
+
+bool Compiler::compile(bool fuse, std::optional<InlineOptions> inlining) {
+  while (!isEnd()) {
+    bool compiled;
+    if (match(TokenType::COMMENT)) {
+      forward();
+      continue;
+    } else if (match(TokenType::VAR)) {
+      compiled = letStatement(false);
+    } else if (match(TokenType::FUN)) {
+      compiled = functionDeclaration();
+    } else {
+      // In general, this section is not reached except testing.
+      compiled = expression(Tier::OrLogic);
+    }
+    if (!compiled) {
+      return false;
+    }
+  }
+  if (inlining.has_value()) {
+    program_.inlineFunctions(*inlining);
+  }
+  if (fuse) {
+    program_.fuseSuperinstructions();
+  }
+  return program_.link();
+}
+
+bool Compiler::functionDeclaration() {
+  forward();
+  if (!match(TokenType::IDENTIFIER)) {
+    return syntaxError();
+  }
+  auto name = peek().lexeme();
+  forward();
+  if (!consume(TokenType::LEFT_PAREN)) {
+    return false;
+  }
+  std::vector<std::string> args;
+  while (match(TokenType::IDENTIFIER)) {
+    args.emplace_back(peek().lexeme());
+    forward();
+    if (!match(TokenType::COMMA)) {
+      break;
+    }
+    forward();
+  }
+  if (!consume(TokenType::RIGHT_PAREN)) {
+    return false;
+  }
+  if (!match(TokenType::LEFT_BRACE)) {
+    return syntaxError("function should be started with left bracket");
+  }
+  forward();
+  program_.addFunction(std::string(name), args);
+
+  bool returned = false;
+  while (!match(TokenType::RIGHT_BRACE)) {
+    if (isEnd()) {
+      return syntaxError();
+    }
+    if (match(TokenType::COMMENT)) {
+      forward();
+      continue;
+    }
+    returned = match(TokenType::RETURN);
+    if (!statement()) {
+      return false;
+    }
+  }
+  forward();
+  // Execution must not fall through into the code placed after this function.
+  if (!returned) {
+    program_.addInst(OPCode::OP_RETURN);
+  }
+  return true;
+}
+
+bool Compiler::statement() {
+  if (match(TokenType::VAR)) {
+    return letStatement(false);
+  } else if (match(TokenType::IDENTIFIER)) {
+    if (match(TokenType::LEFT_PAREN, 1)) {
+      return functionCall() && consume(TokenType::SEMICOLON);
+    } else if (match(TokenType::EQUAL, 1)) {
+      return letStatement(true);
+    }
+  } else if (match(TokenType::RETURN)) {
+    return returnStatement();
+  } else if (match(TokenType::IF)) {
+    return ifStatement();
+  }
+  return syntaxError();
+}
+
+bool Compiler::letStatement(bool substitution) {
+  // Not to pass `let` when passed statement is substitution.
+  if (!substitution) {
+    forward();
+  }
+  if (!match(TokenType::IDENTIFIER)) {
+    return syntaxError();
+  }
+  auto name = peek().lexeme();
+  forward();
+  if (!consume(TokenType::EQUAL)) {
+    return false;
+  }
+  bool compiled =
+      match(TokenType::IDENTIFIER) && match(TokenType::LEFT_PAREN, 1)
+          ? functionCall()
+          : expression(Tier::OrLogic);
+  if (!compiled) {
+    return false;
+  }
+  if (!match(TokenType::SEMICOLON)) {
+    return syntaxError("Variable definition must be ended with semicolon");
+  }
+  forward();
+  // Slot is resolved after the value, as LetStatement does.
+  program_.addInst(OPCode::OP_STORE_SLOT, {program_.resolveLocalSlot(name)});
+  return true;
+}
+
+bool Compiler::functionCall() {
+  auto name = peek().lexeme();
+  forward();
+  if (!consume(TokenType::LEFT_PAREN)) {
+    return false;
+  }
+  while (!match(TokenType::RIGHT_PAREN)) {
+    if (!expression(Tier::OrLogic)) {
+      return false;
+    }
+    if (!match(TokenType::COMMA)) {
+      break;
+    }
+    forward();
+  }
+  if (!consume(TokenType::RIGHT_PAREN)) {
+    return false;
+  }
+  program_.addInst(OPCode::OP_CALL,
+                   {std::make_pair(Value::Category::Variable, name)});
+  return true;
+}
+
+bool Compiler::returnStatement() {
+  forward();
+  if (match(TokenType::NUMBER)) {
+    program_.addInst(OPCode::OP_PUSH,
+                     {std::make_pair(Value::Category::Literal,
+                                     toNumber(peek().lexeme()))});
+  } else if (match(TokenType::IDENTIFIER)) {
+    program_.addInst(OPCode::OP_LOAD_SLOT,
+                     {program_.findLocalSlot(peek().lexeme())});
+  } else {
+    return syntaxError();
+  }
+  forward();
+  if (!match(TokenType::SEMICOLON)) {
+    return syntaxError("return must be ended with semicolon");
+  }
+  forward();
+  program_.addInst(OPCode::OP_RETURN);
+  return true;
+}
+
+bool Compiler::ifStatement() {
+  forward();
+  if (!consume(TokenType::LEFT_PAREN) || !expression(Tier::Equality) ||
+      !consume(TokenType::RIGHT_PAREN) || !consume(TokenType::LEFT_BRACE)) {
+    return false;
+  }
+  std::string label_if_entry = program_.getIndexedLabel();
+  std::string label_not_if_entry = program_.getIndexedLabel();
+  program_.addInst(
+      OPCode::OP_BRANCH,
+      {std::make_pair(Value::Category::Literal, label_if_entry),
+       std::make_pair(Value::Category::Literal, label_not_if_entry)});
+  bool entered = false;
+  while (!match(TokenType::RIGHT_BRACE)) {
+    if (isEnd()) {
+      return syntaxError();
+    }
+    if (match(TokenType::COMMENT)) {
+      forward();
+      continue;
+    }
+    if (!entered) {
+      program_.addLabel(label_if_entry);
+      entered = true;
+    }
+    if (!statement()) {
+      return false;
+    }
+  }
+  forward();
+  program_.addLabel(label_not_if_entry);
+  return true;
+}
+
+bool Compiler::expression(Tier max_tier) {
+  if (!unaryExpression()) {
+    return false;
+  }
+  while (const auto* token = at(0)) {
+    auto tier = binaryTier(token->type());
+    if (!tier || *tier > max_tier) {
+      break;
+    }
+    auto type = token->type();
+    forward();
+    // Logical operators skip the right operand if the left one decides the
+    // result.
+    std::optional<std::string> label_end;
+    if (*tier == Tier::AndLogic || *tier == Tier::OrLogic) {
+      label_end = program_.getIndexedLabel();
+      program_.addInst(*tier == Tier::AndLogic
+                           ? OPCode::OP_JUMP_IF_FALSE_OR_POP
+                           : OPCode::OP_JUMP_IF_TRUE_OR_POP,
+                       {std::make_pair(Value::Category::Literal, *label_end)});
+    }
+    // Right operand of left associative operator must be tighter.
+    if (!expression(isRightAssociative(*tier)
+                        ? *tier
+                        : static_cast<Tier>(static_cast<int>(*tier) - 1))) {
+      return false;
+    }
+    if (label_end.has_value()) {
+      program_.addLabel(*label_end);
+    } else {
+      program_.addInst(opcodeFromToken(type));
+    }
+  }
+  return true;
+}
+
+bool Compiler::unaryExpression() {
+  // Operator is not emitted, as UnaryExpression does.
+  while (match(TokenType::BANG) || match(TokenType::MINUS)) {
+    forward();
+  }
+  return primaryExpression();
+}
+
+bool Compiler::primaryExpression() {
+  if (match(TokenType::NUMBER)) {
+    program_.addInst(OPCode::OP_PUSH,
+                     {std::make_pair(Value::Category::Literal,
+                                     toNumber(peek().lexeme()))});
+    forward();
+    return true;
+  } else if (match(TokenType::IDENTIFIER)) {
+    program_.addInst(OPCode::OP_LOAD_SLOT,
+                     {program_.findLocalSlot(peek().lexeme())});
+    forward();
+    return true;
+  } else if (match(TokenType::LEFT_PAREN)) {
+    forward();
+    return expression(Tier::OrLogic) && consume(TokenType::RIGHT_PAREN);
+  }
+  return syntaxError();
+}
+
+bool Compiler::consume(TokenType expected) {
+  if (!match(expected)) {
+    return syntaxError();
+  }
+  forward();
+  return true;
+}
+
+bool Compiler::syntaxError(std::string_view message) {
+  std::cerr << fmt::format("{}: line no {}", message, peek().lineno())
+            << std::endl;
+  return false;
+}
+
+}  // namespace Startear
@@ -0,0 +1,78 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_COMPILER_H
+#define STARTEAR_COMPILER_H
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "parser.h"
+#include "program.h"
+#include "token_cursor.h"
+#include "tokenizer.h"
+
+namespace Startear {
+// Single pass compiler which emits instructions while parsing, without
+// building AST. It accepts the same grammar as Parser, and emits the same
+// program as StartearVMInstructionEmitter does without constant folding.
+// Top level statements are emitted in the order of source, while the
+// emitter places global variables before functions.
+class Compiler : private TokenCursor {
+ public:
+  // Borrow tokens, which must outlive the compiler.
+  Compiler(const std::vector<Token>& tokens) : TokenCursor(tokens) {}
+  Compiler(Tokenizer& tokenizer) : TokenCursor(tokenizer) {}
+
+  // Compile all of tokens and link the program. Small functions are inlined if
+  // inlining is given, and superinstructions are fused before linking if fuse
+  // is true. It returns false on syntax error.
+  bool compile(bool fuse = false,
+               std::optional<InlineOptions> inlining = std::nullopt);
+
+  const Program& program() const { return program_; }
+
+ private:
+  bool functionDeclaration();
+  bool statement();
+  bool letStatement(bool substitution);
+  bool functionCall();
+  bool returnStatement();
+  bool ifStatement();
+  // Compile binary operators of max_tier or tighter by precedence climbing.
+  bool expression(Tier max_tier);
+  bool unaryExpression();
+  bool primaryExpression();
+
+  // Consume the token of expected type, or report syntax error.
+  bool consume(TokenType expected);
+  bool syntaxError(std::string_view message = "Syntax Error");
+
+  Program program_;
+};
+}  // namespace Startear
+
+#endif  // STARTEAR_COMPILER_H
@@ -50,9 +50,21 @@ void disassemble(Program& p) {
     std::string instr_str;
     auto func_name = p.functionRegistry().findByProgramCounter(ptr);
 
-    switch (instr_entry->get().opcode()) {
+    std::cout << fmt::format("{:04} | ", ptr);
+    switch (instr_entry->opcode()) {
+      case OPCode::OP_ADD_DOUBLE:
+      case OPCode::OP_SUB_DOUBLE:
+      case OPCode::OP_MUL_DOUBLE:
+      case OPCode::OP_DIV_DOUBLE:
+      case OPCode::OP_EQUAL_DOUBLE:
+      case OPCode::OP_BANG_EQUAL_DOUBLE:
+      case OPCode::OP_LESS_EQUAL_DOUBLE:
+      case OPCode::OP_GREATER_EQUAL_DOUBLE:
+      case OPCode::OP_LESS_DOUBLE:
+      case OPCode::OP_GREATER_DOUBLE:
+        instr_str = opcodeToString(instr_entry->opcode());
       case OPCode::OP_ADD:
-        instr_str = "OP_ADD";
+        SET_INSTRUCTION("OP_ADD");
       case OPCode::OP_SUB:
         SET_INSTRUCTION("OP_SUB");
       case OPCode::OP_MUL:
@@ -75,6 +87,8 @@ void disassemble(Program& p) {
         SET_INSTRUCTION("OP_AND");
       case OPCode::OP_OR:
         SET_INSTRUCTION("OP_OR");
+      case OPCode::OP_HALT:
+        SET_INSTRUCTION("OP_HALT");
       case OPCode::OP_RETURN:
         SET_INSTRUCTION("OP_RETURN");
         std::cout << fmt::format("{}", instr_str);
@@ -83,17 +97,32 @@ void disassemble(Program& p) {
         }
         std::cout << std::endl;
         break;
-      case OPCode::OP_LOAD_LOCAL:
-        SET_INSTRUCTION("OP_LOAD_LOCAL");
-      case OPCode::OP_CALL:
+      case OPCode::OP_LOAD_SLOT:
+        SET_INSTRUCTION("OP_LOAD_SLOT");
+      case OPCode::OP_STORE_SLOT: {
+        SET_INSTRUCTION("OP_STORE_SLOT");
+        STARTEAR_ASSERT(instr_entry->operandSize() == 1);
+        std::cout << fmt::format("{} {}", instr_str, instr_entry->operand(0));
+        if (func_name.has_value()) {
+          std::cout << fmt::format(" <- {}", func_name.value().get().name_);
+        }
+        std::cout << std::endl;
+        break;
+      }
+      case OPCode::OP_TAIL_CALL:
+        SET_INSTRUCTION("OP_TAIL_CALL");
+      case OPCode::OP_CALL: {
         SET_INSTRUCTION("OP_CALL");
-      case OPCode::OP_STORE_LOCAL: {
-        SET_INSTRUCTION("OP_STORE_LOCAL");
-        auto operand_ptrs = instr_entry->get().operandsPointer();
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        auto operand_data_entry = p.fetchValue(operand_ptrs[0]);
-        std::cout << fmt::format("{} {}", instr_str,
-                                 operand_data_entry->getString().value());
+        STARTEAR_ASSERT(instr_entry->operandSize() == 1);
+        if (p.linked()) {
+          std::cout << fmt::format(
+              "{} {}", instr_str,
+              p.functionRegistry().findById(instr_entry->operand(0)).name_);
+        } else {
+          auto operand_data_entry = p.fetchValue(instr_entry->operand(0));
+          std::cout << fmt::format("{} {}", instr_str,
+                                   operand_data_entry->getString().value());
+        }
         if (func_name.has_value()) {
           std::cout << fmt::format(" <- {}", func_name.value().get().name_);
         }
@@ -104,9 +133,8 @@ void disassemble(Program& p) {
         SET_INSTRUCTION("OP_PUSH");
       case OPCode::OP_PRINT: {
         SET_INSTRUCTION("OP_PRINT");
-        auto operand_ptrs = instr_entry->get().operandsPointer();
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        auto operand_data_entry = p.fetchValue(operand_ptrs[0]);
+        STARTEAR_ASSERT(instr_entry->operandSize() == 1);
+        auto operand_data_entry = p.fetchValue(instr_entry->operand(0));
         if (!operand_data_entry) {
           NOT_REACHED;
         }
@@ -130,14 +158,22 @@ void disassemble(Program& p) {
       }
       case OPCode::OP_BRANCH: {
         instr_str = "OP_BRANCH";
-        auto operand_ptrs = instr_entry->get().operandsPointer();
-        STARTEAR_ASSERT(operand_ptrs.size() == 2);
-        auto true_label_entry = p.fetchValue(operand_ptrs[0]);
+        STARTEAR_ASSERT(instr_entry->operandSize() == 2);
+        if (p.linked()) {
+          std::cout << fmt::format("{} {} {}", instr_str, instr_entry->operand(0),
+                                   instr_entry->operand(1));
+          if (func_name.has_value()) {
+            std::cout << fmt::format(" <- {}", func_name.value().get().name_);
+          }
+          std::cout << std::endl;
+          break;
+        }
+        auto true_label_entry = p.fetchValue(instr_entry->operand(0));
         if (!true_label_entry || !true_label_entry->getString() ||
             true_label_entry->category() != Value::Category::Literal) {
           NOT_REACHED;
         }
-        auto false_label_entry = p.fetchValue(operand_ptrs[1]);
+        auto false_label_entry = p.fetchValue(instr_entry->operand(1));
         if (!false_label_entry || !false_label_entry->getString() ||
             false_label_entry->category() != Value::Category::Literal) {
           NOT_REACHED;
@@ -151,8 +187,85 @@ void disassemble(Program& p) {
         std::cout << std::endl;
         break;
       }
+      case OPCode::OP_ADD_SLOT_CONST:
+      case OPCode::OP_PUSH_STORE: {
+        instr_str = opcodeToString(instr_entry->opcode());
+        STARTEAR_ASSERT(instr_entry->operandSize() == 2);
+        const bool slot_first =
+            instr_entry->opcode() == OPCode::OP_ADD_SLOT_CONST;
+        auto value_entry = p.fetchValue(instr_entry->operand(slot_first));
+        if (!value_entry) {
+          NOT_REACHED;
+        }
+        std::string value_str;
+        if (value_entry->getDouble()) {
+          value_str = fmt::format("{}", *value_entry->getDouble());
+        } else if (value_entry->getString()) {
+          value_str = *value_entry->getString();
+        }
+        if (slot_first) {
+          std::cout << fmt::format("{} {} {}", instr_str,
+                                   instr_entry->operand(0), value_str);
+        } else {
+          std::cout << fmt::format("{} {} {}", instr_str, value_str,
+                                   instr_entry->operand(1));
+        }
+        if (func_name.has_value()) {
+          std::cout << fmt::format(" <- {}", func_name.value().get().name_);
+        }
+        std::cout << std::endl;
+        break;
+      }
+      case OPCode::OP_COMPARE_BRANCH: {
+        instr_str = "OP_COMPARE_BRANCH";
+        STARTEAR_ASSERT(instr_entry->operandSize() == 3);
+        auto cmp_str =
+            opcodeToString(static_cast<OPCode>(instr_entry->operand(0)));
+        if (p.linked()) {
+          std::cout << fmt::format("{} {} {} {}", instr_str, cmp_str,
+                                   instr_entry->operand(1),
+                                   instr_entry->operand(2));
+        } else {
+          auto true_label_entry = p.fetchValue(instr_entry->operand(1));
+          auto false_label_entry = p.fetchValue(instr_entry->operand(2));
+          if (!true_label_entry || !true_label_entry->getString() ||
+              !false_label_entry || !false_label_entry->getString()) {
+            NOT_REACHED;
+          }
+          std::cout << fmt::format("{} {} {} {}", instr_str, cmp_str,
+                                   *true_label_entry->getString(),
+                                   *false_label_entry->getString());
+        }
+        if (func_name.has_value()) {
+          std::cout << fmt::format(" <- {}", func_name.value().get().name_);
+        }
+        std::cout << std::endl;
+        break;
+      }
+      case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+      case OPCode::OP_JUMP_IF_TRUE_OR_POP: {
+        instr_str = opcodeToString(instr_entry->opcode());
+        STARTEAR_ASSERT(instr_entry->operandSize() == 1);
+        if (p.linked()) {
+          std::cout << fmt::format("{} {}", instr_str, instr_entry->operand(0));
+        } else {
+          auto label_entry = p.fetchValue(instr_entry->operand(0));
+          if (!label_entry || !label_entry->getString()) {
+            NOT_REACHED;
+          }
+          std::cout << fmt::format("{} {}", instr_str,
+                                   *label_entry->getString());
+        }
+        if (func_name.has_value()) {
+          std::cout << fmt::format(" <- {}", func_name.value().get().name_);
+        }
+        std::cout << std::endl;
+        break;
+      }
+      case OPCode::OPCODE_SIZE:
+        NOT_REACHED;
     }
-    ++ptr;
+    ptr += instr_entry->length();
   }
 }
 
@@ -0,0 +1,158 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "flat_ast.h"
+
+#include "ast.h"
+
+namespace Startear {
+
+FlatAST FlatAST::build(ASTNode& root) {
+  FlatAST ast;
+  ast.root_ = root.flatten(ast);
+  return ast;
+}
+
+FlatAST::NodeIndex FlatAST::addNode(Kind kind, uint32_t payload,
+                                    const std::vector<NodeIndex>& children) {
+  STARTEAR_ASSERT(kinds_.size() < invalid_index);
+  kinds_.emplace_back(kind);
+  payloads_.emplace_back(payload);
+  first_child_.emplace_back(children_.size());
+  child_count_.emplace_back(children.size());
+  children_.insert(children_.end(), children.begin(), children.end());
+  return kinds_.size() - 1;
+}
+
+FlatAST::NodeIndex FlatAST::addNumber(double number) {
+  numbers_.emplace_back(number);
+  return addNode(Kind::Number, numbers_.size() - 1);
+}
+
+uint32_t FlatAST::internName(std::string_view name) {
+  auto [it, inserted] =
+      name_index_.try_emplace(std::string(name), names_.size());
+  if (inserted) {
+    names_.emplace_back(name);
+  }
+  return it->second;
+}
+
+void FlatAST::lower(Program& program) const {
+  STARTEAR_ASSERT(root_ != invalid_index);
+  lowerNode(root_, program);
+}
+
+void FlatAST::lowerNode(NodeIndex node, Program& program) const {
+  const auto nodes = children(node);
+  switch (kinds_[node]) {
+    case Kind::Number:
+      program.addInst(OPCode::OP_PUSH,
+                      {std::make_pair(Value::Category::Literal, number(node))});
+      break;
+    case Kind::Identifier:
+      program.addInst(OPCode::OP_LOAD_SLOT,
+                      {program.findLocalSlot(name(node))});
+      break;
+    case Kind::Unary:
+      lowerNode(nodes[0], program);
+      break;
+    case Kind::Binary: {
+      const auto op = static_cast<OPCode>(payloads_[node]);
+      lowerNode(nodes[0], program);
+      // Logical operators skip the right operand if the left one decides the
+      // result.
+      if (auto jump = shortCircuitOpcode(op)) {
+        auto label_end = program.getIndexedLabel();
+        program.addInst(*jump,
+                        {std::make_pair(Value::Category::Literal, label_end)});
+        lowerNode(nodes[1], program);
+        program.addLabel(label_end);
+        break;
+      }
+      lowerNode(nodes[1], program);
+      program.addInst(op);
+      break;
+    }
+    case Kind::Call:
+      for (auto arg : nodes) {
+        lowerNode(arg, program);
+      }
+      program.addInst(OPCode::OP_CALL, {std::make_pair(Value::Category::Variable,
+                                                       name(node))});
+      break;
+    case Kind::Let:
+      lowerNode(nodes[0], program);
+      program.addInst(OPCode::OP_STORE_SLOT,
+                      {program.resolveLocalSlot(name(node))});
+      break;
+    case Kind::Return:
+      lowerNode(nodes[0], program);
+      program.addInst(OPCode::OP_RETURN);
+      break;
+    case Kind::Function: {
+      std::vector<std::string> arg_names;
+      size_t i = 0;
+      for (; i < nodes.size() && kinds_[nodes[i]] == Kind::Param; ++i) {
+        arg_names.emplace_back(name(nodes[i]));
+      }
+      program.addFunction(std::string(name(node)), arg_names);
+      for (; i < nodes.size(); ++i) {
+        lowerNode(nodes[i], program);
+      }
+      if (nodes.size() == arg_names.size() ||
+          kinds_[nodes[nodes.size() - 1]] != Kind::Return) {
+        program.addInst(OPCode::OP_RETURN);
+      }
+      break;
+    }
+    case Kind::If: {
+      lowerNode(nodes[0], program);
+      auto label_if_entry = program.getIndexedLabel();
+      auto label_not_if_entry = program.getIndexedLabel();
+      program.addInst(
+          OPCode::OP_BRANCH,
+          {std::make_pair(Value::Category::Literal, label_if_entry),
+           std::make_pair(Value::Category::Literal, label_not_if_entry)});
+      for (size_t i = 1; i < nodes.size(); ++i) {
+        if (i == 1) {
+          program.addLabel(label_if_entry);
+        }
+        lowerNode(nodes[i], program);
+      }
+      program.addLabel(label_not_if_entry);
+      break;
+    }
+    case Kind::Block:
+      for (auto stmt : nodes) {
+        lowerNode(stmt, program);
+      }
+      break;
+    case Kind::Param:
+      NOT_REACHED;
+  }
+}
+
+}  // namespace Startear
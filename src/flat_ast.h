@@ -0,0 +1,125 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_FLAT_AST_H
+#define STARTEAR_FLAT_AST_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "opcode.h"
+#include "program.h"
+
+namespace Startear {
+
+class ASTNode;
+
+// AST stored as structure of arrays. Nodes are addressed by 32-bit index, and
+// children of a node are placed contiguously in a shared index array. Nodes
+// are appended in post order, so that children always precede their parent.
+class FlatAST {
+ public:
+  using NodeIndex = uint32_t;
+  static constexpr NodeIndex invalid_index =
+      std::numeric_limits<NodeIndex>::max();
+
+  enum class Kind : uint8_t {
+    Number,      // payload: index of number
+    Identifier,  // payload: index of name
+    Unary,       // payload: token type, children: operand
+    Binary,      // payload: opcode, children: lhs, rhs
+    Call,        // payload: index of name, children: arguments
+    Let,         // payload: index of name, children: value
+    Return,      // children: value
+    Param,       // payload: index of name
+    Function,    // payload: index of name, children: params, statements
+    If,          // children: condition, statements
+    Block,       // children: statements
+  };
+
+  class Children {
+   public:
+    Children(const NodeIndex* begin, const NodeIndex* end)
+        : begin_(begin), end_(end) {}
+    const NodeIndex* begin() const { return begin_; }
+    const NodeIndex* end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    NodeIndex operator[](size_t i) const { return begin_[i]; }
+
+   private:
+    const NodeIndex* begin_;
+    const NodeIndex* end_;
+  };
+
+  // Flatten the tree. Constants and simplifications by ConstantFoldingVisitor
+  // are reflected if the tree is folded in advance.
+  static FlatAST build(ASTNode& root);
+
+  NodeIndex addNode(Kind kind, uint32_t payload,
+                    const std::vector<NodeIndex>& children = {});
+  NodeIndex addNumber(double number);
+  // Returns the index of name, which is used as payload of named nodes.
+  uint32_t internName(std::string_view name);
+
+  // Emits the same instructions as StartearVMInstructionEmitter does for the
+  // original tree.
+  void lower(Program& program) const;
+
+  size_t size() const { return kinds_.size(); }
+  NodeIndex root() const { return root_; }
+  Kind kind(NodeIndex node) const { return kinds_[node]; }
+  uint32_t payload(NodeIndex node) const { return payloads_[node]; }
+  Children children(NodeIndex node) const {
+    const auto* begin = children_.data() + first_child_[node];
+    return Children(begin, begin + child_count_[node]);
+  }
+  double number(NodeIndex node) const { return numbers_[payloads_[node]]; }
+  std::string_view name(NodeIndex node) const {
+    return names_[payloads_[node]];
+  }
+
+ private:
+  void lowerNode(NodeIndex node, Program& program) const;
+
+  // Node records.
+  std::vector<Kind> kinds_;
+  std::vector<uint32_t> payloads_;
+  std::vector<uint32_t> first_child_;
+  std::vector<uint32_t> child_count_;
+  std::vector<NodeIndex> children_;
+
+  std::vector<double> numbers_;
+  std::vector<std::string> names_;
+  std::unordered_map<std::string, uint32_t> name_index_;
+  NodeIndex root_{invalid_index};
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_FLAT_AST_H
@@ -0,0 +1,750 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "jit.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+
+namespace Startear {
+
+#if defined(__x86_64__)
+namespace {
+enum Register : uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+};
+
+enum XMMRegister : uint8_t { XMM0 = 0, XMM1 = 1 };
+
+enum Condition : uint8_t {
+  Below = 0x2,
+  AboveEqual = 0x3,
+  Equal = 0x4,
+  NotEqual = 0x5,
+  Above = 0x7,
+  Parity = 0xa,
+  NotParity = 0xb,
+};
+
+// Minimal x86-64 encoder for the instructions which JIT emits. Memory operands
+// are always [base + disp32], where base must not be RSP or R12.
+class Assembler {
+ public:
+  using Label = size_t;
+
+  Label newLabel() {
+    labels_.emplace_back(std::nullopt);
+    return labels_.size() - 1;
+  }
+  void bind(Label label) { labels_[label] = code_.size(); }
+
+  void push(Register reg) {
+    if (reg >= 8) {
+      byte(0x41);
+    }
+    byte(0x50 | (reg & 7));
+  }
+  void pop(Register reg) {
+    if (reg >= 8) {
+      byte(0x41);
+    }
+    byte(0x58 | (reg & 7));
+  }
+  void ret() { byte(0xc3); }
+
+  void mov(Register dst, Register src) { rm(0x89, src, dst); }
+  void mov(Register dst, uint64_t imm) {
+    byte(rex(0, dst));
+    byte(0xb8 | (dst & 7));
+    append(imm);
+  }
+  void load(Register dst, Register base, int32_t disp) {
+    memory(0x8b, dst, base, disp);
+  }
+  void store(Register base, int32_t disp, Register src) {
+    memory(0x89, src, base, disp);
+  }
+  void lea(Register dst, Register base, int32_t disp) {
+    memory(0x8d, dst, base, disp);
+  }
+  void andq(Register dst, Register src) { rm(0x21, src, dst); }
+  // Compares lhs with rhs, i.e. flags of lhs - rhs.
+  void cmp(Register lhs, Register rhs) { rm(0x39, rhs, lhs); }
+  void neg(Register reg) {
+    byte(rex(0, reg));
+    byte(0xf7);
+    byte(modrm(3, 3, reg));
+  }
+  // setcc into AL or CL, followed by the zero extension of AL if needed.
+  void set(Condition cc, Register reg) {
+    STARTEAR_ASSERT(reg == RAX || reg == RCX);
+    bytes({0x0f, static_cast<uint8_t>(0x90 | cc), modrm(3, 0, reg)});
+  }
+  void andb(Register dst, Register src) {
+    bytes({0x20, modrm(3, src, dst)});
+  }
+  void orb(Register dst, Register src) { bytes({0x08, modrm(3, src, dst)}); }
+  void movzxb(Register dst, Register src) {
+    bytes({0x0f, 0xb6, modrm(3, dst, src)});
+  }
+
+  void movq(XMMRegister dst, Register src) {
+    byte(0x66);
+    byte(rex(0, src));
+    bytes({0x0f, 0x6e, modrm(3, dst, src)});
+  }
+  void movq(Register dst, XMMRegister src) {
+    byte(0x66);
+    byte(rex(0, dst));
+    bytes({0x0f, 0x7e, modrm(3, src, dst)});
+  }
+  // Scalar double operation, e.g. 0x58 for addsd.
+  void sd(uint8_t opcode, XMMRegister dst, XMMRegister src) {
+    bytes({0xf2, 0x0f, opcode, modrm(3, dst, src)});
+  }
+  void ucomisd(XMMRegister lhs, XMMRegister rhs) {
+    bytes({0x66, 0x0f, 0x2e, modrm(3, lhs, rhs)});
+  }
+  void xorpd(XMMRegister dst, XMMRegister src) {
+    bytes({0x66, 0x0f, 0x57, modrm(3, dst, src)});
+  }
+
+  void jump(Condition cc, Label target) {
+    bytes({0x0f, static_cast<uint8_t>(0x80 | cc)});
+    fixup(target);
+  }
+  void jump(Label target) {
+    byte(0xe9);
+    fixup(target);
+  }
+  void call(Label target) {
+    byte(0xe8);
+    fixup(target);
+  }
+  void call(const void* function) {
+    mov(RAX, reinterpret_cast<uint64_t>(function));
+    bytes({0xff, 0xd0});
+  }
+
+  // Resolves relative offsets of jumps and calls. All of labels must be bound.
+  const std::vector<uint8_t>& finalize() {
+    for (const auto& [position, label] : fixups_) {
+      STARTEAR_ASSERT(labels_[label].has_value());
+      auto rel = static_cast<int32_t>(static_cast<int64_t>(*labels_[label]) -
+                                      static_cast<int64_t>(position + 4));
+      memcpy(code_.data() + position, &rel, sizeof(rel));
+    }
+    fixups_.clear();
+    return code_;
+  }
+  size_t offset(Label label) const { return *labels_[label]; }
+
+ private:
+  static uint8_t rex(uint8_t reg, uint8_t rm) {
+    return 0x48 | ((reg >> 3) << 2) | (rm >> 3);
+  }
+  static uint8_t modrm(uint8_t mod, uint8_t reg, uint8_t rm) {
+    return (mod << 6) | ((reg & 7) << 3) | (rm & 7);
+  }
+  void rm(uint8_t opcode, uint8_t reg, uint8_t rm) {
+    bytes({rex(reg, rm), opcode, modrm(3, reg, rm)});
+  }
+  void memory(uint8_t opcode, uint8_t reg, Register base, int32_t disp) {
+    STARTEAR_ASSERT((base & 7) != 4);
+    bytes({rex(reg, base), opcode, modrm(2, reg, base)});
+    append(disp);
+  }
+  void fixup(Label target) {
+    fixups_.emplace_back(code_.size(), target);
+    append(int32_t{0});
+  }
+  void byte(uint8_t b) { code_.emplace_back(b); }
+  void bytes(std::initializer_list<uint8_t> bs) {
+    code_.insert(code_.end(), bs);
+  }
+  template <typename T>
+  void append(T v) {
+    auto offset = code_.size();
+    code_.resize(offset + sizeof(T));
+    memcpy(code_.data() + offset, &v, sizeof(T));
+  }
+
+  std::vector<uint8_t> code_;
+  std::vector<std::optional<size_t>> labels_;
+  std::vector<std::pair<size_t, Label>> fixups_;
+};
+
+[[noreturn]] void abortNativeCode(const char* message) {
+  std::cerr << message << std::endl;
+  NOT_REACHED;
+}
+
+std::optional<Value> literal(const Program& program, size_t i) {
+  auto value = program.fetchValue(i);
+  if (!value || value->category() != Value::Category::Literal) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+// The result of the abstract interpretation of function.
+struct Plan {
+  // Depth of operand stack before each of reachable instructions, which are
+  // ordered by program counter.
+  std::map<size_t, size_t> depths_;
+  size_t max_depth_{0};
+  bool returns_value_{false};
+};
+
+class Compiler {
+ public:
+  explicit Compiler(const Program& program)
+      : program_(program),
+        registry_(program.functionRegistry()),
+        plans_(registry_.size()),
+        returns_value_(registry_.size(), true) {}
+
+  // Finds compilable functions. Whether a function returns a value depends on
+  // its callees, so that it is iterated until the assumption is stable.
+  void analyze() {
+    std::vector<bool> compilable(registry_.size(), true);
+    for (size_t round = 0; round <= 2 * registry_.size() + 1; ++round) {
+      bool changed = false;
+      for (size_t id = 0; id < registry_.size(); ++id) {
+        if (!compilable[id]) {
+          continue;
+        }
+        auto plan = analyze(registry_.findById(id), compilable);
+        if (!plan) {
+          compilable[id] = false;
+          changed = true;
+        } else if (plan->returns_value_ != returns_value_[id]) {
+          returns_value_[id] = plan->returns_value_;
+          changed = true;
+        }
+        plans_[id] = std::move(plan);
+      }
+      if (!changed) {
+        return;
+      }
+    }
+    // Never stabilized.
+    std::fill(plans_.begin(), plans_.end(), std::nullopt);
+  }
+
+  const std::vector<uint8_t>& emit() {
+    type_error_ = assembler_.newLabel();
+    stack_overflow_ = assembler_.newLabel();
+    for (size_t id = 0; id < registry_.size(); ++id) {
+      entries_.emplace_back(assembler_.newLabel());
+    }
+    for (size_t id = 0; id < registry_.size(); ++id) {
+      if (plans_[id]) {
+        emitFunction(registry_.findById(id), *plans_[id]);
+      }
+    }
+    // Stack is aligned in function body, so that runtime can be called.
+    assembler_.bind(type_error_);
+    assembler_.mov(RDI, reinterpret_cast<uint64_t>("Operand is not a number"));
+    assembler_.call(reinterpret_cast<const void*>(&abortNativeCode));
+    assembler_.bind(stack_overflow_);
+    assembler_.mov(RDI, reinterpret_cast<uint64_t>("Stack overflow"));
+    assembler_.call(reinterpret_cast<const void*>(&abortNativeCode));
+    return assembler_.finalize();
+  }
+
+  bool compiled(size_t id) const { return plans_[id].has_value(); }
+  bool returnsValue(size_t id) const { return returns_value_[id]; }
+  size_t offset(size_t id) const { return assembler_.offset(entries_[id]); }
+
+ private:
+  std::optional<Plan> analyze(const Program::FunctionMetadata& function,
+                              const std::vector<bool>& compilable) const {
+    Plan plan;
+    std::optional<bool> returns_value;
+    const auto locals = function.locals_.size();
+    std::vector<std::pair<size_t, size_t>> worklist{{function.pc_, 0}};
+    while (!worklist.empty()) {
+      auto [pc, depth] = worklist.back();
+      worklist.pop_back();
+      if (auto itr = plan.depths_.find(pc); itr != plan.depths_.end()) {
+        if (itr->second != depth) {
+          return std::nullopt;
+        }
+        continue;
+      }
+      // Falling into other function is not supported.
+      if (pc >= program_.codeSize() ||
+          (pc != function.pc_ && registry_.findByProgramCounter(pc))) {
+        return std::nullopt;
+      }
+      plan.depths_.emplace(pc, depth);
+      plan.max_depth_ = std::max(plan.max_depth_, depth);
+      Instruction instr(program_.codeData() + pc);
+      const auto next = pc + instr.length();
+      const auto pops = [&depth](size_t n) {
+        if (depth < n) {
+          return false;
+        }
+        depth -= n;
+        return true;
+      };
+      // Quickened instructions are compiled as generic ones.
+      switch (genericOpcode(instr.opcode())) {
+        case OPCode::OP_PUSH:
+          if (!literal(program_, instr.operand(0))) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth + 1);
+          break;
+        case OPCode::OP_LOAD_SLOT:
+          if (instr.operand(0) >= locals) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth + 1);
+          break;
+        case OPCode::OP_STORE_SLOT:
+          if (instr.operand(0) >= locals || !pops(1)) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth);
+          break;
+        case OPCode::OP_PUSH_STORE:
+          if (!literal(program_, instr.operand(0)) ||
+              instr.operand(1) >= locals) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth);
+          break;
+        case OPCode::OP_ADD_SLOT_CONST: {
+          auto constant = program_.fetchValue(instr.operand(1));
+          if (instr.operand(0) >= locals || !constant ||
+              !constant->getDouble()) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth + 1);
+          break;
+        }
+        case OPCode::OP_ADD:
+        case OPCode::OP_SUB:
+        case OPCode::OP_MUL:
+        case OPCode::OP_DIV:
+        case OPCode::OP_EQUAL:
+        case OPCode::OP_BANG_EQUAL:
+        case OPCode::OP_LESS_EQUAL:
+        case OPCode::OP_GREATER_EQUAL:
+        case OPCode::OP_LESS:
+        case OPCode::OP_GREATER:
+          if (!pops(2)) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth + 1);
+          break;
+        case OPCode::OP_BRANCH:
+          if (!pops(1)) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(instr.operand(0), depth);
+          worklist.emplace_back(instr.operand(1), depth);
+          break;
+        case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+        case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+          if (depth == 0) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(instr.operand(0), depth);
+          worklist.emplace_back(next, depth - 1);
+          break;
+        case OPCode::OP_COMPARE_BRANCH:
+          if (!isComparison(static_cast<OPCode>(instr.operand(0))) ||
+              !pops(2)) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(instr.operand(1), depth);
+          worklist.emplace_back(instr.operand(2), depth);
+          break;
+        case OPCode::OP_CALL: {
+          const auto callee = instr.operand(0);
+          if (callee >= registry_.size() || !compilable[callee] ||
+              !pops(registry_.findById(callee).arity_)) {
+            return std::nullopt;
+          }
+          worklist.emplace_back(next, depth + (returns_value_[callee] ? 1 : 0));
+          break;
+        }
+        case OPCode::OP_TAIL_CALL: {
+          // Returns whatever callee returns.
+          const auto callee = instr.operand(0);
+          if (callee >= registry_.size() || !compilable[callee] ||
+              !pops(registry_.findById(callee).arity_) ||
+              (returns_value && *returns_value != returns_value_[callee])) {
+            return std::nullopt;
+          }
+          returns_value = returns_value_[callee];
+          break;
+        }
+        case OPCode::OP_RETURN:
+          // All of returns must agree on whether the value is returned.
+          if (returns_value && *returns_value != (depth > 0)) {
+            return std::nullopt;
+          }
+          returns_value = depth > 0;
+          break;
+        default:
+          // e.g. OP_PRINT, OP_AND and OP_OR, which are no longer emitted.
+          return std::nullopt;
+      }
+    }
+    plan.max_depth_ += 1;
+    plan.returns_value_ = returns_value.value_or(false);
+    return plan;
+  }
+
+  // Native frame keeps base of frame on RBX, limit of stack on R12, and the
+  // mask of boxed values on R13.
+  void emitFunction(const Program::FunctionMetadata& function,
+                    const Plan& plan) {
+    auto& a = assembler_;
+    const auto locals = function.locals_.size();
+    const auto slot = [](size_t i) { return static_cast<int32_t>(i * 8); };
+    // Operand at the given depth from the bottom of operand stack.
+    const auto operand = [&](size_t depth) { return slot(locals + depth); };
+
+    std::map<size_t, Assembler::Label> labels;
+    for (const auto& [pc, _] : plan.depths_) {
+      labels.emplace(pc, a.newLabel());
+    }
+
+    a.bind(entries_[function.id_]);
+    // Three pushes align the stack to 16 bytes.
+    a.push(RBX);
+    a.push(R12);
+    a.push(R13);
+    a.mov(RBX, RDI);
+    a.mov(R12, RSI);
+    a.lea(RAX, RBX, slot(locals + plan.max_depth_));
+    a.cmp(RAX, R12);
+    a.jump(Above, stack_overflow_);
+    a.mov(R13, Value::boxedMask());
+    if (locals > function.arity_) {
+      a.mov(RAX, Value().bits());
+      for (auto i = function.arity_; i < locals; ++i) {
+        a.store(RBX, slot(i), RAX);
+      }
+    }
+
+    const auto guard = [&](Register reg) {
+      a.mov(RDX, reg);
+      a.andq(RDX, R13);
+      a.cmp(RDX, R13);
+      a.jump(Equal, type_error_);
+    };
+    // Loads two operands on the top into XMM0 and XMM1.
+    const auto load_operands = [&](size_t depth) {
+      a.load(RAX, RBX, operand(depth - 2));
+      a.load(RCX, RBX, operand(depth - 1));
+      guard(RAX);
+      guard(RCX);
+      a.movq(XMM0, RAX);
+      a.movq(XMM1, RCX);
+    };
+    // Compares XMM0 and XMM1, and jumps to if_true if the comparison holds.
+    const auto compare_branch = [&](OPCode code, Assembler::Label if_true,
+                                    Assembler::Label if_false) {
+      switch (code) {
+        case OPCode::OP_EQUAL:
+          a.ucomisd(XMM0, XMM1);
+          a.jump(Parity, if_false);
+          a.jump(Equal, if_true);
+          break;
+        case OPCode::OP_BANG_EQUAL:
+          a.ucomisd(XMM0, XMM1);
+          a.jump(Parity, if_true);
+          a.jump(NotEqual, if_true);
+          break;
+        case OPCode::OP_GREATER:
+          a.ucomisd(XMM0, XMM1);
+          a.jump(Above, if_true);
+          break;
+        case OPCode::OP_GREATER_EQUAL:
+          a.ucomisd(XMM0, XMM1);
+          a.jump(AboveEqual, if_true);
+          break;
+        case OPCode::OP_LESS:
+          a.ucomisd(XMM1, XMM0);
+          a.jump(Above, if_true);
+          break;
+        case OPCode::OP_LESS_EQUAL:
+          a.ucomisd(XMM1, XMM0);
+          a.jump(AboveEqual, if_true);
+          break;
+        default:
+          NOT_REACHED;
+      }
+      a.jump(if_false);
+    };
+
+    for (const auto& [pc, depth] : plan.depths_) {
+      a.bind(labels.at(pc));
+      Instruction instr(program_.codeData() + pc);
+      const auto code = genericOpcode(instr.opcode());
+      switch (code) {
+        case OPCode::OP_PUSH:
+          a.mov(RAX, literal(program_, instr.operand(0))->bits());
+          a.store(RBX, operand(depth), RAX);
+          break;
+        case OPCode::OP_LOAD_SLOT:
+          a.load(RAX, RBX, slot(instr.operand(0)));
+          a.store(RBX, operand(depth), RAX);
+          break;
+        case OPCode::OP_STORE_SLOT:
+          a.load(RAX, RBX, operand(depth - 1));
+          a.store(RBX, slot(instr.operand(0)), RAX);
+          break;
+        case OPCode::OP_PUSH_STORE:
+          a.mov(RAX, literal(program_, instr.operand(0))->bits());
+          a.store(RBX, slot(instr.operand(1)), RAX);
+          break;
+        case OPCode::OP_ADD_SLOT_CONST:
+          a.load(RAX, RBX, slot(instr.operand(0)));
+          guard(RAX);
+          a.movq(XMM0, RAX);
+          a.mov(RCX, program_.fetchValue(instr.operand(1))->bits());
+          a.movq(XMM1, RCX);
+          a.sd(0x58, XMM0, XMM1);
+          a.movq(RAX, XMM0);
+          a.store(RBX, operand(depth), RAX);
+          break;
+        case OPCode::OP_ADD:
+        case OPCode::OP_SUB:
+        case OPCode::OP_MUL:
+        case OPCode::OP_DIV: {
+          load_operands(depth);
+          const uint8_t opcodes[] = {0x58, 0x5c, 0x59, 0x5e};
+          a.sd(opcodes[static_cast<size_t>(code) -
+                       static_cast<size_t>(OPCode::OP_ADD)],
+               XMM0, XMM1);
+          // Arithmetic on doubles never yields the bits of boxed values.
+          a.movq(RAX, XMM0);
+          a.store(RBX, operand(depth - 2), RAX);
+          break;
+        }
+        case OPCode::OP_EQUAL:
+        case OPCode::OP_BANG_EQUAL:
+        case OPCode::OP_LESS_EQUAL:
+        case OPCode::OP_GREATER_EQUAL:
+        case OPCode::OP_LESS:
+        case OPCode::OP_GREATER: {
+          load_operands(depth);
+          switch (code) {
+            case OPCode::OP_EQUAL:
+              a.ucomisd(XMM0, XMM1);
+              a.set(Equal, RAX);
+              a.set(NotParity, RCX);
+              a.andb(RAX, RCX);
+              break;
+            case OPCode::OP_BANG_EQUAL:
+              a.ucomisd(XMM0, XMM1);
+              a.set(NotEqual, RAX);
+              a.set(Parity, RCX);
+              a.orb(RAX, RCX);
+              break;
+            case OPCode::OP_GREATER:
+              a.ucomisd(XMM0, XMM1);
+              a.set(Above, RAX);
+              break;
+            case OPCode::OP_GREATER_EQUAL:
+              a.ucomisd(XMM0, XMM1);
+              a.set(AboveEqual, RAX);
+              break;
+            case OPCode::OP_LESS:
+              a.ucomisd(XMM1, XMM0);
+              a.set(Above, RAX);
+              break;
+            default:
+              a.ucomisd(XMM1, XMM0);
+              a.set(AboveEqual, RAX);
+              break;
+          }
+          // 1.0 or 0.0 from the flag.
+          a.movzxb(RAX, RAX);
+          a.neg(RAX);
+          a.mov(RCX, Value(Value::Category::Literal, 1.0).bits());
+          a.andq(RAX, RCX);
+          a.store(RBX, operand(depth - 2), RAX);
+          break;
+        }
+        case OPCode::OP_BRANCH:
+          a.load(RAX, RBX, operand(depth - 1));
+          guard(RAX);
+          a.movq(XMM0, RAX);
+          a.xorpd(XMM1, XMM1);
+          a.ucomisd(XMM0, XMM1);
+          a.jump(Parity, labels.at(instr.operand(0)));
+          a.jump(NotEqual, labels.at(instr.operand(0)));
+          a.jump(labels.at(instr.operand(1)));
+          break;
+        case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+        case OPCode::OP_JUMP_IF_TRUE_OR_POP: {
+          // Jumps with the left operand if it decides the result. It must be
+          // 0.0 or 1.0 otherwise.
+          const double decisive =
+              code == OPCode::OP_JUMP_IF_TRUE_OR_POP ? 1.0 : 0.0;
+          a.load(RAX, RBX, operand(depth - 1));
+          guard(RAX);
+          a.movq(XMM0, RAX);
+          a.mov(RCX, Value(Value::Category::Literal, decisive).bits());
+          a.movq(XMM1, RCX);
+          a.ucomisd(XMM0, XMM1);
+          a.jump(Parity, type_error_);
+          a.jump(Equal, labels.at(instr.operand(0)));
+          a.mov(RCX, Value(Value::Category::Literal, 1.0 - decisive).bits());
+          a.movq(XMM1, RCX);
+          a.ucomisd(XMM0, XMM1);
+          a.jump(NotEqual, type_error_);
+          break;
+        }
+        case OPCode::OP_COMPARE_BRANCH:
+          load_operands(depth);
+          compare_branch(static_cast<OPCode>(instr.operand(0)),
+                         labels.at(instr.operand(1)),
+                         labels.at(instr.operand(2)));
+          break;
+        case OPCode::OP_CALL: {
+          const auto& callee = registry_.findById(instr.operand(0));
+          const auto base = operand(depth - callee.arity_);
+          a.lea(RDI, RBX, base);
+          a.mov(RSI, R12);
+          a.call(entries_[callee.id_]);
+          if (returns_value_[callee.id_]) {
+            a.store(RBX, base, RAX);
+          }
+          break;
+        }
+        case OPCode::OP_TAIL_CALL: {
+          // Arguments are moved to the base of frame, and callee is entered
+          // with the registers of caller restored, so that it returns to the
+          // caller of this function.
+          const auto& callee = registry_.findById(instr.operand(0));
+          const auto first = depth - callee.arity_;
+          for (size_t i = 0; i < callee.arity_; ++i) {
+            a.load(RAX, RBX, operand(first + i));
+            a.store(RBX, slot(i), RAX);
+          }
+          a.mov(RDI, RBX);
+          a.mov(RSI, R12);
+          a.pop(R13);
+          a.pop(R12);
+          a.pop(RBX);
+          a.jump(entries_[callee.id_]);
+          break;
+        }
+        case OPCode::OP_RETURN:
+          if (depth > 0) {
+            a.load(RAX, RBX, operand(depth - 1));
+          }
+          a.pop(R13);
+          a.pop(R12);
+          a.pop(RBX);
+          a.ret();
+          break;
+        default:
+          NOT_REACHED;
+      }
+    }
+  }
+
+  const Program& program_;
+  const Program::FunctionRegistry& registry_;
+  std::vector<std::optional<Plan>> plans_;
+  std::vector<bool> returns_value_;
+  Assembler assembler_;
+  std::vector<Assembler::Label> entries_;
+  Assembler::Label type_error_;
+  Assembler::Label stack_overflow_;
+};
+}  // namespace
+
+JIT::JIT(const Program& program)
+    : entries_(program.functionRegistry().size(), nullptr),
+      returns_value_(program.functionRegistry().size(), false) {
+  Compiler compiler(program);
+  compiler.analyze();
+  const auto& code = compiler.emit();
+  // Pages are never writable and executable at the same time.
+  void* pages = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED) {
+    return;
+  }
+  memcpy(pages, code.data(), code.size());
+  if (mprotect(pages, code.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(pages, code.size());
+    return;
+  }
+  code_ = pages;
+  code_size_ = code.size();
+  for (size_t id = 0; id < entries_.size(); ++id) {
+    if (compiler.compiled(id)) {
+      entries_[id] = reinterpret_cast<Entry>(static_cast<uint8_t*>(code_) +
+                                             compiler.offset(id));
+      returns_value_[id] = compiler.returnsValue(id);
+    }
+  }
+}
+
+JIT::~JIT() {
+  if (code_) {
+    munmap(code_, code_size_);
+  }
+}
+#else
+// Other architectures are always interpreted.
+JIT::JIT(const Program& program)
+    : entries_(program.functionRegistry().size(), nullptr),
+      returns_value_(program.functionRegistry().size(), false) {}
+
+JIT::~JIT() = default;
+#endif
+
+size_t JIT::compiledCount() const {
+  return std::count_if(entries_.begin(), entries_.end(),
+                       [](Entry entry) { return entry != nullptr; });
+}
+
+}  // namespace Startear
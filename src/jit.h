@@ -0,0 +1,80 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_JIT_H
+#define STARTEAR_JIT_H
+
+#include <cstddef>
+#include <vector>
+
+#include "program.h"
+
+namespace Startear {
+
+// Baseline method JIT, which translates functions into x86-64 machine code.
+//
+// Native code runs on the value stack of VM in the same layout as the frame
+// of interpreter, where local variables are followed by operands. The depth of
+// operand stack is resolved at compile time, so that each operand is kept on
+// the fixed slot of the frame, and no instruction is dispatched at runtime.
+//
+// Function is compiled only if all of reachable instructions are supported,
+// the depth of operand stack is consistent on each of them, and all of callees
+// are compiled. Others are left to the interpreter.
+class JIT {
+ public:
+  // Arguments have been placed on the first slots from base, and the frame
+  // must not exceed limit. It returns the value which the function returns,
+  // which is meaningful only if returnsValue() is true.
+  using Entry = Value (*)(Value* base, const Value* limit);
+
+  explicit JIT(const Program& program);
+  ~JIT();
+
+  JIT(const JIT&) = delete;
+  JIT& operator=(const JIT&) = delete;
+
+  // Returns nullptr if the function is interpreted.
+  Entry entry(size_t function_id) const {
+    STARTEAR_ASSERT(function_id < entries_.size());
+    return entries_[function_id];
+  }
+  bool returnsValue(size_t function_id) const {
+    STARTEAR_ASSERT(function_id < returns_value_.size());
+    return returns_value_[function_id];
+  }
+  size_t compiledCount() const;
+
+ private:
+  // Executable pages which hold the code of all of compiled functions.
+  void* code_{nullptr};
+  size_t code_size_{0};
+  std::vector<Entry> entries_;
+  std::vector<bool> returns_value_;
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_JIT_H
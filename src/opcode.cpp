@@ -26,6 +26,7 @@
 #include "opcode.h"
 
 #include <string>
+#include <utility>
 
 namespace Startear {
 std::string opcodeToString(OPCode op) {
@@ -42,10 +43,10 @@ std::string opcodeToString(OPCode op) {
       return "OP_MUL";
     case OPCode::OP_DIV:
       return "OP_DIV";
-    case OPCode::OP_STORE_LOCAL:
-      return "OP_STORE_LOCAL";
-    case OPCode::OP_LOAD_LOCAL:
-      return "OP_LOAD_LOCAL";
+    case OPCode::OP_STORE_SLOT:
+      return "OP_STORE_SLOT";
+    case OPCode::OP_LOAD_SLOT:
+      return "OP_LOAD_SLOT";
     case OPCode::OP_CALL:
       return "OP_CALL";
     case OPCode::OP_RETURN:
@@ -66,22 +67,76 @@ std::string opcodeToString(OPCode op) {
       return "OP_AND";
     case OPCode::OP_OR:
       return "OP_OR";
+    case OPCode::OP_BRANCH:
+      return "OP_BRANCH";
+    case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+      return "OP_JUMP_IF_FALSE_OR_POP";
+    case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+      return "OP_JUMP_IF_TRUE_OR_POP";
+    case OPCode::OP_ADD_SLOT_CONST:
+      return "OP_ADD_SLOT_CONST";
+    case OPCode::OP_COMPARE_BRANCH:
+      return "OP_COMPARE_BRANCH";
+    case OPCode::OP_PUSH_STORE:
+      return "OP_PUSH_STORE";
+    case OPCode::OP_ADD_DOUBLE:
+      return "OP_ADD_DOUBLE";
+    case OPCode::OP_SUB_DOUBLE:
+      return "OP_SUB_DOUBLE";
+    case OPCode::OP_MUL_DOUBLE:
+      return "OP_MUL_DOUBLE";
+    case OPCode::OP_DIV_DOUBLE:
+      return "OP_DIV_DOUBLE";
+    case OPCode::OP_EQUAL_DOUBLE:
+      return "OP_EQUAL_DOUBLE";
+    case OPCode::OP_BANG_EQUAL_DOUBLE:
+      return "OP_BANG_EQUAL_DOUBLE";
+    case OPCode::OP_LESS_EQUAL_DOUBLE:
+      return "OP_LESS_EQUAL_DOUBLE";
+    case OPCode::OP_GREATER_EQUAL_DOUBLE:
+      return "OP_GREATER_EQUAL_DOUBLE";
+    case OPCode::OP_LESS_DOUBLE:
+      return "OP_LESS_DOUBLE";
+    case OPCode::OP_GREATER_DOUBLE:
+      return "OP_GREATER_DOUBLE";
+    case OPCode::OP_TAIL_CALL:
+      return "OP_TAIL_CALL";
+    case OPCode::OP_HALT:
+      return "OP_HALT";
     default:
       return "";
   }
 }
 
+size_t operandSize(OPCode code) {
+  switch (code) {
+    case OPCode::OP_PRINT:
+    case OPCode::OP_PUSH:
+    case OPCode::OP_STORE_SLOT:
+    case OPCode::OP_LOAD_SLOT:
+    case OPCode::OP_CALL:
+    case OPCode::OP_TAIL_CALL:
+    case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+    case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+      return 1;
+    case OPCode::OP_BRANCH:
+    case OPCode::OP_ADD_SLOT_CONST:
+    case OPCode::OP_PUSH_STORE:
+      return 2;
+    case OPCode::OP_COMPARE_BRANCH:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
 bool validOperandSize(OPCode code, size_t operand_size) {
-  const auto expect_size = [&operand_size](size_t expected) {
-    return operand_size == expected;
-  };
   switch (code) {
     case OPCode::OP_PRINT:
     case OPCode::OP_PUSH:
-    case OPCode::OP_STORE_LOCAL:
-    case OPCode::OP_LOAD_LOCAL:
+    case OPCode::OP_STORE_SLOT:
+    case OPCode::OP_LOAD_SLOT:
     case OPCode::OP_CALL:
-      return expect_size(1);
     case OPCode::OP_ADD:
     case OPCode::OP_SUB:
     case OPCode::OP_MUL:
@@ -95,12 +150,78 @@ bool validOperandSize(OPCode code, size_t operand_size) {
     case OPCode::OP_AND:
     case OPCode::OP_GREATER:
     case OPCode::OP_RETURN:
-      return expect_size(0);
     case OPCode::OP_BRANCH:
-      return expect_size(2);
+    case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+    case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+    case OPCode::OP_ADD_SLOT_CONST:
+    case OPCode::OP_COMPARE_BRANCH:
+    case OPCode::OP_PUSH_STORE:
+    case OPCode::OP_TAIL_CALL:
+    case OPCode::OP_HALT:
+      return operandSize(code) == operand_size;
     default:
+      // Quickened instructions are never emitted.
       return false;
   }
 }
 
-}  // namespace Startear
\ No newline at end of file
+namespace {
+// Pairs of generic and quickened opcodes.
+constexpr std::pair<OPCode, OPCode> quickened_opcodes[] = {
+    {OPCode::OP_ADD, OPCode::OP_ADD_DOUBLE},
+    {OPCode::OP_SUB, OPCode::OP_SUB_DOUBLE},
+    {OPCode::OP_MUL, OPCode::OP_MUL_DOUBLE},
+    {OPCode::OP_DIV, OPCode::OP_DIV_DOUBLE},
+    {OPCode::OP_EQUAL, OPCode::OP_EQUAL_DOUBLE},
+    {OPCode::OP_BANG_EQUAL, OPCode::OP_BANG_EQUAL_DOUBLE},
+    {OPCode::OP_LESS_EQUAL, OPCode::OP_LESS_EQUAL_DOUBLE},
+    {OPCode::OP_GREATER_EQUAL, OPCode::OP_GREATER_EQUAL_DOUBLE},
+    {OPCode::OP_LESS, OPCode::OP_LESS_DOUBLE},
+    {OPCode::OP_GREATER, OPCode::OP_GREATER_DOUBLE},
+};
+}  // namespace
+
+std::optional<OPCode> quickenedOpcode(OPCode generic) {
+  for (const auto& [from, to] : quickened_opcodes) {
+    if (from == generic) {
+      return to;
+    }
+  }
+  return std::nullopt;
+}
+
+OPCode genericOpcode(OPCode code) {
+  for (const auto& [from, to] : quickened_opcodes) {
+    if (to == code) {
+      return from;
+    }
+  }
+  return code;
+}
+
+bool isComparison(OPCode code) {
+  switch (code) {
+    case OPCode::OP_EQUAL:
+    case OPCode::OP_BANG_EQUAL:
+    case OPCode::OP_LESS_EQUAL:
+    case OPCode::OP_GREATER_EQUAL:
+    case OPCode::OP_LESS:
+    case OPCode::OP_GREATER:
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::optional<OPCode> shortCircuitOpcode(OPCode logical) {
+  switch (logical) {
+    case OPCode::OP_AND:
+      return OPCode::OP_JUMP_IF_FALSE_OR_POP;
+    case OPCode::OP_OR:
+      return OPCode::OP_JUMP_IF_TRUE_OR_POP;
+    default:
+      return std::nullopt;
+  }
+}
+
+}  // namespace Startear
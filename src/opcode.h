@@ -26,11 +26,13 @@
 #ifndef STARTEAR_ALL_OPCODE_H
 #define STARTEAR_ALL_OPCODE_H
 
+#include <cstdint>
+#include <optional>
 #include <string>
 
 namespace Startear {
 
-enum class OPCode : size_t {
+enum class OPCode : uint8_t {
   /**
    * Print a operand
    * e.g.
@@ -52,15 +54,16 @@ enum class OPCode : size_t {
   OP_MUL,
   OP_DIV,
   /**
-   * Save stack top value with operand variable name.
-   * e.g. OP_STORE_LOCAL "n"
+   * Save stack top value to the local variable slot of current frame.
+   * The slot index is resolved at code generation phase.
+   * e.g. OP_STORE_SLOT 0
    */
-  OP_STORE_LOCAL,
+  OP_STORE_SLOT,
   /**
-   * Look up specified variable and push top of stack.
-   * e.g. OP_LOAD_LOCAL "n"
+   * Look up specified local variable slot and push top of stack.
+   * e.g. OP_LOAD_SLOT 0
    */
-  OP_LOAD_LOCAL,
+  OP_LOAD_SLOT,
   /**
    * Call function.
    * e.g. OP_CALL "sub"
@@ -77,7 +80,7 @@ enum class OPCode : size_t {
    * 42 | OP_PUSH 32         # first argument
    * 43 | OP_CALL "sub"      # function call. It will set next pointer to return
    * back.
-   * 44 | OP_STORE_LOCAL "n" # Store returned value from function "sub"
+   * 44 | OP_STORE_SLOT 0    # Store returned value from function "sub"
    *
    * Note that only to use this instruction without operands will be treated as
    * startup function like "main".
@@ -113,12 +116,99 @@ enum class OPCode : size_t {
    * e.g. OP_BRANCH <target label when true> <target label when false>
    */
   OP_BRANCH,
+  /**
+   * Short-circuit evaluation of `&&` and `||`. If the top of stack decides the
+   * result, that is 0.0 for `&&` and 1.0 for `||`, it jumps to the operand
+   * with the value remained as the result. Otherwise it pops the value, and
+   * the right operand follows. The value must be 0.0 or 1.0.
+   *
+   * e.g. `a && b`
+   * OP_LOAD_SLOT a
+   * OP_JUMP_IF_FALSE_OR_POP <end label>
+   * OP_LOAD_SLOT b
+   * <end label>
+   */
+  OP_JUMP_IF_FALSE_OR_POP,
+  OP_JUMP_IF_TRUE_OR_POP,
+  /**
+   * Superinstructions. They are not emitted by code generation directly, but
+   * the peephole pass fuses frequent sequences into them to reduce the number
+   * of dispatches.
+   *
+   * OP_ADD_SLOT_CONST <slot> <value>
+   *   = OP_LOAD_SLOT <slot>; OP_PUSH <value>; OP_ADD
+   * OP_COMPARE_BRANCH <comparison opcode> <true label> <false label>
+   *   = OP_EQUAL (or other comparisons); OP_BRANCH <true label> <false label>
+   * OP_PUSH_STORE <value> <slot>
+   *   = OP_PUSH <value>; OP_STORE_SLOT <slot>
+   */
+  OP_ADD_SLOT_CONST,
+  OP_COMPARE_BRANCH,
+  OP_PUSH_STORE,
+  /**
+   * Quickened instructions. They are not emitted by code generation either,
+   * but VM rewrites generic arithmetic and comparisons into them in place
+   * once both operands are observed to be doubles. They skip type dispatch,
+   * and are rewritten back to the generic ones if the operands are not doubles.
+   *
+   * OP_ADD_DOUBLE = OP_ADD on two doubles, and so on.
+   */
+  OP_ADD_DOUBLE,
+  OP_SUB_DOUBLE,
+  OP_MUL_DOUBLE,
+  OP_DIV_DOUBLE,
+  OP_EQUAL_DOUBLE,
+  OP_BANG_EQUAL_DOUBLE,
+  OP_LESS_EQUAL_DOUBLE,
+  OP_GREATER_EQUAL_DOUBLE,
+  OP_LESS_DOUBLE,
+  OP_GREATER_DOUBLE,
+  /**
+   * Call function in tail position, whose result is returned by caller as is.
+   * This is not emitted by code generation either, but linker rewrites
+   * OP_CALL followed by OP_RETURN (or by storing the result to a slot and
+   * returning the slot) into it. The instructions which follow are left as
+   * they are.
+   * e.g. OP_TAIL_CALL "sub"
+   *
+   * Callee reuses the frame of caller instead of pushing new one, so that
+   * recursion in tail position runs in constant frames. The entry frame is
+   * never reused, and then it behaves like OP_CALL.
+   */
+  OP_TAIL_CALL,
+  /**
+   * Terminate the program. This is appended to the end of instructions by
+   * linker as sentinel, so that VM doesn't have to check the end of program on
+   * every instruction.
+   */
+  OP_HALT,
+  // The number of opcodes. This is not an instruction.
+  OPCODE_SIZE,
 };
 
 std::string opcodeToString(OPCode op);
 
+// The number of operands which the instruction takes. Each of them is encoded
+// as fixed width operand_t following the opcode byte.
+size_t operandSize(OPCode code);
+
 bool validOperandSize(OPCode, size_t operand_size);
 
+// Quickened variant of generic arithmetic or comparison. Returns std::nullopt
+// if the opcode has no variant.
+std::optional<OPCode> quickenedOpcode(OPCode generic);
+// Generic opcode of quickened one. Others are returned as is.
+OPCode genericOpcode(OPCode code);
+
+// Comparison which yields 1 or 0, e.g. OP_LESS. Quickened ones are excluded.
+bool isComparison(OPCode code);
+
+// Conditional jump which lowers OP_AND or OP_OR with short-circuit evaluation.
+// Returns std::nullopt for other opcodes.
+std::optional<OPCode> shortCircuitOpcode(OPCode logical);
+
+using operand_t = uint32_t;
+
 }  // namespace Startear
 
 #endif  // STARTEAR_ALL_OPCODE_H
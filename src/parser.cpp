@@ -35,197 +35,252 @@ bool isDigit(char c) { return c >= '0' && c <= '9'; }
 
 ASTNodePtr Parser::parse() { return programDeclaration(); }
 
-BasicExpressionPtr Parser::basicExpression() {
-  return std::make_unique<BasicExpression>(orLogicExpression());
+namespace {
+// Downcast the node whose type is known by its tier.
+template <class T>
+ArenaPtr<T> nodeAs(ASTNodePtr node) {
+  return ArenaPtr<T>(static_cast<T*>(node.release()));
 }
+}  // namespace
 
-OrLogicExpressionPtr Parser::orLogicExpression() {
-  auto left = andLogicExpression();
-  OrLogicExpressionPtr or_expr;
-  while (match(TokenType::BAR_BAR)) {
-    auto& root_token = tokens_[current_];
-    forward();
-    auto right = andLogicExpression();
-    if (right != nullptr) {
-      or_expr = std::make_unique<OrLogicExpression>(std::make_unique<Equality>(root_token),
-              std::move(left), std::move(right));
-    } else {
-      auto or_right = orLogicExpression();
-      or_expr = std::make_unique<OrLogicExpression>(std::make_unique<Equality>(root_token),
-              std::move(left), std::move(or_right));
-    }
-  }
-  if (or_expr != nullptr) {
-    return or_expr;
+std::optional<Tier> binaryTier(TokenType type) {
+  switch (type) {
+    case TokenType::STAR:
+    case TokenType::SLASH:
+      return Tier::Multiplication;
+    case TokenType::PLUS:
+    case TokenType::MINUS:
+      return Tier::Addition;
+    case TokenType::GREATER:
+    case TokenType::GREATER_EQUAL:
+    case TokenType::LESS:
+    case TokenType::LESS_EQUAL:
+      return Tier::Comparison;
+    case TokenType::EQUAL_EQUAL:
+    case TokenType::BANG_EQUAL:
+      return Tier::Equality;
+    case TokenType::AND_AND:
+      return Tier::AndLogic;
+    case TokenType::BAR_BAR:
+      return Tier::OrLogic;
+    default:
+      return std::nullopt;
   }
-  return std::make_unique<OrLogicExpression>(std::move(left));
 }
 
-AndLogicExpressionPtr Parser::andLogicExpression() {
-  auto left = equalityExpression();
-  AndLogicExpressionPtr and_expr;
-  while (match(TokenType::AND_AND)) {
-    auto& root_token = tokens_[current_];
-    forward();
-    auto right = equalityExpression();
-    if (right != nullptr) {
-      and_expr = std::make_unique<AndLogicExpression>(std::make_unique<Equality>(root_token),
-                                                    std::move(left), std::move(right));
-    } else {
-      auto or_right = andLogicExpression();
-      and_expr = std::make_unique<AndLogicExpression>(std::make_unique<Equality>(root_token),
-                                                    std::move(left), std::move(or_right));
-    }
-  }
-  if (and_expr != nullptr) {
-    return and_expr;
-  }
-  return std::make_unique<AndLogicExpression>(std::move(left));
+BasicExpressionPtr Parser::basicExpression() {
+  return arena_.make<BasicExpression>(orLogicExpression());
 }
 
-EqualityExpressionPtr Parser::equalityExpression() {
-  auto left = comparisonExpression();
-  EqualityExpressionPtr eql;
-
-  while (match(TokenType::BANG_EQUAL) || match(TokenType::EQUAL_EQUAL)) {
-    auto& root_token = tokens_[current_];
-    forward();
-    auto right = comparisonExpression();
-
-    if (eql == nullptr) {
-      eql = std::make_unique<EqualityExpression>(
-          std::make_unique<Equality>(root_token), std::move(left),
-          std::move(right));
-    } else {
-      auto new_eql = std::make_unique<EqualityExpression>(
-          std::make_unique<Equality>(root_token), std::move(eql),
-          std::move(right));
-      eql = std::move(new_eql);
-    }
-  }
-
-  if (eql == nullptr) {
-    eql = std::make_unique<EqualityExpression>(std::move(left));
-  }
-
-  return eql;
+OrLogicExpressionPtr Parser::orLogicExpression() {
+  return nodeAs<OrLogicExpression>(
+      promote(binaryExpression(Tier::OrLogic), Tier::OrLogic).node_);
 }
 
-ComparisonExpressionPtr Parser::comparisonExpression() {
-  auto left = additionExpression();
-  ComparisonExpressionPtr cmp;
+EqualityExpressionPtr Parser::equalityExpression() {
+  return nodeAs<EqualityExpression>(
+      promote(binaryExpression(Tier::Equality), Tier::Equality).node_);
+}
 
-  while (match(TokenType::GREATER) || match(TokenType::GREATER_EQUAL)
-  || match(TokenType::LESS_EQUAL) || match(TokenType::LESS)) {
-    auto& root_token = tokens_[current_];
-    forward();
-    auto right = additionExpression();
-    if (cmp == nullptr) {
-      cmp = std::make_unique<ComparisonExpression>(
-          std::make_unique<Compare>(root_token), std::move(left),
-          std::move(right));
-    } else {
-      auto new_cmp = std::make_unique<ComparisonExpression>(
-          std::make_unique<Compare>(root_token), std::move(cmp),
-          std::move(right));
-      cmp = std::move(new_cmp);
+Parser::Operand Parser::binaryExpression(Tier max_tier) {
+  Operand lhs{Tier::Unary, unaryExpression()};
+  while (const auto* token = at(0)) {
+    auto tier = binaryTier(token->type());
+    if (!tier || *tier > max_tier) {
+      break;
     }
+    auto op = *token;
+    forward();
+    // Right operand of left associative operator must be tighter.
+    auto rhs = binaryExpression(
+        isRightAssociative(*tier)
+            ? *tier
+            : static_cast<Tier>(static_cast<int>(*tier) - 1));
+    lhs = combine(*tier, op, std::move(lhs), std::move(rhs));
   }
-  if (cmp == nullptr) {
-    cmp = std::make_unique<ComparisonExpression>(std::move(left));
-  }
-  return cmp;
+  return lhs;
 }
 
-AdditionExpressionPtr Parser::additionExpression() {
-  auto left = multiplicationExpression();
-  AdditionExpressionPtr add;
-
-  while (match(TokenType::MINUS) || match(TokenType::PLUS)) {
-    auto& root_token = tokens_[current_];
-    forward();
-    auto right = multiplicationExpression();
-
-    if (add == nullptr) {
-      add = std::make_unique<AdditionExpression>(
-          std::make_unique<Addition>(root_token), std::move(left),
-          std::move(right));
-    } else {
-      auto new_add = std::make_unique<AdditionExpression>(
-          std::make_unique<Addition>(root_token), std::move(add),
-          std::move(right));
-      add = std::move(new_add);
+Parser::Operand Parser::promote(Operand operand, Tier tier) {
+  while (operand.tier_ < tier) {
+    auto& node = operand.node_;
+    switch (operand.tier_) {
+      case Tier::Unary:
+        node = arena_.make<MultiplicationExpression>(
+            nodeAs<UnaryExpression>(std::move(node)));
+        break;
+      case Tier::Multiplication:
+        node = arena_.make<AdditionExpression>(
+            nodeAs<MultiplicationExpression>(std::move(node)));
+        break;
+      case Tier::Addition:
+        node = arena_.make<ComparisonExpression>(
+            nodeAs<AdditionExpression>(std::move(node)));
+        break;
+      case Tier::Comparison:
+        node = arena_.make<EqualityExpression>(
+            nodeAs<ComparisonExpression>(std::move(node)));
+        break;
+      case Tier::Equality:
+        node = arena_.make<AndLogicExpression>(
+            nodeAs<EqualityExpression>(std::move(node)));
+        break;
+      case Tier::AndLogic:
+        node = arena_.make<OrLogicExpression>(
+            nodeAs<AndLogicExpression>(std::move(node)));
+        break;
+      case Tier::OrLogic:
+        NOT_REACHED;
     }
+    operand.tier_ = static_cast<Tier>(static_cast<int>(operand.tier_) + 1);
   }
-
-  if (add == nullptr) {
-    add = std::make_unique<AdditionExpression>(std::move(left));
-  }
-
-  return add;
+  return operand;
 }
 
-MultiplicationExpressionPtr Parser::multiplicationExpression() {
-  auto left = unaryExpression();
-  MultiplicationExpressionPtr mul;
-
-  while (match(TokenType::SLASH) || match(TokenType::STAR)) {
-    auto root_token = tokens_[current_];
-    forward();
-    auto right = unaryExpression();
-
-    if (mul == nullptr) {
-      mul = std::make_unique<MultiplicationExpression>(
-          std::make_unique<Multiplication>(root_token), std::move(left),
-          std::move(right));
-    } else {
-      auto new_mul = std::make_unique<MultiplicationExpression>(
-          std::make_unique<Multiplication>(root_token), std::move(mul),
-          std::move(right));
-      mul = std::move(new_mul);
-    }
+Parser::Operand Parser::combine(Tier tier, Token& op, Operand lhs,
+                                Operand rhs) {
+  // Left operand of the same tier is chained as is, and operands of tighter
+  // tiers are wrapped up to the one below.
+  const auto below = static_cast<Tier>(static_cast<int>(tier) - 1);
+  const bool chained = lhs.tier_ == tier;
+  if (!chained) {
+    lhs = promote(std::move(lhs), below);
   }
-
-  if (mul == nullptr) {
-    mul = std::make_unique<MultiplicationExpression>(std::move(left));
+  ASTNodePtr node;
+  switch (tier) {
+    case Tier::Multiplication: {
+      auto token = arena_.make<Multiplication>(op);
+      auto right = nodeAs<UnaryExpression>(std::move(rhs.node_));
+      if (chained) {
+        node = arena_.make<MultiplicationExpression>(
+            std::move(token),
+            nodeAs<MultiplicationExpression>(std::move(lhs.node_)),
+            std::move(right));
+      } else {
+        node = arena_.make<MultiplicationExpression>(
+            std::move(token), nodeAs<UnaryExpression>(std::move(lhs.node_)),
+            std::move(right));
+      }
+      break;
+    }
+    case Tier::Addition: {
+      auto token = arena_.make<Addition>(op);
+      auto right = nodeAs<MultiplicationExpression>(
+          promote(std::move(rhs), below).node_);
+      if (chained) {
+        node = arena_.make<AdditionExpression>(
+            std::move(token), nodeAs<AdditionExpression>(std::move(lhs.node_)),
+            std::move(right));
+      } else {
+        node = arena_.make<AdditionExpression>(
+            std::move(token),
+            nodeAs<MultiplicationExpression>(std::move(lhs.node_)),
+            std::move(right));
+      }
+      break;
+    }
+    case Tier::Comparison: {
+      auto token = arena_.make<Compare>(op);
+      auto right =
+          nodeAs<AdditionExpression>(promote(std::move(rhs), below).node_);
+      if (chained) {
+        node = arena_.make<ComparisonExpression>(
+            std::move(token),
+            nodeAs<ComparisonExpression>(std::move(lhs.node_)),
+            std::move(right));
+      } else {
+        node = arena_.make<ComparisonExpression>(
+            std::move(token), nodeAs<AdditionExpression>(std::move(lhs.node_)),
+            std::move(right));
+      }
+      break;
+    }
+    case Tier::Equality: {
+      auto token = arena_.make<Equality>(op);
+      auto right =
+          nodeAs<ComparisonExpression>(promote(std::move(rhs), below).node_);
+      if (chained) {
+        node = arena_.make<EqualityExpression>(
+            std::move(token), nodeAs<EqualityExpression>(std::move(lhs.node_)),
+            std::move(right));
+      } else {
+        node = arena_.make<EqualityExpression>(
+            std::move(token),
+            nodeAs<ComparisonExpression>(std::move(lhs.node_)),
+            std::move(right));
+      }
+      break;
+    }
+    case Tier::AndLogic: {
+      // Right associative, so that the left operand is never chained.
+      STARTEAR_ASSERT(!chained);
+      auto token = arena_.make<Equality>(op);
+      auto left = nodeAs<EqualityExpression>(std::move(lhs.node_));
+      if (rhs.tier_ == Tier::AndLogic) {
+        node = arena_.make<AndLogicExpression>(
+            std::move(token), std::move(left),
+            nodeAs<AndLogicExpression>(std::move(rhs.node_)));
+      } else {
+        node = arena_.make<AndLogicExpression>(
+            std::move(token), std::move(left),
+            nodeAs<EqualityExpression>(promote(std::move(rhs), below).node_));
+      }
+      break;
+    }
+    case Tier::OrLogic: {
+      STARTEAR_ASSERT(!chained);
+      auto token = arena_.make<Equality>(op);
+      auto left = nodeAs<AndLogicExpression>(std::move(lhs.node_));
+      if (rhs.tier_ == Tier::OrLogic) {
+        node = arena_.make<OrLogicExpression>(
+            std::move(token), std::move(left),
+            nodeAs<OrLogicExpression>(std::move(rhs.node_)));
+      } else {
+        node = arena_.make<OrLogicExpression>(
+            std::move(token), std::move(left),
+            nodeAs<AndLogicExpression>(promote(std::move(rhs), below).node_));
+      }
+      break;
+    }
+    case Tier::Unary:
+      NOT_REACHED;
   }
-
-  return mul;
+  return Operand{tier, std::move(node)};
 }
 
 UnaryExpressionPtr Parser::unaryExpression() {
-  auto root_token = tokens_[current_];
+  auto root_token = peek();
   if (match(TokenType::BANG) || match(TokenType::MINUS)) {
     forward();
     auto unary = unaryExpression();
-    return std::make_unique<UnaryExpression>(
-        std::make_unique<Unary>(root_token), std::move(unary));
+    return arena_.make<UnaryExpression>(
+        arena_.make<Unary>(root_token), std::move(unary));
   }
 
   auto primary = primaryExpression();
-  return std::make_unique<UnaryExpression>(std::move(primary));
+  return arena_.make<UnaryExpression>(std::move(primary));
 }
 
 PrimaryExpressionPtr Parser::primaryExpression() {
-  auto root_token = tokens_[current_];
+  auto root_token = peek();
   if (match(TokenType::NUMBER) || match(TokenType::STRING) ||
       match(TokenType::FALSE) || match(TokenType::TRUE) ||
       match(TokenType::NIL) ||
       match(TokenType::IDENTIFIER) /* To allow variable number */) {
     forward();
-    return std::make_unique<PrimaryExpression>(
-        std::make_unique<Primary>(root_token));
+    return arena_.make<PrimaryExpression>(
+        arena_.make<Primary>(root_token));
   } else if (match(TokenType::LEFT_PAREN)) {
     forward();
     auto expr = basicExpression();
     if (!match(TokenType::RIGHT_PAREN)) {
       std::cerr << fmt::format("Syntax Error: line no {}",
-                               tokens_[current_].lineno())
+                               peek().lineno())
                 << std::endl;
       return nullptr;
     }
     forward();
-    return std::make_unique<PrimaryExpression>(std::move(expr));
+    return arena_.make<PrimaryExpression>(std::move(expr));
   }
 
   return nullptr;
@@ -240,7 +295,7 @@ LetStatementPtr Parser::letStatement(bool substitution) {
   if (!match(TokenType::IDENTIFIER)) {
     return nullptr;
   }
-  auto root_token = tokens_[current_];
+  auto root_token = peek();
   forward();
   if (match(TokenType::EQUAL)) {
     forward();
@@ -249,28 +304,28 @@ LetStatementPtr Parser::letStatement(bool substitution) {
       FunctionCallPtr expr = functionCall();
       if (!expr) {
         std::cerr << fmt::format("Syntax Error: line no {}",
-                                 tokens_[current_].lineno())
+                                 peek().lineno())
                   << std::endl;
         return nullptr;
       }
-      stmt = std::make_unique<LetStatement>(
-          std::make_unique<Normal>(root_token), std::move(expr));
+      stmt = arena_.make<LetStatement>(
+          arena_.make<Normal>(root_token), std::move(expr));
     } else {
       BasicExpressionPtr expr = basicExpression();
       if (!expr) {
         std::cerr << fmt::format("Syntax Error: line no {}",
-                                 tokens_[current_].lineno())
+                                 peek().lineno())
                   << std::endl;
         return nullptr;
       }
-      stmt = std::make_unique<LetStatement>(
-          std::make_unique<Normal>(root_token), std::move(expr));
+      stmt = arena_.make<LetStatement>(
+          arena_.make<Normal>(root_token), std::move(expr));
     }
     if (!match(TokenType::SEMICOLON)) {
       std::cerr
           << fmt::format(
                  "Variable definition must be ended with semicolon: line no {}",
-                 tokens_[current_].lineno())
+                 peek().lineno())
           << std::endl;
       return nullptr;
     }
@@ -281,11 +336,11 @@ LetStatementPtr Parser::letStatement(bool substitution) {
 }
 
 FunctionCallPtr Parser::functionCall() {
-  auto name_token = tokens_[current_];
+  auto name_token = peek();
   forward();
   if (!match(TokenType::LEFT_PAREN)) {
     std::cerr << fmt::format("Syntax Error: line no {}",
-                             tokens_[current_].lineno())
+                             peek().lineno())
               << std::endl;
     return nullptr;
   }
@@ -302,13 +357,13 @@ FunctionCallPtr Parser::functionCall() {
       NOT_REACHED;
     }
   }
-  return std::make_unique<FunctionCall>(std::make_unique<Normal>(name_token),
+  return arena_.make<FunctionCall>(arena_.make<Normal>(name_token),
                                         stmts);
 }
 
 ReturnDeclarationPtr Parser::returnDeclaration() {
   forward();
-  auto return_value_token = tokens_[current_];
+  auto return_value_token = peek();
   forward();
   bool is_literal = true;
   if (return_value_token.lexeme()[0] != '"') {  // string literal or not
@@ -321,25 +376,25 @@ ReturnDeclarationPtr Parser::returnDeclaration() {
   }
   if (is_literal) {
     forward();
-    return std::make_unique<ReturnDeclaration>(
-        std::make_unique<Primary>(return_value_token));
+    return arena_.make<ReturnDeclaration>(
+        arena_.make<Primary>(return_value_token));
   }
   if (!match(TokenType::SEMICOLON)) {
     std::cerr << fmt::format("return must be ended with semicolon: line no {}",
-                             tokens_[current_].lineno())
+                             peek().lineno())
               << std::endl;
     return nullptr;
   }
   forward();
-  return std::make_unique<ReturnDeclaration>(
-      std::make_unique<Normal>(return_value_token));
+  return arena_.make<ReturnDeclaration>(
+      arena_.make<Normal>(return_value_token));
 }
 
 IfStatementPtr Parser::ifStatement() {
   forward();
   if (!match(TokenType::LEFT_PAREN)) {
     std::cerr << fmt::format("Syntax Error: line no {}",
-                             tokens_[current_].lineno())
+                             peek().lineno())
               << std::endl;
     NOT_REACHED;
   }
@@ -347,14 +402,14 @@ IfStatementPtr Parser::ifStatement() {
   auto eql_expr_ptr = equalityExpression();
   if (!match(TokenType::RIGHT_PAREN)) {
     std::cerr << fmt::format("Syntax Error: line no {}",
-                             tokens_[current_].lineno())
+                             peek().lineno())
               << std::endl;
     NOT_REACHED;
   }
   forward();
   if (!match(TokenType::LEFT_BRACE)) {
     std::cerr << fmt::format("Syntax Error: line no {}",
-                             tokens_[current_].lineno())
+                             peek().lineno())
               << std::endl;
     NOT_REACHED;
   }
@@ -382,23 +437,23 @@ IfStatementPtr Parser::ifStatement() {
     }
     if (!current_stmt) {
       std::cerr << fmt::format("Syntax Error: line no {}",
-                               tokens_[current_].lineno())
+                               peek().lineno())
                 << std::endl;
       return nullptr;
     }
     expressions.emplace_back(std::move(current_stmt));
   }
   forward();
-  return std::make_unique<IfStatement>(std::move(eql_expr_ptr), expressions);
+  return arena_.make<IfStatement>(std::move(eql_expr_ptr), expressions);
 }
 
 FunctionDeclarationPtr Parser::functionDeclaration() {
   forward();
-  auto name_token = tokens_[current_];
+  auto name_token = peek();
   forward();
   if (!match(TokenType::LEFT_PAREN)) {
     std::cerr << fmt::format("Syntax Error: line no {}",
-                             tokens_[current_].lineno())
+                             peek().lineno())
               << std::endl;
     return nullptr;
   }
@@ -407,27 +462,27 @@ FunctionDeclarationPtr Parser::functionDeclaration() {
   if (match(TokenType::IDENTIFIER)) {
     // TODO: Should alert if there is no termination symbol of function.
     while (!isEnd()) {
-      auto current_token = tokens_[current_];
+      auto current_token = peek();
       forward();
       if (match(TokenType::RIGHT_PAREN)) {
-        args.emplace_back(std::make_unique<Normal>(current_token));
+        args.emplace_back(arena_.make<Normal>(current_token));
         forward();
         break;
       } else if (!match(TokenType::COMMA)) {
         std::cerr << fmt::format(
                          "arguments should be separated by comma: line no {}",
-                         tokens_[current_].lineno())
+                         peek().lineno())
                   << std::endl;
         return nullptr;
       }
-      args.emplace_back(std::make_unique<Normal>(current_token));
+      args.emplace_back(arena_.make<Normal>(current_token));
       forward();
     }
     if (!match(TokenType::LEFT_BRACE)) {
       std::cerr
           << fmt::format(
                  "function should be started with left bracket: line no {}",
-                 tokens_[current_].lineno())
+                 peek().lineno())
           << std::endl;
       return nullptr;
     }
@@ -463,20 +518,20 @@ FunctionDeclarationPtr Parser::functionDeclaration() {
       current_stmt = ifStatement();
     } else {
       std::cerr << fmt::format("Syntax Error: line no {}",
-                               tokens_[current_].lineno())
+                               peek().lineno())
                 << std::endl;
       NOT_REACHED;
     }
     if (!current_stmt) {
       std::cerr << fmt::format("Syntax Error: line no {}",
-                               tokens_[current_].lineno())
+                               peek().lineno())
                 << std::endl;
       return nullptr;
     }
     expressions.emplace_back(std::move(current_stmt));
   }
-  return std::make_unique<FunctionDeclaration>(
-      std::make_unique<Normal>(name_token), args, expressions);
+  return arena_.make<FunctionDeclaration>(
+      arena_.make<Normal>(name_token), args, expressions);
 }
 
 ProgramDeclarationPtr Parser::programDeclaration() {
@@ -508,7 +563,7 @@ ProgramDeclarationPtr Parser::programDeclaration() {
       basic_exprs.emplace_back(std::move(basic_expr));
     }
   }
-  return std::make_unique<ProgramDeclaration>(let_statements, func_decls,
+  return arena_.make<ProgramDeclaration>(let_statements, func_decls,
                                               basic_exprs);
 }
 
@@ -26,26 +26,64 @@
 #ifndef STARTEAR_ALL_PARSER_H
 #define STARTEAR_ALL_PARSER_H
 
+#include <optional>
 #include <vector>
 
+#include "arena.h"
 #include "ast.h"
+#include "token_cursor.h"
 #include "tokenizer.h"
 
 namespace Startear {
-class Parser {
+// Binding tiers of binary operators, from the tightest one.
+enum class Tier {
+  Unary,
+  Multiplication,
+  Addition,
+  Comparison,
+  Equality,
+  AndLogic,
+  OrLogic,
+};
+
+// Returns the tier of binary operator, or std::nullopt for other tokens.
+std::optional<Tier> binaryTier(TokenType type);
+
+// Logical operators associate to the right, and others to the left.
+inline bool isRightAssociative(Tier tier) {
+  return tier == Tier::AndLogic || tier == Tier::OrLogic;
+}
+
+// Parser is the parse session, whose arena owns all of AST nodes and tokens in
+// them. The tree returned by parse() is valid while the parser is alive, and
+// released at once with the parser.
+class Parser : private TokenCursor {
  public:
-  Parser(std::vector<Token>& tokens) : tokens_(tokens) {}
+  // Borrow tokens, which must outlive the parser.
+  Parser(const std::vector<Token>& tokens) : TokenCursor(tokens) {}
+  // Pull tokens from the tokenizer lazily, so that tokens are consumed while
+  // the rest of input is being read.
+  Parser(Tokenizer& tokenizer) : TokenCursor(tokenizer) {}
 
   ASTNodePtr parse();
 
+  const Arena& arena() const { return arena_; }
+
  private:
+  // Expression node whose type is the one of its tier.
+  struct Operand {
+    Tier tier_;
+    ASTNodePtr node_;
+  };
+
   BasicExpressionPtr basicExpression();
   OrLogicExpressionPtr orLogicExpression();
-  AndLogicExpressionPtr andLogicExpression();
   EqualityExpressionPtr equalityExpression();
-  ComparisonExpressionPtr comparisonExpression();
-  AdditionExpressionPtr additionExpression();
-  MultiplicationExpressionPtr multiplicationExpression();
+  // Parse binary operators of max_tier or tighter by precedence climbing.
+  Operand binaryExpression(Tier max_tier);
+  // Wrap the operand into single operand nodes up to tier.
+  Operand promote(Operand operand, Tier tier);
+  Operand combine(Tier tier, Token& op, Operand lhs, Operand rhs);
   UnaryExpressionPtr unaryExpression();
   PrimaryExpressionPtr primaryExpression();
   LetStatementPtr letStatement(bool substitution = false);
@@ -55,26 +93,7 @@ class Parser {
   IfStatementPtr ifStatement();
   ReturnDeclarationPtr returnDeclaration();
 
-  bool match(TokenType expected) { return match(expected, 0); }
-
-  bool match(TokenType expected, size_t ahead) {
-    if (ahead + current_ >= tokens_.size()) {
-      return false;
-    }
-    return tokens_[current_ + ahead].type() == expected;
-  }
-
-  void forward() {
-    if (isEnd()) {
-      return;
-    }
-    ++current_;
-  }
-
-  bool isEnd() { return current_ >= tokens_.size(); }
-
-  uint32_t current_{0};
-  std::vector<Token> tokens_;
+  Arena arena_;
 };
 }  // namespace Startear
 
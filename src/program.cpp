@@ -25,71 +25,536 @@
 
 #include "program.h"
 
+#include <algorithm>
 #include <cstring>
 #include <fmt/format.h>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
 
 #include "startear_assert.h"
 
 namespace Startear {
 
-void Value::setString(const char* s, size_t len) {
-  bytes_ = reinterpret_cast<std::byte*>(calloc(len, sizeof(char)));
-  memcpy(bytes_, s, len * sizeof(char));
+const char* StringPool::intern(std::string_view s) {
+  static std::mutex mutex;
+  static std::unordered_set<std::string> pool;
+  std::lock_guard<std::mutex> lock(mutex);
+  // Elements of node based container never move, so c_str() is stable.
+  auto [itr, _] = pool.emplace(s);
+  return itr->c_str();
+}
+
+void Value::setString(Category c, std::string_view s) {
+  auto ptr = reinterpret_cast<uint64_t>(StringPool::intern(s));
+  STARTEAR_ASSERT((ptr & ~payload_mask) == 0);
+  bits_ = box(Tag::StringTag, c, ptr);
 }
 
 void Value::setDouble(double d) {
-  type_ = SupportedTypes::Double;
-  bytes_ = reinterpret_cast<std::byte*>(calloc(1, sizeof(double)));
-  memcpy(bytes_, &d, sizeof(double));
+  memcpy(&bits_, &d, sizeof(double));
+  // NaN which collides with boxed values must be canonicalized.
+  if (!isDouble()) {
+    bits_ = canonical_nan;
+  }
 }
 
 std::optional<const char*> Value::getString() const {
-  if (type_ != SupportedTypes::String) {
+  if (type() != SupportedTypes::String) {
     return std::nullopt;
   }
-  auto* v_ptr = reinterpret_cast<const char*>(bytes_);
-  return v_ptr;
+  return reinterpret_cast<const char*>(bits_ & payload_mask);
 }
 
 std::optional<double> Value::getDouble() const {
-  STARTEAR_ASSERT(category_ == Value::Literal);
-  if (type_ != SupportedTypes::Double) {
+  if (!isDouble()) {
+    return std::nullopt;
+  }
+  double d;
+  memcpy(&d, &bits_, sizeof(double));
+  return d;
+}
+
+std::optional<bool> Value::getBoolean() const {
+  if (type() != SupportedTypes::Boolean) {
     return std::nullopt;
   }
-  auto* v_ptr = reinterpret_cast<double*>(bytes_);
-  return *v_ptr;
+  return (bits_ & payload_mask) != 0;
 }
 
-void Program::addInst(OPCode code) { instructions_.emplace_back(code); }
+Value::SupportedTypes Value::type() const {
+  if (isDouble()) {
+    return SupportedTypes::Double;
+  }
+  switch (tag()) {
+    case Tag::BooleanTag:
+      return SupportedTypes::Boolean;
+    case Tag::StringTag:
+      return SupportedTypes::String;
+    default:
+      return SupportedTypes::None;
+  }
+}
 
-std::optional<std::reference_wrapper<const Instruction>> Program::fetchInst(
-    size_t pc) {
+void Program::addInst(OPCode code) {
+  if (!validOperandSize(code, 0)) {
+    return;
+  }
+  emitOpcode(code);
+}
+
+void Program::addInst(OPCode code, std::initializer_list<size_t> immediates) {
+  if (!validOperandSize(code, immediates.size())) {
+    return;
+  }
+  emitOpcode(code);
+  for (const auto immediate : immediates) {
+    emitOperand(immediate);
+  }
+}
+
+std::optional<Instruction> Program::fetchInst(size_t pc) const {
   if (isProgramEnd(pc)) {
     return std::nullopt;
   }
-  return instructions_[pc];
+  return Instruction(codeData() + pc);
 }
 
-std::optional<Value> Program::fetchValue(size_t i) {
-  if (i >= values_.size()) {
+std::vector<Instruction> Program::instructions() const {
+  std::vector<Instruction> instructions;
+  for (size_t pc = 0; !isProgramEnd(pc);) {
+    Instruction instr(codeData() + pc);
+    instructions.emplace_back(instr);
+    pc += instr.length();
+  }
+  return instructions;
+}
+
+void Program::emitOpcode(OPCode code) {
+  STARTEAR_ASSERT(!mapped());
+  code_.emplace_back(static_cast<uint8_t>(code));
+}
+
+void Program::emitOperand(size_t operand) {
+  STARTEAR_ASSERT(operand <= std::numeric_limits<operand_t>::max());
+  auto encoded = static_cast<operand_t>(operand);
+  auto offset = code_.size();
+  code_.resize(offset + sizeof(operand_t));
+  memcpy(code_.data() + offset, &encoded, sizeof(operand_t));
+}
+
+void Program::patchOperand(size_t pc, size_t i, size_t operand) {
+  STARTEAR_ASSERT(i < Instruction(code_.data() + pc).operandSize());
+  STARTEAR_ASSERT(operand <= std::numeric_limits<operand_t>::max());
+  auto encoded = static_cast<operand_t>(operand);
+  memcpy(code_.data() + pc + 1 + i * sizeof(operand_t), &encoded,
+         sizeof(operand_t));
+}
+
+bool Program::rewriteOpcode(size_t pc, OPCode code) {
+  if (mapped()) {
+    return false;
+  }
+  STARTEAR_ASSERT(pc < code_.size());
+  STARTEAR_ASSERT(Instruction(code_.data() + pc).operandSize() ==
+                  operandSize(code));
+  code_[pc] = static_cast<uint8_t>(code);
+  return true;
+}
+
+std::optional<Value> Program::fetchValue(size_t i) const {
+  if (i >= valueCount()) {
     return std::nullopt;
   }
-  return values_.at(i);
+  return valueData()[i];
 }
 
 size_t Program::addValue(Value v) {
-  values_.emplace_back(v);
-  return values_.size() - 1;
+  STARTEAR_ASSERT(!mapped());
+  auto [itr, inserted] = value_index_.emplace(v.bits(), values_.size());
+  if (inserted) {
+    values_.emplace_back(v);
+  }
+  return itr->second;
 }
 
-void Program::addFunction(std::string name, std::vector<size_t>& args) {
-  auto current_top = instructions_.size();
-  registered_function_.registerFunction(name, args, current_top);
+void Program::addFunction(std::string name, std::vector<std::string>& args) {
+  auto current_top = code_.size();
+  current_function_ =
+      registered_function_.registerFunction(name, args, current_top);
+}
+
+size_t Program::resolveLocalSlot(std::string_view name) {
+  if (!current_function_.has_value()) {
+    return toplevel_.resolveSlot(name);
+  }
+  return registered_function_.functions_[*current_function_].resolveSlot(name);
+}
+
+size_t Program::findLocalSlot(std::string_view name) {
+  const auto& function = current_function_.has_value()
+                             ? registered_function_.functions_[*current_function_]
+                             : toplevel_;
+  auto slot = function.findSlot(name);
+  if (!slot.has_value()) {
+    std::cerr << fmt::format("{} is not defined", name) << std::endl;
+    undefined_local_ = true;
+    // Placeholder. It is never executed, because linking fails.
+    return 0;
+  }
+  return *slot;
 }
 
 void Program::addLabel(std::string name) {
-  auto current_top = instructions_.size();
-  registered_function_.registerLabel(name, current_top);
+  auto current_top = code_.size();
+  labels_.emplace(std::make_pair(name, current_top));
+}
+
+bool Program::link() {
+  if (linked_) {
+    return true;
+  }
+  if (undefined_local_) {
+    return false;
+  }
+  const auto resolve_symbol =
+      [this](size_t operand) -> std::optional<std::string> {
+    auto symbol_entry = fetchValue(operand);
+    if (!symbol_entry || !symbol_entry->getString()) {
+      return std::nullopt;
+    }
+    return *symbol_entry->getString();
+  };
+  // Operands are resolved into this table first, so that the program is
+  // left untouched if any symbol is undefined.
+  struct Patch {
+    size_t pc_;
+    size_t index_;
+    size_t operand_;
+  };
+  std::vector<Patch> patches;
+  for (size_t pc = 0; !isProgramEnd(pc);) {
+    Instruction instr(code_.data() + pc);
+    switch (instr.opcode()) {
+      case OPCode::OP_CALL: {
+        auto name = resolve_symbol(instr.operand(0));
+        STARTEAR_ASSERT(name.has_value());
+        auto function = registered_function_.findByName(*name);
+        if (!function.has_value()) {
+          std::cerr << fmt::format("{} is not defined", *name) << std::endl;
+          return false;
+        }
+        patches.emplace_back(Patch{pc, 0, function->get().id_});
+        break;
+      }
+      case OPCode::OP_BRANCH:
+      case OPCode::OP_COMPARE_BRANCH:
+      case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+      case OPCode::OP_JUMP_IF_TRUE_OR_POP: {
+        // Labels are the last two operands of branches, and the only operand
+        // of jumps.
+        const size_t labels = instr.operandSize() >= 2 ? 2 : 1;
+        for (size_t i = instr.operandSize() - labels; i < instr.operandSize();
+             ++i) {
+          auto label = resolve_symbol(instr.operand(i));
+          STARTEAR_ASSERT(label.has_value());
+          auto itr = labels_.find(*label);
+          if (itr == labels_.end()) {
+            std::cerr << fmt::format("Failed to find label entry on {}",
+                                     *label)
+                      << std::endl;
+            return false;
+          }
+          patches.emplace_back(Patch{pc, i, itr->second});
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    pc += instr.length();
+  }
+  for (const auto& patch : patches) {
+    patchOperand(patch.pc_, patch.index_, patch.operand_);
+  }
+  markTailCalls();
+  // Sentinel. Labels which point to the end of program jump to here.
+  emitOpcode(OPCode::OP_HALT);
+  linked_ = true;
+  return true;
+}
+
+void Program::markTailCalls() {
+  const auto opcode_at = [this](size_t pc) -> std::optional<OPCode> {
+    if (isProgramEnd(pc)) {
+      return std::nullopt;
+    }
+    return static_cast<OPCode>(code_[pc]);
+  };
+  for (size_t pc = 0; !isProgramEnd(pc);
+       pc += Instruction(code_.data() + pc).length()) {
+    Instruction instr(code_.data() + pc);
+    if (instr.opcode() != OPCode::OP_CALL) {
+      continue;
+    }
+    const auto next = pc + instr.length();
+    // `return f(x)` can't be written in source, so that the result of call is
+    // returned through a local variable like `let y = f(x); return y;`. The
+    // slot is never read after returning.
+    bool tail = opcode_at(next) == OPCode::OP_RETURN;
+    if (!tail && opcode_at(next) == OPCode::OP_STORE_SLOT) {
+      Instruction store(code_.data() + next);
+      const auto load_pc = next + store.length();
+      if (opcode_at(load_pc) == OPCode::OP_LOAD_SLOT) {
+        Instruction load(code_.data() + load_pc);
+        tail = load.operand(0) == store.operand(0) &&
+               opcode_at(load_pc + load.length()) == OPCode::OP_RETURN;
+      }
+    }
+    // Following instructions are kept, because control may reach them by
+    // jump, and the entry frame executes the call as usual.
+    if (tail) {
+      code_[pc] = static_cast<uint8_t>(OPCode::OP_TAIL_CALL);
+    }
+  }
+}
+
+void Program::fuseSuperinstructions() {
+  STARTEAR_ASSERT(!linked_);
+  // Control can reach jump targets from other than the previous instruction,
+  // so that they must not be fused into the middle of superinstruction.
+  std::unordered_set<size_t> jump_targets;
+  for (const auto& [_, pc] : labels_) {
+    jump_targets.emplace(pc);
+  }
+  for (const auto& function : registered_function_.functions_) {
+    jump_targets.emplace(function.pc_);
+  }
+
+  const auto original = std::move(code_);
+  code_.clear();
+  std::vector<size_t> pcs;
+  for (size_t pc = 0; pc < original.size();) {
+    pcs.emplace_back(pc);
+    pc += Instruction(original.data() + pc).length();
+  }
+  const auto instr_at = [&](size_t i) {
+    return Instruction(original.data() + pcs[i]);
+  };
+  // Whether the i-th instruction can be the non-head part of fusion.
+  const auto fusible = [&](size_t i, OPCode code) {
+    return i < pcs.size() && instr_at(i).opcode() == code &&
+           jump_targets.find(pcs[i]) == jump_targets.end();
+  };
+
+  std::unordered_map<size_t, size_t> relocation;
+  for (size_t i = 0; i < pcs.size();) {
+    relocation.emplace(pcs[i], code_.size());
+    auto instr = instr_at(i);
+    if (instr.opcode() == OPCode::OP_LOAD_SLOT &&
+        fusible(i + 1, OPCode::OP_PUSH) && fusible(i + 2, OPCode::OP_ADD)) {
+      emitOpcode(OPCode::OP_ADD_SLOT_CONST);
+      emitOperand(instr.operand(0));
+      emitOperand(instr_at(i + 1).operand(0));
+      i += 3;
+    } else if (isComparison(instr.opcode()) &&
+               fusible(i + 1, OPCode::OP_BRANCH)) {
+      auto branch = instr_at(i + 1);
+      emitOpcode(OPCode::OP_COMPARE_BRANCH);
+      emitOperand(static_cast<size_t>(instr.opcode()));
+      emitOperand(branch.operand(0));
+      emitOperand(branch.operand(1));
+      i += 2;
+    } else if (instr.opcode() == OPCode::OP_PUSH &&
+               fusible(i + 1, OPCode::OP_STORE_SLOT)) {
+      emitOpcode(OPCode::OP_PUSH_STORE);
+      emitOperand(instr.operand(0));
+      emitOperand(instr_at(i + 1).operand(0));
+      i += 2;
+    } else {
+      code_.insert(code_.end(), original.begin() + pcs[i],
+                   original.begin() + pcs[i] + instr.length());
+      ++i;
+    }
+  }
+  relocation.emplace(original.size(), code_.size());
+  relocate(relocation);
+}
+
+namespace {
+// Instructions which can be spliced into caller. Slots are renamed, and the
+// others are copied as is.
+bool inlinable(OPCode code) {
+  switch (code) {
+    case OPCode::OP_PRINT:
+    case OPCode::OP_PUSH:
+    case OPCode::OP_LOAD_SLOT:
+    case OPCode::OP_STORE_SLOT:
+    case OPCode::OP_ADD:
+    case OPCode::OP_SUB:
+    case OPCode::OP_MUL:
+    case OPCode::OP_DIV:
+    case OPCode::OP_AND:
+    case OPCode::OP_OR:
+      return true;
+    default:
+      return isComparison(code);
+  }
+}
+}  // namespace
+
+size_t Program::inlineFunctions(const InlineOptions& options) {
+  STARTEAR_ASSERT(!linked_);
+  std::unordered_set<size_t> jump_targets;
+  for (const auto& [_, pc] : labels_) {
+    jump_targets.emplace(pc);
+  }
+  // Range of the body without the last OP_RETURN. It is std::nullopt if the
+  // function can't be inlined.
+  struct Body {
+    size_t begin_;
+    size_t end_;
+  };
+  const auto find_body =
+      [&](const FunctionMetadata& function) -> std::optional<Body> {
+    if (options.call_counts_ != nullptr &&
+        (function.id_ >= options.call_counts_->size() ||
+         (*options.call_counts_)[function.id_] < options.min_calls_)) {
+      return std::nullopt;
+    }
+    // Slots which are not arguments must be stored before loaded, otherwise
+    // they would observe the value of the previous call.
+    std::vector<bool> stored(function.locals_.size(), false);
+    std::fill_n(stored.begin(), function.arity_, true);
+    size_t depth = 0;
+    size_t size = 0;
+    for (size_t pc = function.pc_; !isProgramEnd(pc);) {
+      if (pc != function.pc_ &&
+          (jump_targets.count(pc) != 0 ||
+           registered_function_.pc_id_.count(pc) != 0)) {
+        return std::nullopt;
+      }
+      Instruction instr(code_.data() + pc);
+      const auto code = instr.opcode();
+      if (code == OPCode::OP_RETURN) {
+        // Only the top of stack is returned.
+        if (depth > 1) {
+          return std::nullopt;
+        }
+        return Body{function.pc_, pc};
+      }
+      if (!inlinable(code) || ++size > options.budget_) {
+        return std::nullopt;
+      }
+      switch (code) {
+        case OPCode::OP_PRINT:
+          break;
+        case OPCode::OP_PUSH:
+          ++depth;
+          break;
+        case OPCode::OP_LOAD_SLOT:
+          if (instr.operand(0) >= stored.size() || !stored[instr.operand(0)]) {
+            return std::nullopt;
+          }
+          ++depth;
+          break;
+        case OPCode::OP_STORE_SLOT:
+          if (instr.operand(0) >= stored.size() || depth == 0) {
+            return std::nullopt;
+          }
+          stored[instr.operand(0)] = true;
+          --depth;
+          break;
+        default:
+          // Binary operators.
+          if (depth < 2) {
+            return std::nullopt;
+          }
+          --depth;
+          break;
+      }
+      pc += instr.length();
+    }
+    return std::nullopt;
+  };
+  std::vector<std::optional<Body>> bodies;
+  for (const auto& function : registered_function_.functions_) {
+    bodies.emplace_back(find_body(function));
+  }
+
+  const auto original = std::move(code_);
+  code_.clear();
+  std::unordered_map<size_t, size_t> relocation;
+  std::optional<size_t> caller;
+  size_t inlined = 0;
+  for (size_t pc = 0; pc < original.size();) {
+    relocation.emplace(pc, code_.size());
+    if (auto itr = registered_function_.pc_id_.find(pc);
+        itr != registered_function_.pc_id_.end()) {
+      caller = itr->second;
+    }
+    Instruction instr(original.data() + pc);
+    const auto next = pc + instr.length();
+    std::optional<size_t> callee;
+    if (caller.has_value() && instr.opcode() == OPCode::OP_CALL) {
+      auto symbol = fetchValue(instr.operand(0));
+      if (symbol && symbol->getString()) {
+        auto function = registered_function_.findByName(*symbol->getString());
+        if (function.has_value() && bodies[function->get().id_]) {
+          callee = function->get().id_;
+        }
+      }
+    }
+    if (!callee.has_value()) {
+      code_.insert(code_.end(), original.begin() + pc, original.begin() + next);
+      pc = next;
+      continue;
+    }
+
+    // Callee has no calls, so that it is never the caller itself.
+    auto& caller_function = registered_function_.functions_[*caller];
+    const auto& callee_function = registered_function_.functions_[*callee];
+    std::vector<size_t> slots;
+    for (const auto& local : callee_function.locals_) {
+      slots.emplace_back(caller_function.resolveSlot(
+          fmt::format("{}.{}", callee_function.name_, local)));
+    }
+    // Arguments on the top of stack are stored in reverse order.
+    for (auto i = callee_function.arity_; i > 0; --i) {
+      emitOpcode(OPCode::OP_STORE_SLOT);
+      emitOperand(slots[i - 1]);
+    }
+    // The returned value is left on the top of stack.
+    const auto& body = *bodies[*callee];
+    for (size_t body_pc = body.begin_; body_pc < body.end_;) {
+      Instruction body_instr(original.data() + body_pc);
+      if (body_instr.opcode() == OPCode::OP_LOAD_SLOT ||
+          body_instr.opcode() == OPCode::OP_STORE_SLOT) {
+        emitOpcode(body_instr.opcode());
+        emitOperand(slots[body_instr.operand(0)]);
+      } else {
+        code_.insert(code_.end(), original.begin() + body_pc,
+                     original.begin() + body_pc + body_instr.length());
+      }
+      body_pc += body_instr.length();
+    }
+    ++inlined;
+    pc = next;
+  }
+  relocation.emplace(original.size(), code_.size());
+  relocate(relocation);
+  return inlined;
+}
+
+void Program::relocate(const std::unordered_map<size_t, size_t>& relocation) {
+  for (auto& [_, pc] : labels_) {
+    pc = relocation.at(pc);
+  }
+  registered_function_.pc_id_.clear();
+  for (auto& function : registered_function_.functions_) {
+    function.pc_ = relocation.at(function.pc_);
+    registered_function_.pc_id_.emplace(function.pc_, function.id_);
+  }
 }
 
 std::string Program::getIndexedLabel() {
@@ -100,34 +565,54 @@ std::string Program::getIndexedLabel() {
 
 std::optional<std::reference_wrapper<const Program::FunctionMetadata>>
 Program::FunctionRegistry::findByProgramCounter(size_t line) const {
-  auto itr = pc_name_.find(line);
-  if (itr == pc_name_.end()) {
+  auto itr = pc_id_.find(line);
+  if (itr == pc_id_.end()) {
     return std::nullopt;
   }
-  return findByName(itr->second);
+  return std::reference_wrapper(functions_[itr->second]);
 }
 
 std::optional<std::reference_wrapper<const Program::FunctionMetadata>>
 Program::FunctionRegistry::findByName(std::string name) const {
-  auto itr2 = metadata_.find(name);
-  if (itr2 == metadata_.end()) {
+  auto itr = name_id_.find(name);
+  if (itr == name_id_.end()) {
     return std::nullopt;
   }
-  return std::reference_wrapper(itr2->second);
+  return std::reference_wrapper(functions_[itr->second]);
 }
 
-void Program::FunctionRegistry::registerFunction(std::string name,
-                                                 std::vector<size_t>& args,
-                                                 size_t pc) {
-  pc_name_.emplace(std::make_pair(pc, name));
-  metadata_.emplace(
-      std::make_pair(name, Program::FunctionMetadata{name, pc, args}));
-  STARTEAR_ASSERT(pc_name_.size() == metadata_.size());
+size_t Program::FunctionRegistry::registerFunction(
+    std::string name, std::vector<std::string>& args, size_t pc) {
+  auto itr = name_id_.find(name);
+  if (itr != name_id_.end()) {
+    return itr->second;
+  }
+  auto id = functions_.size();
+  pc_id_.emplace(std::make_pair(pc, id));
+  name_id_.emplace(std::make_pair(name, id));
+  functions_.emplace_back(
+      Program::FunctionMetadata{name, id, pc, args.size(), args});
+  STARTEAR_ASSERT(pc_id_.size() == name_id_.size());
+  return id;
 }
 
-void Program::FunctionRegistry::registerLabel(std::string label, size_t pc) {
-  auto dummy_args = std::vector<size_t>(0);
-  registerFunction(label, dummy_args, pc);
+size_t Program::FunctionMetadata::resolveSlot(std::string_view name) {
+  auto slot = findSlot(name);
+  if (slot.has_value()) {
+    return *slot;
+  }
+  locals_.emplace_back(name);
+  return locals_.size() - 1;
+}
+
+std::optional<size_t> Program::FunctionMetadata::findSlot(
+    std::string_view name) const {
+  for (size_t i = 0; i < locals_.size(); ++i) {
+    if (locals_[i] == name) {
+      return i;
+    }
+  }
+  return std::nullopt;
 }
 
 }  // namespace Startear
\ No newline at end of file
@@ -27,11 +27,13 @@
 #define STARTEAR_ALL_PROGRAM_H
 
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <deque>
 #include <iostream>
 #include <memory>
 #include <optional>
+#include <string_view>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
@@ -41,69 +43,146 @@
 
 namespace Startear {
 
+// Value is a NaN-boxed 8 byte word. Doubles are stored as is, and other types
+// are packed into the payload of a quiet NaN, so that Value can be copied
+// around the stack without any heap allocation.
+//
+//  63   62..50        49..48  47..0
+// +---+--------------+-------+---------------------------------+
+// | C | 1111111111111|  tag  | payload (bool or string pointer)|
+// +---+--------------+-------+---------------------------------+
+//
+// C is set when the value is Variable category.
 class Value {
  public:
   enum SupportedTypes {
-    // Value is not set.
+    // Value is not set. It is also used as nil.
     None,
     // Used to specify variable name in the instruction sequence, or treat
     // string directly.
     String,
     // Normally, all of number is treated as double in the world of instruction
     // sequence.
-    Double
+    Double,
+    Boolean
   };
 
   enum Category { Variable, Literal };
 
   template <typename T>
   Value(Category c, T v);
-  Value(Category c) : category_(c) {}
+  Value(Category c) : bits_(box(Tag::NoneTag, c, 0)) {}
+  Value() : bits_(box(Tag::NoneTag, Category::Literal, 0)) {}
 
   std::optional<const char*> getString() const;
   std::optional<double> getDouble() const;
+  std::optional<bool> getBoolean() const;
+
+  Category category() const {
+    if (isDouble()) {
+      return Category::Literal;
+    }
+    return (bits_ & sign_bit) != 0 ? Category::Variable : Category::Literal;
+  }
+  SupportedTypes type() const;
 
-  Category category() { return category_; }
-  SupportedTypes type() { return type_; }
+  // Raw representation. Two values have the same bits if and only if they are
+  // the same type, category and entity, because strings are interned.
+  uint64_t bits() const { return bits_; }
+  // Value is not double if and only if all of these bits are set. Native code
+  // checks types with this.
+  static constexpr uint64_t boxedMask() { return quiet_nan; }
 
  private:
-  void setString(const char* s, size_t len);
+  enum Tag : uint64_t { NoneTag = 0, BooleanTag = 1, StringTag = 2 };
+
+  static constexpr uint64_t sign_bit = 0x8000000000000000;
+  static constexpr uint64_t quiet_nan = 0x7ffc000000000000;
+  static constexpr uint64_t canonical_nan = 0x7ff8000000000000;
+  static constexpr uint64_t tag_shift = 48;
+  static constexpr uint64_t tag_mask = 0x3;
+  static constexpr uint64_t payload_mask = 0x0000ffffffffffff;
+
+  static constexpr uint64_t box(Tag tag, Category c, uint64_t payload) {
+    return (c == Category::Variable ? sign_bit : 0) | quiet_nan |
+           (static_cast<uint64_t>(tag) << tag_shift) |
+           (payload & payload_mask);
+  }
+  bool isDouble() const { return (bits_ & quiet_nan) != quiet_nan; }
+  Tag tag() const {
+    return static_cast<Tag>((bits_ >> tag_shift) & tag_mask);
+  }
+
+  void setString(Category c, std::string_view s);
   void setDouble(double d);
 
- protected:
-  std::byte* bytes_;
-  SupportedTypes type_{SupportedTypes::None};
-  Category category_;
+  uint64_t bits_;
+};
+
+static_assert(sizeof(Value) == sizeof(uint64_t));
+static_assert(std::is_trivially_copyable<Value>::value);
+
+// Process wide string pool. Interned strings are never released, so that
+// Value can hold a raw pointer to them.
+class StringPool {
+ public:
+  static const char* intern(std::string_view s);
 };
 
+// Instructions are encoded into the flat byte sequence. Each of them is an
+// opcode byte followed by fixed width operands, e.g.
+//
+// | OP_PUSH | operand (4 bytes) | OP_PUSH | operand (4 bytes) | OP_ADD | ...
+//
+// Instruction is a view to decode single instruction on the sequence. It will
+// be invalidated if the sequence is modified.
 class Instruction {
  public:
-  Instruction(OPCode code) : code_(code) {}
-  template <class It>
-  Instruction(OPCode code, It begin, It end)
-      : code_(code), operands_ptr_(begin, end) {}
+  Instruction(const uint8_t* code) : code_(code) {}
 
-  const OPCode opcode() const { return code_; }
-  const std::vector<size_t>& operandsPointer() const { return operands_ptr_; }
+  const OPCode opcode() const { return static_cast<OPCode>(code_[0]); }
+  size_t operandSize() const { return Startear::operandSize(opcode()); }
+  operand_t operand(size_t i) const {
+    STARTEAR_ASSERT(i < operandSize());
+    operand_t operand;
+    memcpy(&operand, code_ + 1 + i * sizeof(operand_t), sizeof(operand_t));
+    return operand;
+  }
+  // The number of bytes which this instruction occupies.
+  size_t length() const { return 1 + operandSize() * sizeof(operand_t); }
 
  private:
-  OPCode code_;
-  std::vector<size_t> operands_ptr_;
+  const uint8_t* code_;
 };
 
 template <typename T>
-Value::Value(Category c, T v) : category_(c) {
-  if constexpr (std::is_same<std::decay_t<decltype(v)>, std::string>::value) {
-    type_ = SupportedTypes::String;
-    setString(v.c_str(), v.size());
-  } else if (std::is_same<std::decay_t<decltype(v)>, double>::value) {
-    type_ = SupportedTypes::Double;
-    setDouble(v);
+Value::Value(Category c, T v) {
+  using Type = std::decay_t<T>;
+  if constexpr (std::is_same<Type, std::string>::value ||
+                std::is_same<Type, std::string_view>::value ||
+                std::is_same<Type, const char*>::value) {
+    setString(c, v);
+  } else if constexpr (std::is_same<Type, bool>::value) {
+    bits_ = box(Tag::BooleanTag, c, v ? 1 : 0);
+  } else if constexpr (std::is_arithmetic<Type>::value) {
+    STARTEAR_ASSERT(c == Category::Literal);
+    setDouble(static_cast<double>(v));
   } else {
     NOT_REACHED;
   }
 }
 
+// Configuration of Program::inlineFunctions().
+struct InlineOptions {
+  // Callee whose body has more instructions than this is never inlined.
+  size_t budget_{12};
+  // Call counts indexed by function id, which are recorded by VM on the
+  // program generated from the same source. If it is given, only callees which
+  // have been called at least min_calls_ times are inlined.
+  const std::vector<uint64_t>* call_counts_{nullptr};
+  uint64_t min_calls_{1};
+};
+
 class Program {
  public:
   // Instructions
@@ -111,17 +190,30 @@ class Program {
   void addInst(OPCode code,
                std::initializer_list<std::pair<Value::Category, T>> operands);
   void addInst(OPCode code);
-  std::optional<std::reference_wrapper<const Instruction>> fetchInst(size_t pc);
+  // Operands are embedded into the instruction as is, e.g. slot index.
+  void addInst(OPCode code, std::initializer_list<size_t> immediates);
+  // Program counter is the byte offset of instruction in the sequence.
+  std::optional<Instruction> fetchInst(size_t pc) const;
 
   // Value
+  // Values are interned. The same value is stored only once, and its index
+  // never changes after that.
   size_t addValue(Value v);
-  std::optional<Value> fetchValue(size_t i);
+  std::optional<Value> fetchValue(size_t i) const;
 
   struct FunctionMetadata {
     std::string name_;
-    size_t pc_;  // Program counter of specified function.
-    std::vector<size_t>
-        args_;  // The pointers to argument names for temporal use.
+    size_t id_;     // Index of this function in the registry.
+    size_t pc_;     // Program counter of specified function.
+    size_t arity_;  // The number of arguments. They occupy the first slots.
+    // Slot index to local variable name. The size of this is the number of
+    // slots which the frame of this function requires.
+    std::vector<std::string> locals_;
+
+    // Returns the slot index of given variable. New slot will be assigned if
+    // it has not been seen.
+    size_t resolveSlot(std::string_view name);
+    std::optional<size_t> findSlot(std::string_view name) const;
   };
 
   struct FunctionRegistry {
@@ -129,38 +221,124 @@ class Program {
     findByProgramCounter(size_t line) const;
     std::optional<std::reference_wrapper<const FunctionMetadata>> findByName(
         std::string name) const;
-    void registerLabel(std::string label, size_t pc);
-    void registerFunction(std::string name, std::vector<size_t>& args,
-                          size_t pc);
+    const FunctionMetadata& findById(size_t id) const {
+      STARTEAR_ASSERT(id < functions_.size());
+      return functions_[id];
+    }
+    size_t registerFunction(std::string name, std::vector<std::string>& args,
+                            size_t pc);
+    size_t size() const { return functions_.size(); }
 
    private:
+    friend Program;
+    friend class BytecodeFile;
+
     // TODO: replace flat hash map
-    std::unordered_map<size_t, std::string> pc_name_;
-    std::unordered_map<std::string, FunctionMetadata> metadata_;
+    std::unordered_map<size_t, size_t> pc_id_;
+    std::unordered_map<std::string, size_t> name_id_;
+    std::vector<FunctionMetadata> functions_;
   };
 
   friend FunctionRegistry;
+  friend class BytecodeFile;
 
   // Function symbol tables.
   // Register symbol name and current top instruction pointer.
   // This function is used if you'd like to create function from bytecode
   // generation AST visitor.
-  void addFunction(std::string name, std::vector<size_t>& args);
+  void addFunction(std::string name, std::vector<std::string>& args);
   void addLabel(std::string name);
+  // Resolve local variable name to the slot index of the function which is
+  // under code generation. Variables outside of functions are resolved in the
+  // top level scope. New slot is declared by let statement.
+  size_t resolveLocalSlot(std::string_view name);
+  // Look up the slot of local variable which must have been declared by let
+  // statement or argument. Undeclared variable is reported, and the program
+  // fails to link.
+  size_t findLocalSlot(std::string_view name);
   std::string getIndexedLabel();
   const FunctionRegistry& functionRegistry() const {
     return registered_function_;
   }
 
+  // Peephole pass which fuses frequent instruction sequences into
+  // superinstructions, e.g. OP_PUSH and OP_STORE_SLOT into OP_PUSH_STORE.
+  // Jump targets are never fused into the middle of them. It must be called
+  // before link().
+  void fuseSuperinstructions();
+
+  // Splice the bodies of small functions into their call sites. Callees must
+  // be straight-line code which ends with OP_RETURN, so that they are never
+  // recursive. Their locals are renamed into new slots of caller, e.g. `x` of
+  // `inc` into `inc.x`. It returns the number of inlined call sites, and must
+  // be called before fuseSuperinstructions() and link().
+  size_t inlineFunctions(const InlineOptions& options);
+
+  // Resolve symbolic operands into the form which VM can execute directly.
+  // The operand of OP_CALL is rewritten to the id of callee function, and the
+  // operands of OP_BRANCH and jumps are rewritten to program counters. It will
+  // fail if undefined symbol is referred, and the program is left unchanged in
+  // that case. Calls in tail position are rewritten into OP_TAIL_CALL.
+  bool link();
+  bool linked() const { return linked_; }
+
+  // Rewrite the opcode of the instruction in place, e.g. into quickened one.
+  // The operands must have the same layout. It fails if the program is mapped,
+  // whose pages are read-only and shared between processes.
+  bool rewriteOpcode(size_t pc, OPCode code);
+
   // Properties
-  const std::vector<Instruction>& instructions() { return instructions_; }
-  const std::vector<Value>& values() { return values_; }
+  // Instructions and values which are built in this process. Mapped program
+  // has neither of them.
+  const std::vector<uint8_t>& code() const {
+    STARTEAR_ASSERT(!mapped());
+    return code_;
+  }
+  // Decode all of instructions. This is mainly used for tooling or testing.
+  std::vector<Instruction> instructions() const;
+  const std::vector<Value>& values() const {
+    STARTEAR_ASSERT(!mapped());
+    return values_;
+  }
+
+  // Instructions and values which VM executes. They are borrowed from the
+  // read-only image if the program is mapped by BytecodeFile::load().
+  const uint8_t* codeData() const {
+    return image_ ? image_->code_ : code_.data();
+  }
+  size_t codeSize() const { return image_ ? image_->code_size_ : code_.size(); }
+  const Value* valueData() const {
+    return image_ ? image_->values_ : values_.data();
+  }
+  size_t valueCount() const {
+    return image_ ? image_->value_count_ : values_.size();
+  }
+  bool mapped() const { return image_ != nullptr; }
 
  private:
-  bool isProgramEnd(size_t pc) const { return pc >= instructions_.size(); }
+  // Read-only image which is shared by all of copies of mapped program.
+  struct Image {
+    // Keeps the mapping alive.
+    std::shared_ptr<const void> owner_;
+    const uint8_t* code_;
+    size_t code_size_;
+    const Value* values_;
+    size_t value_count_;
+  };
+
+  bool isProgramEnd(size_t pc) const { return pc >= codeSize(); }
+  void emitOpcode(OPCode code);
+  void emitOperand(size_t operand);
+  void patchOperand(size_t pc, size_t i, size_t operand);
+  void markTailCalls();
+  // Move labels and functions after instructions are rewritten. Relocation
+  // maps old program counters to new ones.
+  void relocate(const std::unordered_map<size_t, size_t>& relocation);
 
-  std::vector<Instruction> instructions_;
+  std::vector<uint8_t> code_;
   std::vector<Value> values_;
+  // Raw representation of value to its index on values_.
+  std::unordered_map<uint64_t, size_t> value_index_;
   // This is a pair of function label and pointer in the instructions.
   // For example, try to consider this function
   //
@@ -173,13 +351,22 @@ class Program {
   // in this case, we can get these instructions,
   //
   // 16 | OP_PUSH 32 <- function sample
-  // 17 | OP_PUSH 35
-  // 18 | OP_ADD
-  // 19 | OP_RETURN
+  // 21 | OP_PUSH 35
+  // 26 | OP_ADD
+  // 27 | OP_RETURN
   //
   // In this case, we set the pair {"sample", {16, 0}} in this hash table.
   FunctionRegistry registered_function_;
   size_t label_index_{0};
+  // Label name to program counter. Labels are only used until linking.
+  std::unordered_map<std::string, size_t> labels_;
+  bool linked_{false};
+  // Undeclared local variable has been loaded during code generation.
+  bool undefined_local_{false};
+  // Function which is under code generation.
+  std::optional<size_t> current_function_;
+  FunctionMetadata toplevel_{"", 0, 0, 0, {}};
+  std::shared_ptr<const Image> image_;
 };
 
 template <typename T>
@@ -189,13 +376,11 @@ void Program::addInst(
   if (!validOperandSize(code, operands.size())) {
     return;
   }
-  std::vector<size_t> operands_ptr;
+  emitOpcode(code);
   for (const auto& [category, operand] : operands) {
     Value v(category, operand);
-    auto ptr = addValue(v);
-    operands_ptr.emplace_back(ptr);
+    emitOperand(addValue(v));
   }
-  instructions_.emplace_back(code, operands_ptr.begin(), operands_ptr.end());
 }
 
 }  // namespace Startear
@@ -0,0 +1,407 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "register_program.h"
+
+#include <fmt/format.h>
+
+#include <iostream>
+#include <unordered_set>
+
+namespace Startear {
+
+namespace {
+std::optional<RegisterOPCode> binaryOpcode(OPCode code) {
+  switch (code) {
+    case OPCode::OP_ADD:
+      return RegisterOPCode::OP_ADD;
+    case OPCode::OP_SUB:
+      return RegisterOPCode::OP_SUB;
+    case OPCode::OP_MUL:
+      return RegisterOPCode::OP_MUL;
+    case OPCode::OP_DIV:
+      return RegisterOPCode::OP_DIV;
+    case OPCode::OP_EQUAL:
+      return RegisterOPCode::OP_EQUAL;
+    case OPCode::OP_BANG_EQUAL:
+      return RegisterOPCode::OP_BANG_EQUAL;
+    case OPCode::OP_LESS_EQUAL:
+      return RegisterOPCode::OP_LESS_EQUAL;
+    case OPCode::OP_GREATER_EQUAL:
+      return RegisterOPCode::OP_GREATER_EQUAL;
+    case OPCode::OP_LESS:
+      return RegisterOPCode::OP_LESS;
+    case OPCode::OP_GREATER:
+      return RegisterOPCode::OP_GREATER;
+    case OPCode::OP_AND:
+      return RegisterOPCode::OP_AND;
+    case OPCode::OP_OR:
+      return RegisterOPCode::OP_OR;
+    default:
+      return std::nullopt;
+  }
+}
+}  // namespace
+
+std::string registerOpcodeToString(RegisterOPCode op) {
+  switch (op) {
+    case RegisterOPCode::OP_MOVE:
+      return "OP_MOVE";
+    case RegisterOPCode::OP_ADD:
+      return "OP_ADD";
+    case RegisterOPCode::OP_SUB:
+      return "OP_SUB";
+    case RegisterOPCode::OP_MUL:
+      return "OP_MUL";
+    case RegisterOPCode::OP_DIV:
+      return "OP_DIV";
+    case RegisterOPCode::OP_EQUAL:
+      return "OP_EQUAL";
+    case RegisterOPCode::OP_BANG_EQUAL:
+      return "OP_BANG_EQUAL";
+    case RegisterOPCode::OP_LESS_EQUAL:
+      return "OP_LESS_EQUAL";
+    case RegisterOPCode::OP_GREATER_EQUAL:
+      return "OP_GREATER_EQUAL";
+    case RegisterOPCode::OP_LESS:
+      return "OP_LESS";
+    case RegisterOPCode::OP_GREATER:
+      return "OP_GREATER";
+    case RegisterOPCode::OP_AND:
+      return "OP_AND";
+    case RegisterOPCode::OP_OR:
+      return "OP_OR";
+    case RegisterOPCode::OP_BRANCH:
+      return "OP_BRANCH";
+    case RegisterOPCode::OP_CHECK_BOOLEAN:
+      return "OP_CHECK_BOOLEAN";
+    case RegisterOPCode::OP_CALL:
+      return "OP_CALL";
+    case RegisterOPCode::OP_RETURN:
+      return "OP_RETURN";
+    case RegisterOPCode::OP_PRINT:
+      return "OP_PRINT";
+    case RegisterOPCode::OP_HALT:
+      return "OP_HALT";
+    default:
+      return "";
+  }
+}
+
+bool RegisterProgram::lower(const Program& program) {
+  if (!program.linked()) {
+    std::cerr << "Program must be linked before lowering" << std::endl;
+    return false;
+  }
+  const auto& registry = program.functionRegistry();
+  const auto* code = program.codeData();
+  const auto code_size = program.codeSize();
+  code_.clear();
+  values_.assign(program.valueData(),
+                 program.valueData() + program.valueCount());
+  registered_function_ = registry;
+  entries_.clear();
+  frame_sizes_.clear();
+  for (size_t id = 0; id < registry.size(); ++id) {
+    entries_.emplace_back(0);
+    frame_sizes_.emplace_back(registry.findById(id).locals_.size());
+  }
+
+  std::unordered_set<size_t> jump_targets;
+  for (const auto& instr : program.instructions()) {
+    if (instr.opcode() == OPCode::OP_BRANCH ||
+        instr.opcode() == OPCode::OP_COMPARE_BRANCH) {
+      jump_targets.emplace(instr.operand(instr.operandSize() - 2));
+      jump_targets.emplace(instr.operand(instr.operandSize() - 1));
+    } else if (instr.opcode() == OPCode::OP_JUMP_IF_FALSE_OR_POP ||
+               instr.opcode() == OPCode::OP_JUMP_IF_TRUE_OR_POP) {
+      jump_targets.emplace(instr.operand(0));
+    }
+  }
+
+  // Simulated operand stack. The value at depth i is placed on the temporary
+  // register locals + i if it is computed, otherwise it refers to the local
+  // variable or the constant directly.
+  std::vector<operand_t> operands;
+  std::optional<size_t> function_id;
+  size_t locals = 0;
+  std::unordered_map<size_t, size_t> relocation;
+  std::vector<size_t> branches;
+  // Program counter where the result of logical operator is merged, to the
+  // depth of the result. Both of paths leave it on the same temporary.
+  std::unordered_map<size_t, size_t> merges;
+
+  const auto emit = [&](RegisterOPCode opcode, size_t a, size_t b = 0,
+                        size_t c = 0) {
+    code_.emplace_back(RegisterInstruction{opcode, static_cast<operand_t>(a),
+                                           static_cast<operand_t>(b),
+                                           static_cast<operand_t>(c)});
+  };
+  const auto temporary = [&](size_t depth) {
+    auto reg = locals + depth;
+    if (function_id.has_value()) {
+      frame_sizes_[*function_id] =
+          std::max(frame_sizes_[*function_id], reg + 1);
+    }
+    return static_cast<operand_t>(reg);
+  };
+  const auto pop = [&]() {
+    STARTEAR_ASSERT(!operands.empty());
+    auto operand = operands.back();
+    operands.pop_back();
+    return operand;
+  };
+  // Local variable is going to be overwritten. Values on the operand stack
+  // which refer to it must be saved before that.
+  const auto preserve = [&](operand_t slot) {
+    for (size_t depth = 0; depth < operands.size(); ++depth) {
+      if (operands[depth] == slot) {
+        emit(RegisterOPCode::OP_MOVE, temporary(depth), slot);
+        operands[depth] = temporary(depth);
+      }
+    }
+  };
+  // Value on the operand stack is moved to its temporary register.
+  const auto materialize = [&](size_t depth) {
+    if (operands[depth] != temporary(depth)) {
+      emit(RegisterOPCode::OP_MOVE, temporary(depth), operands[depth]);
+      operands[depth] = temporary(depth);
+    }
+  };
+  // If the next instruction stores the result to local variable, returns its
+  // slot, and the store is fused into the current instruction.
+  const auto store_destination = [&](size_t& next_pc) -> std::optional<size_t> {
+    if (next_pc >= code_size ||
+        jump_targets.find(next_pc) != jump_targets.end()) {
+      return std::nullopt;
+    }
+    Instruction next(code + next_pc);
+    if (next.opcode() != OPCode::OP_STORE_SLOT) {
+      return std::nullopt;
+    }
+    preserve(next.operand(0));
+    next_pc += next.length();
+    return next.operand(0);
+  };
+  const auto binary = [&](RegisterOPCode opcode, operand_t lhs, operand_t rhs,
+                          size_t& next_pc) {
+    auto slot = store_destination(next_pc);
+    if (slot.has_value()) {
+      emit(opcode, *slot, lhs, rhs);
+      return;
+    }
+    auto dst = temporary(operands.size());
+    emit(opcode, dst, lhs, rhs);
+    operands.emplace_back(dst);
+  };
+
+  for (size_t pc = 0; pc < code_size;) {
+    auto function = registry.findByProgramCounter(pc);
+    if (function.has_value()) {
+      function_id = function->get().id_;
+      locals = function->get().locals_.size();
+      entries_[*function_id] = code_.size();
+      operands.clear();
+    }
+    // The move is only on the path of right operand, so that it is placed
+    // before the jump target.
+    if (auto itr = merges.find(pc); itr != merges.end()) {
+      STARTEAR_ASSERT(operands.size() == itr->second + 1);
+      materialize(itr->second);
+    }
+    relocation.emplace(pc, code_.size());
+    Instruction instr(code + pc);
+    size_t next_pc = pc + instr.length();
+
+    switch (genericOpcode(instr.opcode())) {
+      case OPCode::OP_PUSH:
+        operands.emplace_back(constant(instr.operand(0)));
+        break;
+      case OPCode::OP_LOAD_SLOT:
+        operands.emplace_back(instr.operand(0));
+        break;
+      case OPCode::OP_STORE_SLOT: {
+        auto value = pop();
+        preserve(instr.operand(0));
+        if (value != instr.operand(0)) {
+          emit(RegisterOPCode::OP_MOVE, instr.operand(0), value);
+        }
+        break;
+      }
+      case OPCode::OP_PUSH_STORE:
+        preserve(instr.operand(1));
+        emit(RegisterOPCode::OP_MOVE, instr.operand(1),
+             constant(instr.operand(0)));
+        break;
+      case OPCode::OP_ADD_SLOT_CONST:
+        binary(RegisterOPCode::OP_ADD, instr.operand(0),
+               constant(instr.operand(1)), next_pc);
+        break;
+      case OPCode::OP_COMPARE_BRANCH: {
+        auto rhs = pop();
+        auto lhs = pop();
+        auto cond = temporary(operands.size());
+        emit(*binaryOpcode(static_cast<OPCode>(instr.operand(0))), cond, lhs,
+             rhs);
+        branches.emplace_back(code_.size());
+        emit(RegisterOPCode::OP_BRANCH, cond, instr.operand(1),
+             instr.operand(2));
+        break;
+      }
+      case OPCode::OP_BRANCH:
+        branches.emplace_back(code_.size());
+        emit(RegisterOPCode::OP_BRANCH, pop(), instr.operand(0),
+             instr.operand(1));
+        break;
+      case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+      case OPCode::OP_JUMP_IF_TRUE_OR_POP: {
+        STARTEAR_ASSERT(!operands.empty());
+        // Left operand is the result if the jump is taken.
+        const auto depth = operands.size() - 1;
+        materialize(depth);
+        merges.emplace(instr.operand(0), depth);
+        // Stack VM rejects the left operand other than 0 or 1, even if it
+        // would be taken as true by the branch.
+        emit(RegisterOPCode::OP_CHECK_BOOLEAN, operands[depth]);
+        branches.emplace_back(code_.size());
+        if (instr.opcode() == OPCode::OP_JUMP_IF_TRUE_OR_POP) {
+          emit(RegisterOPCode::OP_BRANCH, pop(), instr.operand(0), next_pc);
+        } else {
+          emit(RegisterOPCode::OP_BRANCH, pop(), next_pc, instr.operand(0));
+        }
+        break;
+      }
+      // Register VM has no tail calls. Instructions which follow the tail call
+      // return its result.
+      case OPCode::OP_TAIL_CALL:
+      case OPCode::OP_CALL: {
+        const auto& callee = registry.findById(instr.operand(0));
+        STARTEAR_ASSERT(operands.size() >= callee.arity_);
+        // Arguments must be placed on the top of registers in order.
+        auto first = operands.size() - callee.arity_;
+        for (auto depth = first; depth < operands.size(); ++depth) {
+          if (operands[depth] != temporary(depth)) {
+            emit(RegisterOPCode::OP_MOVE, temporary(depth), operands[depth]);
+          }
+        }
+        operands.resize(first);
+        auto base = temporary(first);
+        auto slot = store_destination(next_pc);
+        if (slot.has_value()) {
+          emit(RegisterOPCode::OP_CALL, *slot, callee.id_, base);
+        } else {
+          emit(RegisterOPCode::OP_CALL, base, callee.id_, base);
+          operands.emplace_back(base);
+        }
+        break;
+      }
+      case OPCode::OP_RETURN:
+        emit(RegisterOPCode::OP_RETURN, operands.empty() ? no_operand : pop());
+        break;
+      case OPCode::OP_PRINT:
+        emit(RegisterOPCode::OP_PRINT, constant(instr.operand(0)));
+        break;
+      case OPCode::OP_HALT:
+        emit(RegisterOPCode::OP_HALT, 0);
+        break;
+      default: {
+        auto opcode = binaryOpcode(genericOpcode(instr.opcode()));
+        if (!opcode.has_value()) {
+          std::cerr << fmt::format("{} can't be lowered",
+                                   opcodeToString(instr.opcode()))
+                    << std::endl;
+          return false;
+        }
+        auto rhs = pop();
+        auto lhs = pop();
+        binary(*opcode, lhs, rhs, next_pc);
+        break;
+      }
+    }
+    pc = next_pc;
+  }
+  relocation.emplace(code_size, code_.size());
+
+  for (const auto i : branches) {
+    code_[i].b_ = relocation.at(code_[i].b_);
+    code_[i].c_ = relocation.at(code_[i].c_);
+  }
+  lowered_ = true;
+  return true;
+}
+
+void disassemble(const RegisterProgram& p) {
+  const auto rk = [&](operand_t operand) -> std::string {
+    if (!RegisterProgram::isConstant(operand)) {
+      return fmt::format("r{}", operand);
+    }
+    const auto& v = p.value(operand);
+    if (v.getDouble()) {
+      return fmt::format("{}", *v.getDouble());
+    }
+    if (v.getString()) {
+      return fmt::format("\"{}\"", *v.getString());
+    }
+    return "nil";
+  };
+  for (size_t pc = 0; pc < p.code().size(); ++pc) {
+    const auto& instr = p.code()[pc];
+    auto instr_str = registerOpcodeToString(instr.opcode_);
+    std::cout << fmt::format("{:04} | ", pc);
+    switch (instr.opcode_) {
+      case RegisterOPCode::OP_MOVE:
+        std::cout << fmt::format("{} r{} {}", instr_str, instr.a_,
+                                 rk(instr.b_));
+        break;
+      case RegisterOPCode::OP_BRANCH:
+        std::cout << fmt::format("{} {} {} {}", instr_str, rk(instr.a_),
+                                 instr.b_, instr.c_);
+        break;
+      case RegisterOPCode::OP_CALL:
+        std::cout << fmt::format(
+            "{} r{} {} r{}", instr_str, instr.a_,
+            p.functionRegistry().findById(instr.b_).name_, instr.c_);
+        break;
+      case RegisterOPCode::OP_RETURN:
+        std::cout << fmt::format(
+            "{} {}", instr_str,
+            instr.a_ == RegisterProgram::no_operand ? "" : rk(instr.a_));
+        break;
+      case RegisterOPCode::OP_PRINT:
+        std::cout << fmt::format("{} {}", instr_str, rk(instr.a_));
+        break;
+      case RegisterOPCode::OP_HALT:
+        std::cout << instr_str;
+        break;
+      default:
+        std::cout << fmt::format("{} r{} {} {}", instr_str, instr.a_,
+                                 rk(instr.b_), rk(instr.c_));
+        break;
+    }
+    std::cout << std::endl;
+  }
+}
+
+}  // namespace Startear
@@ -0,0 +1,153 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_ALL_REGISTER_PROGRAM_H
+#define STARTEAR_ALL_REGISTER_PROGRAM_H
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "ast.h"
+#include "opcode.h"
+#include "program.h"
+
+namespace Startear {
+
+// Instructions of register based VM. Registers are the slots of frame, where
+// local variables are placed first, and temporaries follow them. RK(x) is the
+// operand which refers to register x, or constant x if it is marked as
+// constant by RegisterProgram::constant().
+enum class RegisterOPCode : uint8_t {
+  // a <- RK(b)
+  OP_MOVE,
+  // a <- RK(b) (add, sub, mul, div) RK(c)
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  // a <- RK(b) (==, !=, <=, >=, <, >, &&, ||) RK(c). The result is 0 or 1.
+  OP_EQUAL,
+  OP_BANG_EQUAL,
+  OP_LESS_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS,
+  OP_GREATER,
+  OP_AND,
+  OP_OR,
+  // Jump to b if RK(a) is 1, otherwise jump to c.
+  OP_BRANCH,
+  // Terminate the program unless RK(a) is 0 or 1, e.g. left operand of &&.
+  OP_CHECK_BOOLEAN,
+  // a <- call function whose id is b. Arguments are placed on the registers
+  // from c, and they become the first registers of callee frame in place.
+  OP_CALL,
+  // Return RK(a), or nil if a is no_operand.
+  OP_RETURN,
+  // Print RK(a).
+  OP_PRINT,
+  // Terminate the program.
+  OP_HALT,
+};
+
+std::string registerOpcodeToString(RegisterOPCode op);
+
+// Three-address instruction. Unlike the stack based Program, it is not
+// encoded into bytes because all of instructions have the same width.
+struct RegisterInstruction {
+  RegisterOPCode opcode_;
+  operand_t a_{0};
+  operand_t b_{0};
+  operand_t c_{0};
+};
+
+class RegisterProgram {
+ public:
+  static constexpr operand_t constant_bit = 1u << 31;
+  static constexpr operand_t no_operand =
+      std::numeric_limits<operand_t>::max();
+
+  static operand_t constant(size_t i) {
+    STARTEAR_ASSERT(i < constant_bit);
+    return static_cast<operand_t>(i) | constant_bit;
+  }
+  static bool isConstant(operand_t operand) {
+    return (operand & constant_bit) != 0;
+  }
+
+  // Lower the linked stack based program into three-address instructions.
+  // Operand stack of each function is simulated at code generation time, so
+  // that OP_PUSH and OP_LOAD_SLOT become operands of following instruction,
+  // and the result is stored directly if it is followed by OP_STORE_SLOT.
+  bool lower(const Program& program);
+  bool lowered() const { return lowered_; }
+
+  const std::vector<RegisterInstruction>& code() const { return code_; }
+  const Value& value(operand_t operand) const {
+    STARTEAR_ASSERT(isConstant(operand));
+    return values_[operand & ~constant_bit];
+  }
+  const Program::FunctionRegistry& functionRegistry() const {
+    return registered_function_;
+  }
+  // Program counter of the function, which is the index of instruction.
+  size_t entry(size_t function_id) const { return entries_[function_id]; }
+  // The number of registers which the frame of the function requires.
+  size_t frameSize(size_t function_id) const {
+    return frame_sizes_[function_id];
+  }
+
+ private:
+  std::vector<RegisterInstruction> code_;
+  std::vector<Value> values_;
+  Program::FunctionRegistry registered_function_;
+  std::vector<size_t> entries_;
+  std::vector<size_t> frame_sizes_;
+  bool lowered_{false};
+};
+
+void disassemble(const RegisterProgram& p);
+
+// Emit instructions for RegisterVM. AST is lowered to the stack based program
+// once, and then it is translated into register based one.
+class RegisterVMInstructionEmitter : public IASTNodeVisitor {
+ public:
+  void visit(ASTNode& node) override { node.self(program_); }
+
+  const RegisterProgram& emit() {
+    if (program_.link()) {
+      register_program_.lower(program_);
+    }
+    return register_program_;
+  }
+
+ private:
+  Program program_;
+  RegisterProgram register_program_;
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_ALL_REGISTER_PROGRAM_H
@@ -0,0 +1,224 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "register_vm.h"
+
+#include <fmt/format.h>
+
+#include <iostream>
+
+#define TERMINATE_VM                     \
+  state_ = VMState::TerminatedWithError; \
+  NOT_REACHED;
+
+namespace Startear {
+
+RegisterVM::RegisterVM(const RegisterProgram& program, size_t stack_size)
+    : program_(program), stack_(stack_size) {
+  if (!program_.lowered()) {
+    std::cerr << "Program must be lowered before execution" << std::endl;
+    NOT_REACHED;
+  }
+  auto main_entry_info = program_.functionRegistry().findByName("main");
+  if (!main_entry_info.has_value()) {
+    std::cerr << "Failed to load `main` function" << std::endl;
+    NOT_REACHED;
+  }
+  pushFrame(main_entry_info->get().id_, 0, 0, 0);
+  pc_ = program_.entry(main_entry_info->get().id_);
+}
+
+void RegisterVM::pushStack(Value v) {
+  if (sp_ >= stack_.size()) {
+    std::cerr << "Stack overflow" << std::endl;
+    TERMINATE_VM;
+  }
+  stack_[sp_++] = v;
+}
+
+Value RegisterVM::popStack() {
+  STARTEAR_ASSERT(!frame_.empty());
+  STARTEAR_ASSERT(sp_ > frame_.back().base_ +
+                            program_.frameSize(frame_.back().function_id_));
+  return stack_[--sp_];
+}
+
+void RegisterVM::pushFrame(size_t function_id, size_t base, size_t return_pc,
+                           size_t return_register) {
+  const auto& function = program_.functionRegistry().findById(function_id);
+  const auto frame_size = program_.frameSize(function_id);
+  if (base + frame_size > stack_.size()) {
+    std::cerr << "Stack overflow" << std::endl;
+    TERMINATE_VM;
+  }
+  for (auto i = base + function.arity_; i < base + function.locals_.size();
+       ++i) {
+    stack_[i] = Value();
+  }
+  frame_.emplace_back(Frame{base, return_pc, return_register, function_id});
+  sp_ = base + frame_size;
+}
+
+void RegisterVM::start() {
+  const auto* code = program_.code().data();
+  while (true) {
+    const auto& instr = code[pc_];
+    auto* registers = stack_.data() + frame_.back().base_;
+    const auto rk = [&](operand_t operand) -> Value {
+      if (RegisterProgram::isConstant(operand)) {
+        return program_.value(operand);
+      }
+      return registers[operand];
+    };
+    const auto number = [&](operand_t operand) -> double {
+      auto d = rk(operand).getDouble();
+      if (!d.has_value()) {
+        TERMINATE_VM;
+      }
+      return *d;
+    };
+    const auto set = [&](double d) {
+      registers[instr.a_] = Value(Value::Category::Literal, d);
+    };
+
+    switch (instr.opcode_) {
+      case RegisterOPCode::OP_MOVE:
+        registers[instr.a_] = rk(instr.b_);
+        break;
+      case RegisterOPCode::OP_ADD:
+        set(number(instr.b_) + number(instr.c_));
+        break;
+      case RegisterOPCode::OP_SUB:
+        set(number(instr.b_) - number(instr.c_));
+        break;
+      case RegisterOPCode::OP_MUL:
+        set(number(instr.b_) * number(instr.c_));
+        break;
+      case RegisterOPCode::OP_DIV:
+        set(number(instr.b_) / number(instr.c_));
+        break;
+      case RegisterOPCode::OP_EQUAL:
+        set(number(instr.b_) == number(instr.c_));
+        break;
+      case RegisterOPCode::OP_BANG_EQUAL:
+        set(number(instr.b_) != number(instr.c_));
+        break;
+      case RegisterOPCode::OP_LESS_EQUAL:
+        set(number(instr.b_) <= number(instr.c_));
+        break;
+      case RegisterOPCode::OP_GREATER_EQUAL:
+        set(number(instr.b_) >= number(instr.c_));
+        break;
+      case RegisterOPCode::OP_LESS:
+        set(number(instr.b_) < number(instr.c_));
+        break;
+      case RegisterOPCode::OP_GREATER:
+        set(number(instr.b_) > number(instr.c_));
+        break;
+      case RegisterOPCode::OP_AND:
+      case RegisterOPCode::OP_OR: {
+        auto lhs = number(instr.b_);
+        auto rhs = number(instr.c_);
+        if ((lhs != 0 && lhs != 1) || (rhs != 0 && rhs != 1)) {
+          TERMINATE_VM;
+        }
+        set(instr.opcode_ == RegisterOPCode::OP_AND ? lhs && rhs
+                                                    : lhs || rhs);
+        break;
+      }
+      case RegisterOPCode::OP_BRANCH:
+        pc_ = number(instr.a_) != 0 ? instr.b_ : instr.c_;
+        continue;
+      case RegisterOPCode::OP_CHECK_BOOLEAN: {
+        auto value = number(instr.a_);
+        if (value != 0 && value != 1) {
+          TERMINATE_VM;
+        }
+        break;
+      }
+      case RegisterOPCode::OP_CALL:
+        pushFrame(instr.b_, frame_.back().base_ + instr.c_, pc_ + 1, instr.a_);
+        pc_ = program_.entry(instr.b_);
+        continue;
+      case RegisterOPCode::OP_RETURN: {
+        auto value =
+            instr.a_ == RegisterProgram::no_operand ? Value() : rk(instr.a_);
+        // Returning from the entry function terminates the program. Its frame
+        // is remained to analyse the state of VM.
+        if (frame_.size() == 1) {
+          state_ = VMState::SuccessfulTerminated;
+          return;
+        }
+        auto frame = frame_.back();
+        frame_.pop_back();
+        const auto& caller = frame_.back();
+        stack_[caller.base_ + frame.return_register_] = value;
+        sp_ = caller.base_ + program_.frameSize(caller.function_id_);
+        pc_ = frame.return_pc_;
+        continue;
+      }
+      case RegisterOPCode::OP_PRINT:
+        print(rk(instr.a_));
+        break;
+      case RegisterOPCode::OP_HALT:
+        state_ = VMState::SuccessfulTerminated;
+        return;
+      default:
+        std::cerr << fmt::format("{} is unsupported instruction",
+                                 registerOpcodeToString(instr.opcode_))
+                  << std::endl;
+        TERMINATE_VM;
+    }
+    ++pc_;
+  }
+}
+
+std::optional<Value> RegisterVM::peekLocalVariable(
+    std::string_view name) const {
+  auto slot = peekFunction().findSlot(name);
+  if (!slot.has_value()) {
+    return std::nullopt;
+  }
+  return stack_[frame_.back().base_ + *slot];
+}
+
+void RegisterVM::print(const Value& v) {
+  switch (v.type()) {
+    case Value::SupportedTypes::String:
+      std::cout << v.getString().value() << std::endl;
+      break;
+    case Value::SupportedTypes::Double:
+      std::cout << v.getDouble().value() << std::endl;
+      break;
+    case Value::SupportedTypes::Boolean:
+      std::cout << (v.getBoolean().value() ? "true" : "false") << std::endl;
+      break;
+    default:
+      std::cout << "nil" << std::endl;
+      break;
+  }
+}
+
+}  // namespace Startear
@@ -0,0 +1,96 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_ALL_REGISTER_VM_H
+#define STARTEAR_ALL_REGISTER_VM_H
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "register_program.h"
+#include "vm.h"
+
+namespace Startear {
+
+class RegisterVM : public VM {
+ public:
+  static constexpr size_t default_stack_size = 1 << 16;
+
+  RegisterVM(const RegisterProgram& program,
+             size_t stack_size = default_stack_size);
+
+  // VM
+  void incPc() override { ++pc_; }
+  // Values beyond the registers of top frame are used as stack.
+  void pushStack(Value v) override;
+  Value popStack() override;
+
+  // Registers of each frame are placed on the single value stack. Arguments
+  // are written to the top registers of caller, and they become the first
+  // registers of callee in place.
+  //
+  // |  ...  | local0 | temp0 | arg0 | arg1 | local1 | temp1 |  ...
+  //         ^ caller base_   ^ callee base_
+  struct Frame {
+    size_t base_{0};
+    size_t return_pc_{0};
+    // Register of caller frame to which the return value is written.
+    size_t return_register_{0};
+    size_t function_id_{0};
+  };
+
+  const Program::FunctionMetadata& peekFunction() const {
+    STARTEAR_ASSERT(!frame_.empty());
+    return program_.functionRegistry().findById(frame_.back().function_id_);
+  }
+  // Look up local variable of current frame by its name. This is only for
+  // debugging or testing.
+  std::optional<Value> peekLocalVariable(std::string_view name) const;
+
+  void start();
+
+ private:
+  enum VMState {
+    Initialized,
+    SuccessfulTerminated,
+    TerminatedWithError,
+  };
+
+  void pushFrame(size_t function_id, size_t base, size_t return_pc,
+                 size_t return_register);
+  void print(const Value& v);
+
+  size_t pc_{0};
+  const RegisterProgram& program_;
+  std::vector<Value> stack_;
+  size_t sp_{0};  // Index of the next entry of the registers of top frame.
+  std::vector<Frame> frame_;
+  VMState state_{VMState::Initialized};
+};
+
+}  // namespace Startear
+
+#endif  // STARTEAR_ALL_REGISTER_VM_H
@@ -0,0 +1,106 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_TOKEN_CURSOR_H
+#define STARTEAR_TOKEN_CURSOR_H
+
+#include <deque>
+#include <vector>
+
+#include "tokenizer.h"
+
+namespace Startear {
+// Reads tokens ahead for recursive descent. Tokens are either borrowed from
+// the vector, or pulled from the tokenizer lazily.
+class TokenCursor {
+ public:
+  // Borrow tokens, which must outlive the cursor.
+  TokenCursor(const std::vector<Token>& tokens)
+      : tokens_(tokens.data()), tokens_size_(tokens.size()) {}
+  TokenCursor(Tokenizer& tokenizer) : tokenizer_(&tokenizer) {}
+
+  bool match(TokenType expected) { return match(expected, 0); }
+
+  bool match(TokenType expected, size_t ahead) {
+    const auto* token = at(ahead);
+    return token != nullptr && token->type() == expected;
+  }
+
+  // Returns the token at ahead from the current one, or nullptr at the end of
+  // tokens.
+  const Token* at(size_t ahead) {
+    if (tokenizer_ == nullptr) {
+      return current_ + ahead < tokens_size_ ? &tokens_[current_ + ahead]
+                                             : nullptr;
+    }
+    while (window_.size() <= ahead) {
+      auto token = tokenizer_->next();
+      if (!token) {
+        return nullptr;
+      }
+      window_.emplace_back(*token);
+    }
+    return &window_[ahead];
+  }
+
+  // Returns the current token. The last token is returned at the end of
+  // tokens, which is used to report the line number of errors.
+  const Token& peek() {
+    if (const auto* token = at(0)) {
+      return *token;
+    }
+    if (tokenizer_ == nullptr && tokens_size_ != 0) {
+      return tokens_[tokens_size_ - 1];
+    }
+    return last_;
+  }
+
+  void forward() {
+    if (isEnd()) {
+      return;
+    }
+    if (tokenizer_ == nullptr) {
+      ++current_;
+      return;
+    }
+    last_ = window_.front();
+    window_.pop_front();
+  }
+
+  bool isEnd() { return at(0) == nullptr; }
+
+ private:
+  // Borrowed tokens.
+  const Token* tokens_{nullptr};
+  size_t tokens_size_{0};
+  size_t current_{0};
+  // Tokens pulled from the tokenizer, which are not consumed yet.
+  Tokenizer* tokenizer_{nullptr};
+  std::deque<Token> window_;
+  Token last_{TokenType::COMMENT, "", 1};
+};
+}  // namespace Startear
+
+#endif  // STARTEAR_TOKEN_CURSOR_H
@@ -25,23 +25,322 @@
 
 #include "tokenizer.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <iostream>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 namespace Startear {
 namespace {
-bool isDigit(char c) { return c >= '0' && c <= '9'; }
+enum CharClass : uint8_t {
+  Digit = 1 << 0,
+  Alpha = 1 << 1,  // Letters and underscore, which can start identifier.
+  Space = 1 << 2,  // Blank characters except for newline.
+};
+
+// Character class table indexed by byte.
+constexpr std::array<uint8_t, 256> char_classes = [] {
+  std::array<uint8_t, 256> table{};
+  for (int c = '0'; c <= '9'; ++c) {
+    table[c] |= CharClass::Digit;
+  }
+  for (int c = 'a'; c <= 'z'; ++c) {
+    table[c] |= CharClass::Alpha;
+    table[c - 'a' + 'A'] |= CharClass::Alpha;
+  }
+  table['_'] |= CharClass::Alpha;
+  table[' '] |= CharClass::Space;
+  table['\t'] |= CharClass::Space;
+  table['\r'] |= CharClass::Space;
+  return table;
+}();
+
+bool hasClass(char c, uint8_t classes) {
+  return (char_classes[static_cast<uint8_t>(c)] & classes) != 0;
+}
+
+bool isDigit(char c) { return hasClass(c, CharClass::Digit); }
+
+bool isAlpha(char c) { return hasClass(c, CharClass::Alpha); }
+
+// Keywords are looked up by perfect hash on the first and last character and
+// the length, which has no collision among reserved words.
+struct Keyword {
+  std::string_view word_;
+  TokenType type_;
+};
+
+constexpr size_t keywordHash(std::string_view word) {
+  return (2 * static_cast<uint8_t>(word.front()) +
+          3 * static_cast<uint8_t>(word.back()) + word.size()) &
+         15;
+}
+
+constexpr std::array<Keyword, 16> keywords = [] {
+  std::array<Keyword, 16> table{};
+  for (const auto& keyword : {Keyword{"let", TokenType::VAR},
+                              Keyword{"for", TokenType::FOR},
+                              Keyword{"fn", TokenType::FUN},
+                              Keyword{"true", TokenType::TRUE},
+                              Keyword{"false", TokenType::FALSE},
+                              Keyword{"if", TokenType::IF},
+                              Keyword{"else", TokenType::ELSE},
+                              Keyword{"nil", TokenType::NIL},
+                              Keyword{"return", TokenType::RETURN}}) {
+    table[keywordHash(keyword.word_)] = keyword;
+  }
+  return table;
+}();
+
+const Keyword* findKeyword(std::string_view word) {
+  const auto& keyword = keywords[keywordHash(word)];
+  if (keyword.word_ != word) {
+    return nullptr;
+  }
+  return &keyword;
+}
+
+// Returns the position of the first character from pos which is not in any
+// of classes. Blocks of characters are checked at once with SIMD if it is
+// available.
+size_t skipClass(std::string_view code, size_t pos, uint8_t classes) {
+  const auto* data = reinterpret_cast<const uint8_t*>(code.data());
+#if defined(__AVX2__)
+  const auto in_range = [](__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+  };
+  for (; pos + 32 <= code.size(); pos += 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+    auto mask = _mm256_setzero_si256();
+    if (classes & CharClass::Digit) {
+      mask = _mm256_or_si256(mask, in_range(v, '0', '9'));
+    }
+    if (classes & CharClass::Alpha) {
+      mask = _mm256_or_si256(mask, in_range(v, 'a', 'z'));
+      mask = _mm256_or_si256(mask, in_range(v, 'A', 'Z'));
+      mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    }
+    if (classes & CharClass::Space) {
+      mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+      mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+      mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    }
+    auto matched = static_cast<uint32_t>(_mm256_movemask_epi8(mask));
+    if (matched != 0xffffffff) {
+      return pos + __builtin_ctz(~matched);
+    }
+  }
+#elif defined(__SSE2__)
+  const auto in_range = [](__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+  };
+  for (; pos + 16 <= code.size(); pos += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+    auto mask = _mm_setzero_si128();
+    if (classes & CharClass::Digit) {
+      mask = _mm_or_si128(mask, in_range(v, '0', '9'));
+    }
+    if (classes & CharClass::Alpha) {
+      mask = _mm_or_si128(mask, in_range(v, 'a', 'z'));
+      mask = _mm_or_si128(mask, in_range(v, 'A', 'Z'));
+      mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    }
+    if (classes & CharClass::Space) {
+      mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+      mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+      mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    }
+    auto matched = static_cast<uint32_t>(_mm_movemask_epi8(mask));
+    if (matched != 0xffff) {
+      return pos + __builtin_ctz(~matched);
+    }
+  }
+#endif
+  while (pos < code.size() && (char_classes[data[pos]] & classes) != 0) {
+    ++pos;
+  }
+  return pos;
+}
 
-bool isAlpha(char c) {
-  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+// Returns the position of c from pos, or the end of code if not found.
+size_t findChar(std::string_view code, size_t pos, char c) {
+  const auto* data = code.data();
+#if defined(__AVX2__)
+  const auto target = _mm256_set1_epi8(c);
+  for (; pos + 32 <= code.size(); pos += 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+    auto matched = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, target)));
+    if (matched != 0) {
+      return pos + __builtin_ctz(matched);
+    }
+  }
+#elif defined(__SSE2__)
+  const auto target = _mm_set1_epi8(c);
+  for (; pos + 16 <= code.size(); pos += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+    auto matched =
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, target)));
+    if (matched != 0) {
+      return pos + __builtin_ctz(matched);
+    }
+  }
+#endif
+  while (pos < code.size() && data[pos] != c) {
+    ++pos;
+  }
+  return pos;
 }
 }  // namespace
 
+Source::~Source() {
+  if (mapped_ != nullptr) {
+    munmap(mapped_, mapped_size_);
+  }
+}
+
+std::unique_ptr<Source> Source::map(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  std::unique_ptr<Source> source(new Source());
+  if (st.st_size != 0) {
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "Failed to map " << path << std::endl;
+      close(fd);
+      return nullptr;
+    }
+    source->mapped_ = mapped;
+    source->mapped_size_ = st.st_size;
+    source->code_ =
+        std::string_view(static_cast<const char*>(mapped), st.st_size);
+  }
+  // Mapping remains after the descriptor is closed.
+  close(fd);
+  return source;
+}
+
+std::optional<Tokenizer> Tokenizer::fromFile(const std::string& path) {
+  auto source = Source::map(path);
+  if (source == nullptr) {
+    return std::nullopt;
+  }
+  return Tokenizer(std::move(source));
+}
+
 std::vector<Token>& Tokenizer::scanTokens() {
+  if (stream_ != nullptr) {
+    std::vector<Token> tokens;
+    while (auto token = next()) {
+      tokens.emplace_back(*token);
+    }
+    tokens_ = std::move(tokens);
+    next_ = tokens_.size();
+    return tokens_;
+  }
   while (current_ < code_.size()) {
     scanToken();
   }
   return tokens_;
 }
 
+std::optional<Token> Tokenizer::next() {
+  while (next_ >= tokens_.size()) {
+    tokens_.clear();
+    next_ = 0;
+    if (!scanMore()) {
+      return std::nullopt;
+    }
+  }
+  return tokens_[next_++];
+}
+
+bool Tokenizer::scanMore() {
+  if (stream_ == nullptr) {
+    if (isEnd()) {
+      return false;
+    }
+    scanToken();
+    return true;
+  }
+
+  auto& stream = *stream_;
+  if (stream.end_) {
+    return false;
+  }
+  // Drop consumed characters and append the next chunk after the rest.
+  auto& buffer = stream.buffer_;
+  buffer.erase(0, current_);
+  auto rest = buffer.size();
+  buffer.resize(rest + stream.chunk_size_);
+  stream.input_.read(buffer.data() + rest, stream.chunk_size_);
+  buffer.resize(rest + stream.input_.gcount());
+  stream.end_ = !stream.input_;
+  code_ = buffer;
+  current_ = 0;
+
+  while (!isEnd()) {
+    auto start = current_;
+    auto lineno = current_lineno_;
+    auto count = tokens_.size();
+    scanToken();
+    if (isEnd() && !stream.end_) {
+      // The last token may continue in the next chunk, so it is scanned
+      // again after that.
+      tokens_.erase(tokens_.begin() + count, tokens_.end());
+      current_ = start;
+      current_lineno_ = lineno;
+      break;
+    }
+  }
+  return true;
+}
+
+void Tokenizer::addToken(Token&& token) {
+  if (stream_ == nullptr) {
+    tokens_.emplace_back(token);
+    return;
+  }
+  // Lexemes which refer to the buffer are interned, since the buffer is
+  // overwritten by following chunks.
+  std::string_view lexeme = token.lexeme();
+  switch (token.type()) {
+    case TokenType::COMMENT:
+      lexeme = {};
+      break;
+    case TokenType::STRING:
+    case TokenType::NUMBER:
+    case TokenType::IDENTIFIER:
+      lexeme = *stream_->lexemes_.emplace(lexeme).first;
+      break;
+    default:
+      break;
+  }
+  tokens_.emplace_back(token.type(), lexeme, token.lineno());
+}
+
 void Tokenizer::scanToken() {
+  current_ = skipClass(code_, current_, CharClass::Space);
+  if (isEnd()) {
+    return;
+  }
   auto c = consume();
   switch (c) {
     case '\n':
@@ -98,22 +397,13 @@ void Tokenizer::scanToken() {
     case '|':
       if (nextMatch('|')) {
         addToken(Equality(TokenType::BAR_BAR, "||", current_lineno_));
-        break;
       }
+      break;
     case '&':
       if (nextMatch('&')) {
         addToken(Equality(TokenType::AND_AND, "&&", current_lineno_));
-        break;
       }
-    case 'l':
-      if (parseReservedWord(TokenType::VAR)) break;
-    case 'f':
-      if (parseReservedWord(TokenType::FOR)) break;
-      if (parseReservedWord(TokenType::FUN)) break;
-    case 'r':
-      if (parseReservedWord(TokenType::RETURN)) break;
-    case 'i':
-      if (parseReservedWord(TokenType::IF)) break;
+      break;
     default:
       if (isDigit(c)) {
         parseNumber();
@@ -153,87 +443,47 @@ void Tokenizer::parseInequality(TokenType t) {
 }
 
 void Tokenizer::parseSlash() {
-  auto next_char = consume();
-
-  if (next_char == '/') {
-    std::string comment;
-    while (!isEnd()) {
-      next_char = consume();
-      if (next_char == '\n') {
-        break;
-      }
-      comment += next_char;
-    }
-    addToken(Normal(TokenType::COMMENT, comment, current_lineno_));
+  if (nextMatch('/')) {
+    // Newline is left to be counted by scanToken.
+    auto start = current_;
+    current_ = findChar(code_, current_, '\n');
+    addToken(Normal(TokenType::COMMENT, code_.substr(start, current_ - start),
+                    current_lineno_));
   } else {
-    --current_;
     addToken(Multiplication(TokenType::SLASH, "/", current_lineno_));
   }
 }
 
 void Tokenizer::parseString() {
-  std::string data;
-  bool terminated = false;
-  while (!isEnd()) {
-    auto next_char = consume();
-    if (next_char == '"') {
-      terminated = true;
-      break;
-    }
-    data += next_char;
-  }
-  if (!terminated) {
+  auto start = current_;
+  auto end = findChar(code_, current_, '"');
+  if (end == code_.size()) {
+    current_ = end;
     return;
   }
-  addToken(Primary(TokenType::STRING, data, current_lineno_));
+  current_ = end + 1;
+  addToken(Primary(TokenType::STRING, code_.substr(start, end - start),
+                   current_lineno_));
 }
 
 void Tokenizer::parseNumber() {
-  std::string number;
-  number += code_[current_ - 1];
-  while (!isEnd()) {
-    auto next_char = consume();
-    if (!isDigit(next_char) && next_char != '.') {
-      --current_;
-      break;
-    }
-    number += next_char;
-  }
-  addToken(Primary(TokenType::NUMBER, number, current_lineno_));
-}
-
-bool Tokenizer::parseReservedWord(TokenType expected) {
-  auto token_length = reserved_words[expected].size() - 1;
-  auto proceed_counter = 0;
-  std::string actual_token;
-  actual_token += code_[current_ - 1];
-  while (token_length > 0 && !isEnd()) {
-    char next_char = consume();
-    actual_token += next_char;
-    --token_length;
-    ++proceed_counter;
-  }
-  if (actual_token != reserved_words[expected]) {
-    current_ -= proceed_counter;
-    return false;
-  } else {
-    addToken(Normal(expected, reserved_words[expected], current_lineno_));
-    return true;
+  auto start = current_ - 1;
+  while (!isEnd() && (isDigit(code_[current_]) || code_[current_] == '.')) {
+    ++current_;
   }
+  addToken(Primary(TokenType::NUMBER, code_.substr(start, current_ - start),
+                   current_lineno_));
 }
 
 void Tokenizer::parseIdentifier() {
-  std::string identifier;
-  identifier += code_[current_ - 1];
-  while (!isEnd()) {
-    auto next_char = consume();
-    if (!isAlpha(next_char) && !isDigit(next_char)) {
-      --current_;
-      break;
-    }
-    identifier += next_char;
+  auto start = current_ - 1;
+  current_ = skipClass(code_, current_, CharClass::Alpha | CharClass::Digit);
+  auto word = code_.substr(start, current_ - start);
+  if (const auto* keyword = findKeyword(word)) {
+    // Lexeme of keyword refers to the table, not to the source.
+    addToken(Normal(keyword->type_, keyword->word_, current_lineno_));
+    return;
   }
-
-  addToken(Normal(TokenType::IDENTIFIER, identifier, current_lineno_));
+  addToken(Normal(TokenType::IDENTIFIER, word, current_lineno_));
 }
-}  // namespace Startear
\ No newline at end of file
+}  // namespace Startear
@@ -31,10 +31,12 @@
 #include <optional>
 #include <queue>
 #include <string>
+#include <string_view>
 #include <type_traits>
-#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "arena.h"
 #include "startear_assert.h"
 
 namespace Startear {
@@ -77,118 +79,180 @@ enum TokenType {
   RETURN
 };
 
-static std::unordered_map<TokenType, std::string> reserved_words{
-    {TokenType::VAR, "let"},      {TokenType::FOR, "for"},
-    {TokenType::FUN, "fn"},       {TokenType::TRUE, "true"},
-    {TokenType::FALSE, "false"},  {TokenType::IF, "if"},
-    {TokenType::ELSE, "else"},    {TokenType::NIL, "nil"},
-    {TokenType::RETURN, "return"}};
-
 class Token {
  public:
-  Token(TokenType type, std::string lexeme, size_t lineno)
+  Token(TokenType type, std::string_view lexeme, size_t lineno)
       : type_(type), lexeme_(lexeme), lineno_(lineno) {}
 
-  TokenType type() { return type_; }
-  std::string lexeme() { return lexeme_; }
-  size_t lineno() { return lineno_; }
+  TokenType type() const { return type_; }
+  // View into the source of tokenizer. It is valid while the tokenizer which
+  // produced this token is alive.
+  // Tokens pulled from streaming tokenizer refer to interned copies instead,
+  // and comment tokens of them have empty lexeme.
+  std::string_view lexeme() const { return lexeme_; }
+  size_t lineno() const { return lineno_; }
 
  private:
   TokenType type_;
-  std::string lexeme_;
+  std::string_view lexeme_;
   size_t lineno_;
 };
 
 using TokenRef = std::reference_wrapper<Token>;
 
-using TokenPtr = std::unique_ptr<Token>;
+using TokenPtr = ArenaPtr<Token>;
 
 // ==, !=, ||, &&
 class Equality final : public Token {
  public:
-  Equality(TokenType type, std::string lexeme, size_t lineno)
+  Equality(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Equality(Token& token)
       : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using EqualityPtr = std::unique_ptr<Equality>;
+using EqualityPtr = ArenaPtr<Equality>;
 
 // <=, >=, <, >
 class Compare final : public Token {
  public:
-  Compare(TokenType type, std::string lexeme, size_t lineno)
+  Compare(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Compare(Token& token) : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using ComparePtr = std::unique_ptr<Compare>;
+using ComparePtr = ArenaPtr<Compare>;
 
 // +, -
 class Addition final : public Token {
  public:
-  Addition(TokenType type, std::string lexeme, size_t lineno)
+  Addition(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Addition(Token& token)
       : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using AdditionPtr = std::unique_ptr<Addition>;
+using AdditionPtr = ArenaPtr<Addition>;
 
 // *, /
 class Multiplication final : public Token {
  public:
-  Multiplication(TokenType type, std::string lexeme, size_t lineno)
+  Multiplication(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Multiplication(Token& token)
       : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using MultiplicationPtr = std::unique_ptr<Multiplication>;
+using MultiplicationPtr = ArenaPtr<Multiplication>;
 
 // !, -
 class Unary final : public Token {
  public:
-  Unary(TokenType type, std::string lexeme, size_t lineno)
+  Unary(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Unary(Token& token) : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using UnaryPtr = std::unique_ptr<Unary>;
+using UnaryPtr = ArenaPtr<Unary>;
 
 // true/false, nil, literals
 class Primary final : public Token {
  public:
-  Primary(TokenType type, std::string lexeme, size_t lineno)
+  Primary(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Primary(Token& token) : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using PrimaryPtr = std::unique_ptr<Primary>;
+using PrimaryPtr = ArenaPtr<Primary>;
 
 // Normal tokens.
 class Normal final : public Token {
  public:
-  Normal(TokenType type, std::string lexeme, size_t lineno)
+  Normal(TokenType type, std::string_view lexeme, size_t lineno)
       : Token(type, lexeme, lineno) {}
   Normal(Token& token) : Token(token.type(), token.lexeme(), token.lineno()) {}
 };
 
-using NormalPtr = std::unique_ptr<Normal>;
+using NormalPtr = ArenaPtr<Normal>;
+
+// Buffer of the script. It owns the string, or maps the file onto memory
+// without copy.
+class Source {
+ public:
+  explicit Source(std::string code)
+      : owned_(std::move(code)), code_(owned_) {}
+  ~Source();
+  Source(const Source&) = delete;
+  Source& operator=(const Source&) = delete;
+
+  // Returns nullptr if the file can't be mapped.
+  static std::unique_ptr<Source> map(const std::string& path);
+
+  std::string_view code() const { return code_; }
+
+ private:
+  Source() = default;
+
+  std::string owned_;
+  void* mapped_{nullptr};
+  size_t mapped_size_{0};
+  std::string_view code_;
+};
+
+// Input which is read by chunks of fixed size. Only the unconsumed tail of
+// the input is kept in buffer_.
+struct Stream {
+  Stream(std::istream& input, size_t chunk_size)
+      : input_(input), chunk_size_(chunk_size) {}
+
+  std::istream& input_;
+  size_t chunk_size_;
+  bool end_{false};
+  std::string buffer_;
+  // Lexemes of tokens, which outlive the chunks they are scanned from.
+  std::unordered_set<std::string> lexemes_;
+};
 
 class Tokenizer {
  public:
-  Tokenizer(std::string code) : code_(code) {}
+  Tokenizer(std::string code)
+      : source_(std::make_unique<Source>(std::move(code))),
+        code_(source_->code()) {}
+  Tokenizer(std::unique_ptr<Source> source)
+      : source_(std::move(source)), code_(source_->code()) {}
+  // Tokenize the file on memory map. Lexemes of tokens refer to the mapped
+  // region directly.
+  static std::optional<Tokenizer> fromFile(const std::string& path);
+  // Tokenize the input incrementally, so that the whole input is not on
+  // memory at once. Tokens spanning chunk boundaries are scanned after the
+  // following chunk is read.
+  static constexpr size_t default_chunk_size = 1 << 16;
+  Tokenizer(std::istream& input, size_t chunk_size = default_chunk_size)
+      : stream_(std::make_unique<Stream>(input, chunk_size)) {}
+
   std::vector<Token>& scanTokens();
+  // Whole source, e.g. the mapped file. It is not available in streaming
+  // mode, which keeps only the current chunk.
+  std::optional<std::string_view> source() const {
+    if (source_ == nullptr) {
+      return std::nullopt;
+    }
+    return source_->code();
+  }
+  // Returns the next token, or std::nullopt at the end of the input. This
+  // shouldn't be mixed with scanTokens.
+  std::optional<Token> next();
 
  private:
+  // Scans more tokens into tokens_, reading next chunk in streaming mode.
+  // Returns false if the input is exhausted.
+  bool scanMore();
   void scanToken();
-  void addToken(Token&& token) { tokens_.emplace_back(token); }
+  void addToken(Token&& token);
   void parseInequality(TokenType t);
   void parseSlash();
   void parseString();
   void parseNumber();
-  bool parseReservedWord(TokenType expected);
   void parseIdentifier();
   const char consume() {
     ++current_;
@@ -196,6 +260,9 @@ class Tokenizer {
   }
 
   bool nextMatch(char c) {
+    if (isEnd()) {
+      return false;
+    }
     ++current_;
     if (c == code_[current_ - 1]) {
       return true;
@@ -207,8 +274,14 @@ class Tokenizer {
   bool isEnd() { return current_ >= code_.size(); }
 
   std::vector<Token> tokens_;
+  // Index of the token which is returned by next().
+  size_t next_{0};
   size_t current_{0};
-  std::string code_;
+  // Source is placed on heap, so that lexemes remain valid even if the
+  // tokenizer is moved.
+  std::unique_ptr<Source> source_;
+  std::unique_ptr<Stream> stream_;
+  std::string_view code_;
   size_t current_lineno_{1};
 };
 
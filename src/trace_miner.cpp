@@ -0,0 +1,81 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "trace_miner.h"
+
+#include <algorithm>
+#include <map>
+
+namespace Startear {
+
+namespace {
+bool transfersControl(OPCode code) {
+  switch (code) {
+    case OPCode::OP_CALL:
+    case OPCode::OP_TAIL_CALL:
+    case OPCode::OP_RETURN:
+    case OPCode::OP_BRANCH:
+    case OPCode::OP_COMPARE_BRANCH:
+    case OPCode::OP_JUMP_IF_FALSE_OR_POP:
+    case OPCode::OP_JUMP_IF_TRUE_OR_POP:
+    case OPCode::OP_HALT:
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+std::vector<FusionCandidate> mineFusionCandidates(
+    const std::vector<OPCode>& trace, size_t max_length, size_t top_n) {
+  std::map<std::vector<OPCode>, size_t> counts;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    std::vector<OPCode> sequence{trace[i]};
+    for (size_t j = i + 1; j < trace.size() && sequence.size() < max_length;
+         ++j) {
+      if (transfersControl(sequence.back())) {
+        break;
+      }
+      sequence.emplace_back(trace[j]);
+      ++counts[sequence];
+    }
+  }
+
+  std::vector<FusionCandidate> candidates;
+  candidates.reserve(counts.size());
+  for (const auto& [sequence, count] : counts) {
+    candidates.emplace_back(FusionCandidate{sequence, count});
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const FusionCandidate& a, const FusionCandidate& b) {
+                     return a.savedDispatches() > b.savedDispatches();
+                   });
+  if (candidates.size() > top_n) {
+    candidates.resize(top_n);
+  }
+  return candidates;
+}
+
+}  // namespace Startear
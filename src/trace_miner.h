@@ -0,0 +1,55 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef STARTEAR_ALL_TRACE_MINER_H
+#define STARTEAR_ALL_TRACE_MINER_H
+
+#include <cstddef>
+#include <vector>
+
+#include "opcode.h"
+
+namespace Startear {
+
+// Sequence of opcodes which is a candidate to be fused into superinstruction.
+struct FusionCandidate {
+  std::vector<OPCode> sequence_;
+  // The number of times this sequence appeared in the trace.
+  size_t count_;
+
+  // The number of dispatches which superinstruction would save.
+  size_t savedDispatches() const { return count_ * (sequence_.size() - 1); }
+};
+
+// Count all of the sequences from 2 to max_length opcodes on the dynamic
+// instruction trace, and returns top_n of them ordered by saved dispatches.
+// Sequences which continue after control transfer are ignored, because they
+// can't be fused statically.
+std::vector<FusionCandidate> mineFusionCandidates(
+    const std::vector<OPCode>& trace, size_t max_length, size_t top_n);
+
+}  // namespace Startear
+
+#endif  // STARTEAR_ALL_TRACE_MINER_H
@@ -35,7 +35,12 @@
 
 namespace Startear {
 
-VMImpl::VMImpl(Program& program) : program_(program) {
+VMImpl::VMImpl(Program& program, size_t stack_size)
+    : program_(program), stack_(stack_size) {
+  if (!program_.linked()) {
+    std::cerr << "Program must be linked before execution" << std::endl;
+    NOT_REACHED;
+  }
   auto main_entry_info =
       program_.functionRegistry().findByName(startup_entry.data());
   if (!main_entry_info.has_value()) {
@@ -43,248 +48,431 @@ VMImpl::VMImpl(Program& program) : program_(program) {
     NOT_REACHED;
   }
   pc_ = main_entry_info->get().pc_;
-  pushFrame();  // Main Frame
+  pushFrame(main_entry_info->get());  // Main Frame
 }
 
+// Instructions are dispatched with computed goto (direct threading) if
+// STARTEAR_THREADED_DISPATCH is defined, otherwise with the portable switch.
+// Each handler must finish by DISPATCH() after updating program counter.
+#if defined(STARTEAR_VM_TRACE)
+#define TRACE()        \
+  if (trace_) {        \
+    trace_->emplace_back(static_cast<OPCode>(code[pc_])); \
+  }
+#else
+#define TRACE()
+#endif
+
+#if defined(STARTEAR_VM_COUNT)
+#define COUNT() ++executed_instructions_
+#else
+#define COUNT()
+#endif
+
+#if defined(STARTEAR_THREADED_DISPATCH)
+#define HANDLER(op) \
+  case OPCode::op:  \
+  L_##op
+#define DISPATCH()                     \
+  do {                                 \
+    TRACE();                           \
+    COUNT();                           \
+    goto* dispatch_table[code[pc_]];   \
+  } while (0)
+#else
+#define HANDLER(op) case OPCode::op
+#define DISPATCH() \
+  do {             \
+    TRACE();       \
+    COUNT();       \
+    goto dispatch; \
+  } while (0)
+#endif
+
+// Quickened handlers neither check the depth of operand stack, which has been
+// checked by the generic one, nor switch on the opcode again. If the guard
+// fails, the instruction is rewritten back and dispatched again.
+#define QUICKENED_HANDLER(op, result)                            \
+  HANDLER(op) : {                                                \
+    STARTEAR_ASSERT(operandStackSize() >= 2);                    \
+    const auto lhs = stack_[sp_ - 2].getDouble();                \
+    const auto rhs = stack_[sp_ - 1].getDouble();                \
+    if (!lhs || !rhs) {                                          \
+      dequicken(pc_, OPCode::op);                                \
+      DISPATCH();                                                \
+    }                                                            \
+    stack_[sp_ - 2] = Value(Value::Category::Literal, (result)); \
+    --sp_;                                                       \
+    /* Quickened instructions have no operands. */               \
+    pc_ += 1;                                                    \
+    DISPATCH();                                                  \
+  }
+
 void VMImpl::start() {
-  while (true) {
-    auto instr_entry = program_.fetchInst(pc_);
-    if (!instr_entry.has_value() || frame_.size() < 1) {
-      break;
-    }
+  const uint8_t* code = program_.codeData();
+  executed_instructions_ = 0;
+  if (mismatched_.size() != program_.codeSize()) {
+    mismatched_.assign(program_.codeSize(), false);
+  }
+#if defined(STARTEAR_JIT)
+  if (use_jit_ && !trace_ && !jit_) {
+    jit_ = std::make_unique<JIT>(program_);
+  }
+#endif
 
-    const auto& instr = instr_entry.value();
-    auto opcode = instr.get().opcode();
-    const auto& operand_ptrs = instr.get().operandsPointer();
+#if defined(STARTEAR_THREADED_DISPATCH)
+  void* dispatch_table[static_cast<size_t>(OPCode::OPCODE_SIZE)];
+  for (auto& label : dispatch_table) {
+    label = &&L_UNSUPPORTED;
+  }
+#define REGISTER_HANDLER(op) \
+  dispatch_table[static_cast<size_t>(OPCode::op)] = &&L_##op;
+  REGISTER_HANDLER(OP_PRINT);
+  REGISTER_HANDLER(OP_PUSH);
+  REGISTER_HANDLER(OP_ADD);
+  REGISTER_HANDLER(OP_SUB);
+  REGISTER_HANDLER(OP_MUL);
+  REGISTER_HANDLER(OP_DIV);
+  REGISTER_HANDLER(OP_STORE_SLOT);
+  REGISTER_HANDLER(OP_LOAD_SLOT);
+  REGISTER_HANDLER(OP_CALL);
+  REGISTER_HANDLER(OP_RETURN);
+  REGISTER_HANDLER(OP_EQUAL);
+  REGISTER_HANDLER(OP_BANG_EQUAL);
+  REGISTER_HANDLER(OP_LESS_EQUAL);
+  REGISTER_HANDLER(OP_GREATER_EQUAL);
+  REGISTER_HANDLER(OP_LESS);
+  REGISTER_HANDLER(OP_GREATER);
+  REGISTER_HANDLER(OP_AND);
+  REGISTER_HANDLER(OP_OR);
+  REGISTER_HANDLER(OP_BRANCH);
+  REGISTER_HANDLER(OP_JUMP_IF_FALSE_OR_POP);
+  REGISTER_HANDLER(OP_JUMP_IF_TRUE_OR_POP);
+  REGISTER_HANDLER(OP_ADD_SLOT_CONST);
+  REGISTER_HANDLER(OP_COMPARE_BRANCH);
+  REGISTER_HANDLER(OP_PUSH_STORE);
+  REGISTER_HANDLER(OP_ADD_DOUBLE);
+  REGISTER_HANDLER(OP_SUB_DOUBLE);
+  REGISTER_HANDLER(OP_MUL_DOUBLE);
+  REGISTER_HANDLER(OP_DIV_DOUBLE);
+  REGISTER_HANDLER(OP_EQUAL_DOUBLE);
+  REGISTER_HANDLER(OP_BANG_EQUAL_DOUBLE);
+  REGISTER_HANDLER(OP_LESS_EQUAL_DOUBLE);
+  REGISTER_HANDLER(OP_GREATER_EQUAL_DOUBLE);
+  REGISTER_HANDLER(OP_LESS_DOUBLE);
+  REGISTER_HANDLER(OP_GREATER_DOUBLE);
+  REGISTER_HANDLER(OP_TAIL_CALL);
+  REGISTER_HANDLER(OP_HALT);
+#undef REGISTER_HANDLER
+#endif
 
-    switch (opcode) {
-      case OPCode::OP_PRINT: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        auto data_entry = program_.fetchValue(operand_ptrs[0]);
-        if (!data_entry || data_entry->category() != Value::Category::Literal) {
-          NOT_REACHED;
-        }
-        print(*data_entry);
-        incPc();
-        break;
+  DISPATCH();
+#if !defined(STARTEAR_THREADED_DISPATCH)
+dispatch:
+#endif
+  switch (static_cast<OPCode>(code[pc_])) {
+    HANDLER(OP_PRINT) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      auto data_entry = program_.fetchValue(instr.operand(0));
+      if (!data_entry || data_entry->category() != Value::Category::Literal) {
+        NOT_REACHED;
       }
-      case OPCode::OP_PUSH: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        auto data_entry = program_.fetchValue(operand_ptrs[0]);
-        if (!data_entry || data_entry->category() != Value::Category::Literal) {
-          TERMINATE_VM;
-        }
-        pushStack(*data_entry);
-        incPc();
-        break;
+      print(*data_entry);
+      pc_ = pc_ + instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_PUSH) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      auto data_entry = program_.fetchValue(instr.operand(0));
+      if (!data_entry || data_entry->category() != Value::Category::Literal) {
+        TERMINATE_VM;
       }
-      case OPCode::OP_SUB:
-      case OPCode::OP_DIV:
-      case OPCode::OP_MUL:
-      case OPCode::OP_ADD: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 0);
-        if (frame_.top().stack_.size() < 2) {
-          TERMINATE_VM;
-        }
-        auto lhs = popStack();
-        auto rhs = popStack();
-        if (!lhs.getDouble() || !rhs.getDouble()) {
-          TERMINATE_VM;
-        }
-        auto result = calc(opcode, *lhs.getDouble(), *rhs.getDouble());
-        Value v(Value::Category::Literal, result);
-        pushStack(v);
-        incPc();
-        break;
+      pushStack(*data_entry);
+      pc_ = pc_ + instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_SUB) :
+    HANDLER(OP_DIV) :
+    HANDLER(OP_MUL) :
+    HANDLER(OP_ADD) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 0);
+      if (operandStackSize() < 2) {
+        TERMINATE_VM;
       }
-      case OPCode::OP_STORE_LOCAL: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        Value stack_top = popStack();
-        auto variable_name_entry = program_.fetchValue(operand_ptrs[0]);
-        if (!variable_name_entry || !variable_name_entry->getString()) {
-          TERMINATE_VM;
-        }
-        auto variable_name = *variable_name_entry->getString();
-        saveLocalVariableTable(variable_name, stack_top);
-        incPc();
-        break;
+      auto rhs = popStack();
+      auto lhs = popStack();
+      if (!lhs.getDouble() || !rhs.getDouble()) {
+        TERMINATE_VM;
       }
-      case OPCode::OP_LOAD_LOCAL: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        auto value_entry = lookupLocalVariableTable(operand_ptrs[0]);
-        if (!value_entry) {
-          TERMINATE_VM;
-        }
-        pushStack(*value_entry);
-        incPc();
-        break;
+      auto result = calc(instr.opcode(), *lhs.getDouble(),
+                         *rhs.getDouble());
+      quicken(pc_, instr.opcode());
+      Value v(Value::Category::Literal, result);
+      pushStack(v);
+      pc_ = pc_ + instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_STORE_SLOT) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      STARTEAR_ASSERT(instr.operand(0) < peekFunction().locals_.size());
+      auto v = popStack();
+      stack_[frame_.back().base_ + instr.operand(0)] = v;
+      pc_ = pc_ + instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_LOAD_SLOT) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      STARTEAR_ASSERT(instr.operand(0) < peekFunction().locals_.size());
+      pushStack(stack_[frame_.back().base_ + instr.operand(0)]);
+      pc_ = pc_ + instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_RETURN) : {
+      const Instruction instr(code + pc_);
+      // Returning from the entry function terminates the program. Its frame
+      // is remained to analyse the state of VM.
+      if (frame_.size() == 1) {
+        state_ = VMState::SuccessfulTerminated;
+        return;
       }
-      case OPCode::OP_RETURN: {
-        auto return_pc = frame_.top().return_pc_;
-        pc_ = return_pc;
-        // Call if the function has no instructions.
-        if (frame_.top().stack_.size() == 0) {
-          popFrame();
-          break;
-        }
-        auto return_value = popStack();
+      // Call if the function has no instructions.
+      if (operandStackSize() == 0) {
         popFrame();
-        pushStack(return_value);
-        break;
+        DISPATCH();
       }
-      case OPCode::OP_BANG_EQUAL:
-      case OPCode::OP_GREATER_EQUAL:
-      case OPCode::OP_LESS_EQUAL:
-      case OPCode::OP_LESS:
-      case OPCode::OP_GREATER:
-      case OPCode::OP_AND:
-      case OPCode::OP_OR:
-      case OPCode::OP_EQUAL: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 0);
-        if (frame_.top().stack_.size() < 2) {
-          TERMINATE_VM;
-        }
-        auto lhs = popStack();
-        auto rhs = popStack();
-        if (!lhs.getDouble() || !rhs.getDouble()) {
-          TERMINATE_VM;
-        }
-        if (opcode == OPCode::OP_OR || opcode == OPCode::OP_AND) {
-          if (*lhs.getDouble() != 0 && *lhs.getDouble() != 1) {
-            TERMINATE_VM;
-          }
-          if (*rhs.getDouble() != 0 && *rhs.getDouble() != 1) {
-            TERMINATE_VM;
-          }
-        }
-        bool result = cmp(opcode, *lhs.getDouble(), *rhs.getDouble());
-        pushStack(Value(Value::Category::Literal, static_cast<double>(result)));
-        incPc();
-        break;
+      auto return_value = popStack();
+      popFrame();
+      pushStack(return_value);
+      DISPATCH();
+    }
+    HANDLER(OP_BANG_EQUAL) :
+    HANDLER(OP_GREATER_EQUAL) :
+    HANDLER(OP_LESS_EQUAL) :
+    HANDLER(OP_LESS) :
+    HANDLER(OP_GREATER) :
+    HANDLER(OP_AND) :
+    HANDLER(OP_OR) :
+    HANDLER(OP_EQUAL) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 0);
+      const auto op = instr.opcode();
+      if (operandStackSize() < 2) {
+        TERMINATE_VM;
+      }
+      auto rhs = popStack();
+      auto lhs = popStack();
+      if (!lhs.getDouble() || !rhs.getDouble()) {
+        TERMINATE_VM;
       }
-      case OPCode::OP_BRANCH: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 2);
-        bool cmp = static_cast<bool>(*popStack().getDouble());
-        auto label_entry = program_.fetchValue(cmp ? operand_ptrs[0] : operand_ptrs[1]);
-        if (!label_entry.has_value() || !label_entry->getString()) {
+      if (op == OPCode::OP_OR || op == OPCode::OP_AND) {
+        if (*lhs.getDouble() != 0 && *lhs.getDouble() != 1) {
           TERMINATE_VM;
         }
-        auto metadata_entry =
-            program_.functionRegistry().findByName(*label_entry->getString());
-        if (!metadata_entry) {
-          std::cerr << fmt::format("Failed to find label entry on {}",
-                                   *label_entry->getString())
-                    << std::endl;
+        if (*rhs.getDouble() != 0 && *rhs.getDouble() != 1) {
           TERMINATE_VM;
         }
-        auto pc = metadata_entry->get().pc_;
-        if (pc < 0 || pc >= program_.instructions().size()) {
-          state_ = VMState::SuccessfulTerminated;
-          return;
-        }
-        pc_ = pc;
-        break;
       }
-      case OPCode::OP_CALL: {
-        STARTEAR_ASSERT(operand_ptrs.size() == 1);
-        auto func_label_entry = program_.fetchValue(operand_ptrs[0]);
-        if (!func_label_entry) {
-          TERMINATE_VM;
-        }
-        STARTEAR_ASSERT(func_label_entry->category() ==
-                        Value::Category::Variable);
-        STARTEAR_ASSERT(func_label_entry->getString());
-        // TODO: This information should be known when code analysis phase
-        auto func_entry = program_.functionRegistry().findByName(
-            *func_label_entry->getString());
-        if (!func_entry.has_value()) {
-          std::cerr << fmt::format("{} is not defined",
-                                   *func_label_entry->getString())
-                    << std::endl;
-          TERMINATE_VM;
+      bool result = cmp(op, *lhs.getDouble(), *rhs.getDouble());
+      quicken(pc_, op);
+      pushStack(Value(Value::Category::Literal, static_cast<double>(result)));
+      pc_ = pc_ + instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_BRANCH) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 2);
+      bool cmp = static_cast<bool>(*popStack().getDouble());
+      pc_ = cmp ? instr.operand(0) : instr.operand(1);
+      DISPATCH();
+    }
+    HANDLER(OP_JUMP_IF_FALSE_OR_POP) :
+    HANDLER(OP_JUMP_IF_TRUE_OR_POP) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      if (operandStackSize() < 1) {
+        TERMINATE_VM;
+      }
+      auto lhs = getStackTop().getDouble();
+      if (!lhs || (*lhs != 0 && *lhs != 1)) {
+        TERMINATE_VM;
+      }
+      // Left operand which decides the result is remained as the result.
+      if ((*lhs == 1) == (instr.opcode() == OPCode::OP_JUMP_IF_TRUE_OR_POP)) {
+        pc_ = instr.operand(0);
+        DISPATCH();
+      }
+      --sp_;
+      pc_ += instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_TAIL_CALL) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      const auto& function =
+          program_.functionRegistry().findById(instr.operand(0));
+      if (operandStackSize() < function.arity_) {
+        TERMINATE_VM;
+      }
+      // The entry frame is remained to analyse the state of VM, and native
+      // code doesn't build interpreter frames. They are called as usual.
+      bool native = false;
+#if defined(STARTEAR_JIT)
+      native = jit_ && use_jit_ && !trace_ && jit_->entry(function.id_);
+#endif
+      if (frame_.size() > 1 && !native) {
+        if (call_counts_) {
+          ++(*call_counts_)[function.id_];
         }
-
-        Frame next_frame;
-        next_frame.return_pc_ = pc_ + 1;
-
-        // Extract stack value from current frame to next one.
-        for (int32_t /* not to be inferenced as unsigned integer */ i =
-                 func_entry->get().args_.size() - 1;
-             i >= 0; --i) {
-          auto current_stack_top = popStack();
-          next_frame.stack_.push(current_stack_top);
-          auto arg_name_entry = program_.fetchValue(func_entry->get().args_[i]);
-          if (!arg_name_entry.has_value()) {
-            std::cerr << "The variable name of argument is not registered on "
-                         "program data region"
-                      << std::endl;
-            TERMINATE_VM;
-          }
-          if (!arg_name_entry->getString().has_value()) {
-            TERMINATE_VM;
+        reuseFrame(function);
+        pc_ = function.pc_;
+        DISPATCH();
+      }
+    }
+    [[fallthrough]];
+    HANDLER(OP_CALL) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 1);
+      const auto& function =
+          program_.functionRegistry().findById(instr.operand(0));
+      if (operandStackSize() < function.arity_) {
+        TERMINATE_VM;
+      }
+      if (call_counts_) {
+        ++(*call_counts_)[function.id_];
+      }
+#if defined(STARTEAR_JIT)
+      if (jit_ && use_jit_ && !trace_) {
+        if (auto entry = jit_->entry(function.id_)) {
+          // Native code builds the frame of callee on the same place, and
+          // returns with the arguments consumed.
+          const auto base = sp_ - function.arity_;
+          auto result = entry(stack_.data() + base,
+                              stack_.data() + stack_.size());
+          sp_ = base;
+          if (jit_->returnsValue(function.id_)) {
+            pushStack(result);
           }
-          next_frame.lv_table_.emplace(*arg_name_entry->getString(),
-                                       current_stack_top);
+          pc_ += instr.length();
+          DISPATCH();
         }
-
-        pc_ = func_entry->get().pc_;
-        frame_.emplace(next_frame);
-        break;
       }
-      default:
-        std::cerr << fmt::format("{} is unsupported instruction",
-                                 opcodeToString(opcode))
-                  << std::endl;
+#endif
+      // Arguments on the top of stack become the first slots of callee frame
+      // without any copy.
+      pushFrame(function, pc_ + instr.length());
+      pc_ = function.pc_;
+      DISPATCH();
+    }
+    HANDLER(OP_ADD_SLOT_CONST) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 2);
+      STARTEAR_ASSERT(instr.operand(0) < peekFunction().locals_.size());
+      auto lhs = stack_[frame_.back().base_ + instr.operand(0)];
+      auto rhs = program_.fetchValue(instr.operand(1));
+      if (!rhs || !lhs.getDouble() || !rhs->getDouble()) {
+        TERMINATE_VM;
+      }
+      pushStack(Value(Value::Category::Literal,
+                      *lhs.getDouble() + *rhs->getDouble()));
+      pc_ += instr.length();
+      DISPATCH();
+    }
+    HANDLER(OP_COMPARE_BRANCH) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 3);
+      if (operandStackSize() < 2) {
+        TERMINATE_VM;
+      }
+      auto rhs = popStack();
+      auto lhs = popStack();
+      if (!lhs.getDouble() || !rhs.getDouble()) {
+        TERMINATE_VM;
+      }
+      bool result = cmp(static_cast<OPCode>(instr.operand(0)),
+                        *lhs.getDouble(), *rhs.getDouble());
+      pc_ = result ? instr.operand(1) : instr.operand(2);
+      DISPATCH();
+    }
+    HANDLER(OP_PUSH_STORE) : {
+      const Instruction instr(code + pc_);
+      STARTEAR_ASSERT(instr.operandSize() == 2);
+      STARTEAR_ASSERT(instr.operand(1) < peekFunction().locals_.size());
+      auto data_entry = program_.fetchValue(instr.operand(0));
+      if (!data_entry || data_entry->category() != Value::Category::Literal) {
         TERMINATE_VM;
+      }
+      stack_[frame_.back().base_ + instr.operand(1)] = *data_entry;
+      pc_ += instr.length();
+      DISPATCH();
     }
+    QUICKENED_HANDLER(OP_ADD_DOUBLE, *lhs + *rhs)
+    QUICKENED_HANDLER(OP_SUB_DOUBLE, *lhs - *rhs)
+    QUICKENED_HANDLER(OP_MUL_DOUBLE, *lhs * *rhs)
+    QUICKENED_HANDLER(OP_DIV_DOUBLE, *lhs / *rhs)
+    QUICKENED_HANDLER(OP_EQUAL_DOUBLE, static_cast<double>(*lhs == *rhs))
+    QUICKENED_HANDLER(OP_BANG_EQUAL_DOUBLE, static_cast<double>(*lhs != *rhs))
+    QUICKENED_HANDLER(OP_LESS_EQUAL_DOUBLE, static_cast<double>(*lhs <= *rhs))
+    QUICKENED_HANDLER(OP_GREATER_EQUAL_DOUBLE,
+                      static_cast<double>(*lhs >= *rhs))
+    QUICKENED_HANDLER(OP_LESS_DOUBLE, static_cast<double>(*lhs < *rhs))
+    QUICKENED_HANDLER(OP_GREATER_DOUBLE, static_cast<double>(*lhs > *rhs))
+    HANDLER(OP_HALT) : {
+      const Instruction instr(code + pc_);
+      /**
+       * TODO: We should pop main frame when execution is finished.
+       * In this implementation, we remain it to analyse frame state on test.
+       * Add hooking strategy to check them at test time.
+       */
+      state_ = VMState::SuccessfulTerminated;
+      return;
+    }
+    default:
+#if defined(STARTEAR_THREADED_DISPATCH)
+    L_UNSUPPORTED:
+#endif
+      std::cerr << fmt::format("{} is unsupported instruction",
+                               opcodeToString(static_cast<OPCode>(code[pc_])))
+                << std::endl;
+      TERMINATE_VM;
   }
+}
+
+#undef QUICKENED_HANDLER
+#undef HANDLER
+#undef DISPATCH
+#undef COUNT
+#undef TRACE
 
-  /**
-   * TODO: We should pop main frame when execution is finished.
-   * In this implementation, we remain it to analyse frame state on test.
-   * Add hooking strategy to check them at test time.
-   */
-  state_ = VMState::SuccessfulTerminated;
+bool VMImpl::countsInstructions() {
+#if defined(STARTEAR_VM_COUNT)
+  return true;
+#else
+  return false;
+#endif
 }
 
 void VMImpl::restart(Program& program) {
   STARTEAR_ASSERT(state_ == VMState::SuccessfulTerminated ||
                   state_ == VMState::TerminatedWithError);
   program_ = program;
+  jit_.reset();
+  mismatched_.clear();
   state_ = VMState::Initialized;
   start();
 }
 
-std::optional<Value> VMImpl::lookupLocalVariableTable(size_t ptr) {
-  auto variable_name_entry = program_.fetchValue(ptr);
-  if (!variable_name_entry) {
+std::optional<Value> VMImpl::peekLocalVariable(std::string_view name) {
+  STARTEAR_ASSERT(frame_.size() > 0);
+  auto slot = peekFunction().findSlot(name);
+  if (!slot.has_value()) {
     return std::nullopt;
   }
-  STARTEAR_ASSERT(variable_name_entry->category() == Value::Category::Variable);
-  if (variable_name_entry->getString()) {
-    return lookupLocalVariableTable(*variable_name_entry->getString());
-  }
-  return std::nullopt;
-}
-
-std::optional<Value> VMImpl::lookupLocalVariableTable(
-    std::string variable_name) {
-  auto variable_itr = frame_.top().lv_table_.find(variable_name);
-  if (variable_itr == frame_.top().lv_table_.end()) {
-    return std::nullopt;
-  }
-  auto literal = variable_itr->second;
-  STARTEAR_ASSERT(literal.category() == Value::Category::Literal);
-  return literal;
-}
-
-void VMImpl::saveLocalVariableTable(std::string name, Value& v) {
-  auto entry = frame_.top().lv_table_.find(name);
-  if (entry != frame_.top().lv_table_.end()) {
-    entry->second = v;
-  } else {
-    frame_.top().lv_table_.emplace(name, v);
-  }
+  return stack_[frame_.back().base_ + *slot];
 }
 
 void VMImpl::print(Value& v) {
@@ -297,6 +485,13 @@ void VMImpl::print(Value& v) {
       if (!v.getDouble()) NOT_REACHED;
       std::cout << v.getDouble().value() << std::endl;
       break;
+    case Value::SupportedTypes::Boolean:
+      if (!v.getBoolean()) NOT_REACHED;
+      std::cout << (v.getBoolean().value() ? "true" : "false") << std::endl;
+      break;
+    case Value::SupportedTypes::None:
+      std::cout << "nil" << std::endl;
+      break;
     default:
       TERMINATE_VM;
   }
@@ -322,13 +517,13 @@ bool VMImpl::cmp(OPCode code, double lhs, double rhs) {
     case OPCode::OP_BANG_EQUAL:
       return lhs != rhs;
     case OPCode::OP_GREATER_EQUAL:
-      return lhs <= rhs;
-    case OPCode::OP_LESS_EQUAL:
       return lhs >= rhs;
+    case OPCode::OP_LESS_EQUAL:
+      return lhs <= rhs;
     case OPCode::OP_LESS:
-      return lhs > rhs;
-    case OPCode::OP_GREATER:
       return lhs < rhs;
+    case OPCode::OP_GREATER:
+      return lhs > rhs;
     case OPCode::OP_EQUAL:
       return lhs == rhs;
     case OPCode::OP_OR:
@@ -26,9 +26,12 @@
 #ifndef STARTEAR_ALL_VM_IMPL_H
 #define STARTEAR_ALL_VM_IMPL_H
 
-#include <stack>
+#include <algorithm>
+#include <memory>
 #include <string_view>
+#include <vector>
 
+#include "jit.h"
 #include "opcode.h"
 #include "vm.h"
 
@@ -39,74 +42,155 @@ static constexpr std::string_view startup_entry = "main";
 
 class VMImpl : public VM {
  public:
-  VMImpl(Program& program);
+  // The number of values which single VM can hold on its stack, including
+  // local variables of all frames.
+  static constexpr size_t default_stack_size = 1 << 16;
+
+  VMImpl(Program& program, size_t stack_size = default_stack_size);
 
   // VM
-  void incPc() override { ++pc_; }
+  void incPc() override {
+    STARTEAR_ASSERT(pc_ < program_.codeSize());
+    pc_ += Instruction(program_.codeData() + pc_).length();
+  }
 
   void pushStack(Value v) override {
     STARTEAR_ASSERT(frame_.size() != 0);
-    frame_.top().stack_.push(v);
+    if (sp_ >= stack_.size()) {
+      std::cerr << "Stack overflow" << std::endl;
+      state_ = VMState::TerminatedWithError;
+      NOT_REACHED;
+    }
+    stack_[sp_++] = v;
   }
 
   Value getStackTop() {
-    STARTEAR_ASSERT(frame_.size() != 0);
-    return frame_.top().stack_.top();
+    STARTEAR_ASSERT(operandStackSize() != 0);
+    return stack_[sp_ - 1];
   }
 
   Value popStack() override {
     STARTEAR_ASSERT(frame_.size() != 0);
-    STARTEAR_ASSERT(frame_.top().stack_.size() != 0);
-    auto top = frame_.top().stack_.top();
-    frame_.top().stack_.pop();
-    return top;
+    STARTEAR_ASSERT(operandStackSize() != 0);
+    return stack_[--sp_];
   }
 
   // It determines the scope of program.
   // We assume that this is used as stack way.
+  //
+  // All of frames share single value stack of VM. Each frame owns the region
+  // which starts from base_, where local variables are placed first, and
+  // operands follow them.
+  //
+  // |  ...  | arg0 | arg1 | local0 | operand0 | operand1 |  ...
+  //         ^ base_                           ^ top of stack
   struct Frame {
-    std::stack<Value> stack_;  // Execution stack
-    /**
-     * It might be not efficient approach to save local variable with the pair
-     * of variable name and entity. Is there a critical approach to improve
-     * memory efficiency?
-     */
-    std::unordered_map<std::string, Value> lv_table_;  // Local variable table
+    size_t base_{0};
     // Program counter which is used to point out the place of memory.
     size_t return_pc_{0};
+    size_t function_id_{0};
   };
 
-  void pushFrame(size_t return_pc) {
+  void pushFrame(const Program::FunctionMetadata& function, size_t return_pc) {
+    // Arguments have been pushed by caller. They are used as the first slots
+    // in place.
+    STARTEAR_ASSERT(frame_.empty() ? sp_ >= function.arity_
+                                   : operandStackSize() >= function.arity_);
     Frame f;
+    f.base_ = sp_ - function.arity_;
     f.return_pc_ = return_pc;
-    frame_.push(f);
+    f.function_id_ = function.id_;
+    if (f.base_ + function.locals_.size() > stack_.size()) {
+      std::cerr << "Stack overflow" << std::endl;
+      state_ = VMState::TerminatedWithError;
+      NOT_REACHED;
+    }
+    for (sp_ = f.base_ + function.arity_;
+         sp_ < f.base_ + function.locals_.size(); ++sp_) {
+      stack_[sp_] = Value();
+    }
+    frame_.emplace_back(f);
   }
 
-  void pushFrame() {
+  void pushFrame(const Program::FunctionMetadata& function) {
     // Only to call at once.
     if (frame_.size() != 0) {
       state_ = VMState::TerminatedWithError;
       std::cerr << "Only to call push frame at once without return value";
       NOT_REACHED;
     }
-    Frame f;
-    frame_.push(f);
+    pushFrame(function, 0);
   }
 
   void popFrame() {
-    auto return_pc = frame_.top().return_pc_;
-    pc_ = return_pc;
-    frame_.pop();
+    auto& frame = frame_.back();
+    pc_ = frame.return_pc_;
+    sp_ = frame.base_;
+    frame_.pop_back();
+  }
+
+  // Replace the top frame with the frame of callee in tail position. The
+  // arguments on the top of stack are moved to the base of frame, and callee
+  // returns to where caller would have returned.
+  void reuseFrame(const Program::FunctionMetadata& function) {
+    STARTEAR_ASSERT(operandStackSize() >= function.arity_);
+    auto& frame = frame_.back();
+    std::copy(stack_.begin() + (sp_ - function.arity_), stack_.begin() + sp_,
+              stack_.begin() + frame.base_);
+    frame.function_id_ = function.id_;
+    if (frame.base_ + function.locals_.size() > stack_.size()) {
+      std::cerr << "Stack overflow" << std::endl;
+      state_ = VMState::TerminatedWithError;
+      NOT_REACHED;
+    }
+    for (sp_ = frame.base_ + function.arity_;
+         sp_ < frame.base_ + function.locals_.size(); ++sp_) {
+      stack_[sp_] = Value();
+    }
   }
 
   const Frame& peekFrame() {
     STARTEAR_ASSERT(frame_.size() > 0);
-    return frame_.top();
+    return frame_.back();
   }
 
+  // Returns the metadata of the function which top frame is executing.
+  const Program::FunctionMetadata& peekFunction() {
+    return program_.functionRegistry().findById(peekFrame().function_id_);
+  }
+
+  // Look up local variable of current frame by its name. This is slow, and
+  // only for debugging or testing.
+  std::optional<Value> peekLocalVariable(std::string_view name);
+
   void start();
   void restart(Program& program);
 
+  // Record the opcode of each dispatched instruction into trace. It takes
+  // effect only if VM is built with STARTEAR_VM_TRACE.
+  void recordTrace(std::vector<OPCode>* trace) { trace_ = trace; }
+
+  // Count calls of each function into counts, which is indexed by function
+  // id. It is the profile for InlineOptions. Calls from native code are not
+  // counted.
+  void recordCallCounts(std::vector<uint64_t>* counts) {
+    if (counts != nullptr) {
+      counts->resize(program_.functionRegistry().size(), 0);
+    }
+    call_counts_ = counts;
+  }
+
+  // The number of instructions which are dispatched by the last start().
+  // Instructions in native code are not counted. It is counted only if VM is
+  // built with STARTEAR_VM_COUNT, otherwise 0.
+  uint64_t executedInstructions() const { return executed_instructions_; }
+  static bool countsInstructions();
+
+  // Run compiled functions as native code. It is enabled by default and takes
+  // effect only if VM is built with STARTEAR_JIT. It is ignored while trace is
+  // recorded.
+  void useJIT(bool enabled) { use_jit_ = enabled; }
+
  private:
   enum VMState {
     // Default state. Program has set already,
@@ -118,17 +202,45 @@ class VMImpl : public VM {
     TerminatedWithError,
   };
 
-  std::optional<Value> lookupLocalVariableTable(size_t ptr);
-  std::optional<Value> lookupLocalVariableTable(std::string variable_name);
-  void saveLocalVariableTable(std::string name, Value& v);
+  // The number of values on the operand stack of top frame.
+  size_t operandStackSize() {
+    return sp_ - frame_.back().base_ - peekFunction().locals_.size();
+  }
+
+  // Rewrite generic instruction into quickened one, which has been observed
+  // to take doubles. Instructions whose guard has failed are left generic.
+  void quicken(size_t pc, OPCode generic) {
+    if (program_.mapped() || mismatched_[pc]) {
+      return;
+    }
+    if (auto quickened = quickenedOpcode(generic)) {
+      program_.rewriteOpcode(pc, *quickened);
+    }
+  }
+  void dequicken(size_t pc, OPCode quickened) {
+    mismatched_[pc] = true;
+    program_.rewriteOpcode(pc, genericOpcode(quickened));
+  }
+
   void print(Value& v);
   double calc(OPCode code, double lhs, double rhs);
   bool cmp(OPCode code, double lhs, double rhs);
 
   size_t pc_{0};      // Program counter
   Program& program_;  // All of codes which will be executed
-  std::stack<Frame> frame_;
+  std::vector<Value> stack_;
+  size_t sp_{0};  // Index of the next free entry of stack_
+  std::vector<Frame> frame_;
   VMState state_{VMState::Initialized};
+  std::vector<OPCode>* trace_{nullptr};
+  std::vector<uint64_t>* call_counts_{nullptr};
+  uint64_t executed_instructions_{0};
+  // Type feedback by program counter. Set if the quickened instruction has
+  // observed operands other than doubles.
+  std::vector<bool> mismatched_;
+  bool use_jit_{true};
+  // Functions are compiled on the first start().
+  std::unique_ptr<JIT> jit_;
 };
 }  // namespace Startear
 
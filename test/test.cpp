@@ -23,13 +23,24 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
 #include "ast.h"
+#include "bytecode_file.h"
+#include "compiler.h"
 #include "disassembler.h"
 #include "gtest/gtest.h"
+#include "jit.h"
 #include "parser.h"
 #include "program.h"
+#include "register_vm.h"
 #include "startear_assert.h"
 #include "tokenizer.h"
+#include "trace_miner.h"
 #include "vm_impl.h"
 
 namespace Startear {
@@ -110,6 +121,27 @@ TEST(Basic, BasicTests) {
   EXPECT_EQ(TokenType::IDENTIFIER, result[1].type());
 }
 
+TEST(Basic, MappedSource) {
+  auto path = testing::TempDir() + "startear_mapped_source.st";
+  {
+    std::ofstream ofs(path);
+    ofs << "let value = 12; // note";
+  }
+  auto tokenizer = Tokenizer::fromFile(path);
+  ASSERT_TRUE(tokenizer.has_value());
+  const auto& result = tokenizer->scanTokens();
+  ASSERT_EQ(result.size(), 6);
+  EXPECT_EQ(TokenType::VAR, result[0].type());
+  EXPECT_EQ("value", result[1].lexeme());
+  EXPECT_EQ("12", result[3].lexeme());
+  EXPECT_EQ(" note", result[5].lexeme());
+  // Lexemes are views into the same mapped region.
+  EXPECT_EQ(result[3].lexeme().data() - result[1].lexeme().data(), 8);
+  std::remove(path.c_str());
+
+  EXPECT_FALSE(Tokenizer::fromFile(path).has_value());
+}
+
 TEST_F(TokenizerTest, ForTest) {
   Startear::Tokenizer tokenizer("for (let i = 0.0000; i < 65535; i++) {}");
   result_ = tokenizer.scanTokens();
@@ -133,6 +165,62 @@ TEST_F(TokenizerTest, ForTest) {
   reset();
 }
 
+TEST_F(TokenizerTest, KeywordPrefix) {
+  Startear::Tokenizer tokenizer(
+      "format letter iffy fnord returned true nil else false");
+  result_ = tokenizer.scanTokens();
+  checkToken(TokenType::IDENTIFIER, "format");
+  checkToken(TokenType::IDENTIFIER, "letter");
+  checkToken(TokenType::IDENTIFIER, "iffy");
+  checkToken(TokenType::IDENTIFIER, "fnord");
+  checkToken(TokenType::IDENTIFIER, "returned");
+  checkToken(TokenType::TRUE);
+  checkToken(TokenType::NIL);
+  checkToken(TokenType::ELSE);
+  checkToken(TokenType::FALSE);
+}
+
+TEST_F(TokenizerTest, LongRuns) {
+  // Runs longer than a SIMD block are scanned across several blocks.
+  std::string identifier(70, 'a');
+  identifier += "_B9";
+  std::string blank(40, ' ');
+  Startear::Tokenizer tokenizer(blank + identifier + "\t\r" + blank + "let" +
+                                blank + "\"" + std::string(50, 's') + "\"" +
+                                "// " + std::string(50, 'c') + "\n1");
+  result_ = tokenizer.scanTokens();
+  checkToken(TokenType::IDENTIFIER, identifier);
+  checkToken(TokenType::VAR);
+  checkToken(TokenType::STRING, std::string(50, 's'));
+  checkToken(TokenType::COMMENT, " " + std::string(50, 'c'));
+  checkToken(TokenType::NUMBER, "1");
+  EXPECT_EQ(result_.back().lineno(), 2);
+}
+
+TEST(Basic, StreamingTokenizer) {
+  std::string code =
+      "fn main() {\n  // comment spans chunks\n  let value_name = 12.5;\n"
+      "  if (value_name >= 3) { print(\"long string literal\"); }\n}\n";
+  Tokenizer whole(code);
+  const auto& expected = whole.scanTokens();
+  // Small chunks split most of tokens across chunk boundaries.
+  for (size_t chunk_size : {1, 2, 3, 7, 64}) {
+    std::istringstream input(code);
+    Tokenizer stream(input, chunk_size);
+    size_t i = 0;
+    while (auto token = stream.next()) {
+      ASSERT_LT(i, expected.size());
+      EXPECT_EQ(expected[i].type(), token->type());
+      if (token->type() != TokenType::COMMENT) {
+        EXPECT_EQ(expected[i].lexeme(), token->lexeme());
+      }
+      EXPECT_EQ(expected[i].lineno(), token->lineno());
+      ++i;
+    }
+    EXPECT_EQ(expected.size(), i);
+  }
+}
+
 TEST_F(TokenizerTest, IfTest) {
   Startear::Tokenizer tokenizer("if (args == 0) {}");
   result_ = tokenizer.scanTokens();
@@ -211,6 +299,16 @@ TEST_F(ParserTest, BasicTest) {
   run("2 == 2 || 2 == 3", "(|| (== 2 2) (== 2 3))\n");
 }
 
+TEST_F(ParserTest, Precedence) {
+  run("1 - 2 - 3", "(- (- 1 2) 3)\n");
+  run("1 + 2 * 3 - 4 / 5", "(- (+ 1 (* 2 3)) (/ 4 5))\n");
+  run("1 + 2 < 3 * 4 == 0", "(== (< (+ 1 2) (* 3 4)) 0)\n");
+  run("1 < 2 && 2 < 3 && 3 < 4",
+      "(&& (< 1 2) (&& (< 2 3) (< 3 4)))\n");
+  run("0 == 1 || 1 == 1 && 2 == 2 || 1",
+      "(|| (== 0 1) (|| (&& (== 1 1) (== 2 2)) 1))\n");
+}
+
 TEST_F(ParserTest, FuncTest) {
   std::string code = R"(
 fn main(arg1, arg2) {
@@ -230,15 +328,58 @@ main2 (arg) ->
   run(code, expected);
 }
 
+TEST(ValueTest, NaNBoxing) {
+  Value d(Value::Category::Literal, 3.5);
+  EXPECT_EQ(d.type(), Value::SupportedTypes::Double);
+  EXPECT_EQ(d.getDouble().value(), 3.5);
+  EXPECT_FALSE(d.getString().has_value());
+
+  Value nan(Value::Category::Literal, std::nan(""));
+  EXPECT_EQ(nan.type(), Value::SupportedTypes::Double);
+  EXPECT_TRUE(std::isnan(nan.getDouble().value()));
+
+  Value var1(Value::Category::Variable, std::string("abc"));
+  Value var2(Value::Category::Variable, std::string("abc"));
+  Value lit(Value::Category::Literal, std::string("abc"));
+  EXPECT_EQ(var1.type(), Value::SupportedTypes::String);
+  EXPECT_EQ(var1.category(), Value::Category::Variable);
+  EXPECT_EQ(lit.category(), Value::Category::Literal);
+  EXPECT_STREQ(var1.getString().value(), "abc");
+  EXPECT_EQ(var1.getString().value(), var2.getString().value());
+  EXPECT_EQ(var1.bits(), var2.bits());
+  EXPECT_NE(var1.bits(), lit.bits());
+
+  Value b(Value::Category::Literal, true);
+  EXPECT_EQ(b.type(), Value::SupportedTypes::Boolean);
+  EXPECT_TRUE(b.getBoolean().value());
+  EXPECT_FALSE(b.getDouble().has_value());
+
+  Value nil;
+  EXPECT_EQ(nil.type(), Value::SupportedTypes::None);
+}
+
+size_t programCounterOf(const Program& program, size_t index) {
+  size_t pc = 0;
+  auto instructions = program.instructions();
+  for (size_t i = 0; i < index; ++i) {
+    pc += instructions[i].length();
+  }
+  return pc;
+}
+
 class EmitterTest : public testing::Test {
  public:
-  void run(std::string code) {
+  void run(std::string code, bool fold = false) {
     auto tokenizer = Tokenizer(code);
     auto tokens = tokenizer.scanTokens();
     auto p = Parser(tokens);
     auto result = p.parse();
     ASTPrintVisitor v;
     result->accept(v);
+    if (fold) {
+      ConstantFoldingVisitor folder;
+      result->accept(folder);
+    }
     result->accept(emitter_);
   }
 
@@ -248,105 +389,376 @@ class EmitterTest : public testing::Test {
 TEST_F(EmitterTest, BasicTest) {
   run("2 + 3");
   auto program = emitter_.emit();
-  ASSERT_EQ(program.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program.fetchInst(2)->get().opcode(), OPCode::OP_ADD);
+  ASSERT_EQ(program.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program.instructions()[2].opcode(), OPCode::OP_ADD);
   ASSERT_EQ(program.fetchValue(0)->getDouble(), 2.0);
   ASSERT_EQ(program.fetchValue(1)->getDouble(), 3.0);
 }
 
+TEST_F(EmitterTest, FlatEncoding) {
+  run("2 + 3");
+  auto program = emitter_.emit();
+  // Opcode byte followed by fixed width operands, terminated by OP_HALT.
+  ASSERT_EQ(program.code().size(), 2 * (1 + sizeof(operand_t)) + 2);
+  auto instructions = program.instructions();
+  ASSERT_EQ(instructions.size(), 4);
+  EXPECT_EQ(instructions[0].length(), 1 + sizeof(operand_t));
+  EXPECT_EQ(instructions[2].length(), 1);
+  EXPECT_EQ(instructions[3].opcode(), OPCode::OP_HALT);
+  auto add = program.fetchInst(2 * (1 + sizeof(operand_t)));
+  ASSERT_TRUE(add.has_value());
+  EXPECT_EQ(add->opcode(), OPCode::OP_ADD);
+  EXPECT_FALSE(program.fetchInst(program.code().size()).has_value());
+}
+
 TEST_F(EmitterTest, StoreVariable) {
   run("let a = 3 + 1;");
   auto program = emitter_.emit();
-  ASSERT_EQ(program.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program.fetchInst(2)->get().opcode(), OPCode::OP_ADD);
-  ASSERT_EQ(program.fetchInst(3)->get().opcode(), OPCode::OP_STORE_LOCAL);
+  ASSERT_EQ(program.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program.instructions()[2].opcode(), OPCode::OP_ADD);
+  ASSERT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_SLOT);
   disassemble(program);
 }
 
 TEST_F(EmitterTest, StoreVariable2) {
-  run("let b = a + 2;");
+  run("let a = 1; let b = a + 2;");
   auto program = emitter_.emit();
-  ASSERT_EQ(program.fetchInst(0)->get().opcode(), OPCode::OP_LOAD_LOCAL);
-  ASSERT_EQ(program.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program.fetchInst(2)->get().opcode(), OPCode::OP_ADD);
-  ASSERT_EQ(program.fetchInst(3)->get().opcode(), OPCode::OP_STORE_LOCAL);
+  ASSERT_EQ(program.instructions()[2].opcode(), OPCode::OP_LOAD_SLOT);
+  ASSERT_EQ(program.instructions()[2].operand(0), 0);
+  ASSERT_EQ(program.instructions()[3].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[3].operand(0), 1);
+  ASSERT_EQ(program.instructions()[4].opcode(), OPCode::OP_ADD);
+  ASSERT_EQ(program.instructions()[5].opcode(), OPCode::OP_STORE_SLOT);
+  ASSERT_EQ(program.instructions()[5].operand(0), 1);
   disassemble(program);
 }
 
 TEST_F(EmitterTest, Compare) {
   run("3 == 2");
   auto program = emitter_.emit();
-  ASSERT_EQ(program.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program.fetchInst(2)->get().opcode(), OPCode::OP_EQUAL);
+  ASSERT_EQ(program.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program.instructions()[2].opcode(), OPCode::OP_EQUAL);
   disassemble(program);
 }
 
 TEST_F(EmitterTest, Compare2) {
   run("3 != 2");
   auto program2 = emitter_.emit();
-  ASSERT_EQ(program2.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program2.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program2.fetchInst(2)->get().opcode(), OPCode::OP_BANG_EQUAL);
+  ASSERT_EQ(program2.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program2.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program2.instructions()[2].opcode(), OPCode::OP_BANG_EQUAL);
   disassemble(program2);
 }
 
 TEST_F(EmitterTest, Compare3) {
   run("3 > 2");
   auto program2 = emitter_.emit();
-  ASSERT_EQ(program2.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program2.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program2.fetchInst(2)->get().opcode(), OPCode::OP_GREATER);
+  ASSERT_EQ(program2.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program2.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program2.instructions()[2].opcode(), OPCode::OP_GREATER);
   disassemble(program2);
 }
 
 TEST_F(EmitterTest, Compare4) {
   run("3 >= 2");
   auto program2 = emitter_.emit();
-  ASSERT_EQ(program2.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program2.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program2.fetchInst(2)->get().opcode(), OPCode::OP_GREATER_EQUAL);
+  ASSERT_EQ(program2.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program2.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program2.instructions()[2].opcode(), OPCode::OP_GREATER_EQUAL);
   disassemble(program2);
 }
 
 TEST_F(EmitterTest, Compare5) {
   run("3 < 2");
   auto program2 = emitter_.emit();
-  ASSERT_EQ(program2.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program2.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program2.fetchInst(2)->get().opcode(), OPCode::OP_LESS);
+  ASSERT_EQ(program2.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program2.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program2.instructions()[2].opcode(), OPCode::OP_LESS);
   disassemble(program2);
 }
 
 TEST_F(EmitterTest, Compare6) {
   run("3 <= 2 || 3 == 3");
   auto program2 = emitter_.emit();
-  ASSERT_EQ(program2.fetchInst(0)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(0)->get().operandsPointer()[0], 0);
-  ASSERT_EQ(program2.fetchInst(1)->get().opcode(), OPCode::OP_PUSH);
-  ASSERT_EQ(program2.fetchInst(1)->get().operandsPointer()[0], 1);
-  ASSERT_EQ(program2.fetchInst(2)->get().opcode(), OPCode::OP_LESS_EQUAL);
+  ASSERT_EQ(program2.instructions()[0].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[0].operand(0), 0);
+  ASSERT_EQ(program2.instructions()[1].opcode(), OPCode::OP_PUSH);
+  ASSERT_EQ(program2.instructions()[1].operand(0), 1);
+  ASSERT_EQ(program2.instructions()[2].opcode(), OPCode::OP_LESS_EQUAL);
   disassemble(program2);
 }
 
+TEST_F(EmitterTest, ConstantFolding) {
+  run(R"(
+fn main() {
+  let t = 3 == 3 || 3 == 2;
+  let u = (2 + 3) * 4 - 1;
+  if (1 == 2) {
+    let v = 1;
+  }
+  if (2 == 2) {
+    let w = 2;
+  }
+}
+)",
+      true);
+  auto program = emitter_.emit();
+  auto instructions = program.instructions();
+  ASSERT_EQ(instructions.size(), 8);
+  EXPECT_EQ(instructions[0].opcode(), OPCode::OP_PUSH);
+  EXPECT_EQ(program.fetchValue(instructions[0].operand(0))->getDouble(), 1.0);
+  EXPECT_EQ(instructions[1].opcode(), OPCode::OP_STORE_SLOT);
+  EXPECT_EQ(instructions[2].opcode(), OPCode::OP_PUSH);
+  EXPECT_EQ(program.fetchValue(instructions[2].operand(0))->getDouble(), 19.0);
+  EXPECT_EQ(instructions[3].opcode(), OPCode::OP_STORE_SLOT);
+  // Only the body of always taken if statement remains without branch.
+  EXPECT_EQ(instructions[4].opcode(), OPCode::OP_PUSH);
+  EXPECT_EQ(program.fetchValue(instructions[4].operand(0))->getDouble(), 2.0);
+  EXPECT_EQ(instructions[5].opcode(), OPCode::OP_STORE_SLOT);
+  EXPECT_EQ(instructions[6].opcode(), OPCode::OP_RETURN);
+}
+
+TEST_F(EmitterTest, AlgebraicSimplification) {
+  run(R"(
+fn f(x, y) {
+  let a = x * 1;
+  let b = 0 + x;
+  let c = x - x;
+  let d = (x + y) * 1;
+}
+)",
+      true);
+  auto program = emitter_.emit();
+  auto instructions = program.instructions();
+  ASSERT_EQ(instructions.size(), 18);
+  // x might not be a number, which VM rejects on x * 1.
+  EXPECT_EQ(instructions[2].opcode(), OPCode::OP_MUL);
+  // -0 + 0 is +0.
+  EXPECT_EQ(instructions[6].opcode(), OPCode::OP_ADD);
+  // x - x is kept, e.g. it is NaN for infinite x.
+  EXPECT_EQ(instructions[8].opcode(), OPCode::OP_LOAD_SLOT);
+  EXPECT_EQ(instructions[9].opcode(), OPCode::OP_LOAD_SLOT);
+  EXPECT_EQ(instructions[10].opcode(), OPCode::OP_SUB);
+  EXPECT_EQ(instructions[11].opcode(), OPCode::OP_STORE_SLOT);
+  // Sum is always a number.
+  EXPECT_EQ(instructions[12].opcode(), OPCode::OP_LOAD_SLOT);
+  EXPECT_EQ(instructions[13].opcode(), OPCode::OP_LOAD_SLOT);
+  EXPECT_EQ(instructions[14].opcode(), OPCode::OP_ADD);
+  EXPECT_EQ(instructions[15].opcode(), OPCode::OP_STORE_SLOT);
+}
+
+TEST(ConstantFoldingTest, MatchesUnfolded) {
+  std::string code = R"(
+fn main() {
+  let a = -3;
+  let b = !0;
+  let c = 1 - -3;
+  let d = 2 * -3 + 1;
+}
+)";
+  const auto run = [&code](bool fold) {
+    Tokenizer tokenizer(code);
+    Parser parser(tokenizer.scanTokens());
+    auto ast = parser.parse();
+    EXPECT_NE(ast, nullptr);
+    if (fold) {
+      ConstantFoldingVisitor folder;
+      ast->accept(folder);
+    }
+    StartearVMInstructionEmitter emitter;
+    ast->accept(emitter);
+    auto program = emitter.emit();
+    VMImpl vm(program);
+    vm.start();
+    std::vector<double> results;
+    for (const auto* name : {"a", "b", "c", "d"}) {
+      results.emplace_back(vm.peekLocalVariable(name)->getDouble().value());
+    }
+    return results;
+  };
+  EXPECT_EQ(run(true), run(false));
+}
+
+TEST_F(EmitterTest, ConstantPoolInterning) {
+  run(R"(
+fn f(x) {
+  let a = 3;
+  let b = 3 + x;
+  let c = f(3);
+  let d = f(a);
+}
+)");
+  auto program = emitter_.emit();
+  // 3 and the name of function.
+  EXPECT_EQ(program.values().size(), 2);
+  EXPECT_EQ(program.instructions()[0].operand(0),
+            program.instructions()[2].operand(0));
+  Program p;
+  auto literal = p.addValue(Value(Value::Category::Literal, "f"));
+  EXPECT_EQ(p.addValue(Value(Value::Category::Literal, std::string("f"))),
+            literal);
+  EXPECT_NE(p.addValue(Value(Value::Category::Variable, "f")), literal);
+}
+
+TEST_F(EmitterTest, SlotResolution) {
+  run("fn f(x, y) { let z = y; x = z; }");
+  auto program = emitter_.emit();
+  ASSERT_EQ(program.instructions()[0].opcode(), OPCode::OP_LOAD_SLOT);
+  ASSERT_EQ(program.instructions()[0].operand(0), 1);
+  ASSERT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_SLOT);
+  ASSERT_EQ(program.instructions()[1].operand(0), 2);
+  ASSERT_EQ(program.instructions()[2].opcode(), OPCode::OP_LOAD_SLOT);
+  ASSERT_EQ(program.instructions()[2].operand(0), 2);
+  ASSERT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_SLOT);
+  ASSERT_EQ(program.instructions()[3].operand(0), 0);
+  auto f = program.functionRegistry().findByName("f");
+  ASSERT_TRUE(f.has_value());
+  EXPECT_EQ(f->get().arity_, 2);
+  EXPECT_EQ(f->get().locals_, (std::vector<std::string>{"x", "y", "z"}));
+}
+
+TEST_F(EmitterTest, LinkUndefinedFunction) {
+  run(R"(
+fn main() {
+  let a = 1;
+  if (a == 1) {
+    let c = 2;
+  }
+  let b = undefined(2);
+}
+)");
+  auto program = emitter_.emit();
+  ASSERT_FALSE(program.linked());
+  // Resolved operands are not patched partially.
+  for (const auto& instr : program.instructions()) {
+    if (instr.opcode() == OPCode::OP_BRANCH) {
+      EXPECT_TRUE(program.fetchValue(instr.operand(0))->getString());
+      EXPECT_TRUE(program.fetchValue(instr.operand(1))->getString());
+    }
+  }
+  EXPECT_FALSE(program.link());
+}
+
+TEST_F(EmitterTest, LinkUndefinedVariable) {
+  run(R"(
+fn main() {
+  let b = a + 1;
+}
+)");
+  auto program = emitter_.emit();
+  ASSERT_FALSE(program.linked());
+  // Loading undeclared variable never declares it.
+  auto main = program.functionRegistry().findByName("main");
+  ASSERT_TRUE(main.has_value());
+  EXPECT_EQ(main->get().locals_, (std::vector<std::string>{"b"}));
+}
+
+TEST_F(EmitterTest, Link) {
+  run(R"(
+fn sub(x) {
+  if (x == 0) {
+    return 1;
+  }
+  return x;
+}
+
+fn main() {
+  let a = sub(2);
+}
+)");
+  auto program = emitter_.emit();
+  ASSERT_TRUE(program.linked());
+  auto branch = program.instructions()[3];
+  ASSERT_EQ(branch.opcode(), OPCode::OP_BRANCH);
+  // Jump to `return 1` or `return x`.
+  EXPECT_EQ(branch.operand(0), programCounterOf(program, 4));
+  EXPECT_EQ(branch.operand(1), programCounterOf(program, 6));
+  auto call = program.instructions()[9];
+  ASSERT_EQ(call.opcode(), OPCode::OP_CALL);
+  EXPECT_EQ(call.operand(0),
+            program.functionRegistry().findByName("sub")->get().id_);
+}
+
+TEST_F(EmitterTest, FuseSuperinstructions) {
+  run(R"(
+fn inc(x) {
+  let y = x + 1;
+  if (y == 3) {
+    return y;
+  }
+  return 0;
+}
+
+fn main() {
+  let a = 2;
+  let b = inc(a);
+}
+)");
+  auto program = emitter_.emit(true);
+  ASSERT_TRUE(program.linked());
+  auto instructions = program.instructions();
+  ASSERT_EQ(instructions.size(), 15);
+  EXPECT_EQ(instructions[0].opcode(), OPCode::OP_ADD_SLOT_CONST);
+  EXPECT_EQ(instructions[0].operand(0), 0);
+  EXPECT_EQ(instructions[1].opcode(), OPCode::OP_STORE_SLOT);
+  auto branch = instructions[4];
+  ASSERT_EQ(branch.opcode(), OPCode::OP_COMPARE_BRANCH);
+  EXPECT_EQ(static_cast<OPCode>(branch.operand(0)), OPCode::OP_EQUAL);
+  // Jump targets are relocated.
+  EXPECT_EQ(branch.operand(1), programCounterOf(program, 5));
+  EXPECT_EQ(branch.operand(2), programCounterOf(program, 7));
+  EXPECT_EQ(instructions[9].opcode(), OPCode::OP_PUSH_STORE);
+  EXPECT_EQ(instructions[9].operand(1), 0);
+  EXPECT_EQ(program.functionRegistry().findByName("main")->get().pc_,
+            programCounterOf(program, 9));
+  disassemble(program);
+
+  VMImpl vm(program);
+  vm.start();
+  auto b = vm.peekLocalVariable("b");
+  ASSERT_TRUE(b.has_value());
+  EXPECT_EQ(b->getDouble().value(), 3.0);
+}
+
+TEST(TraceMinerTest, TopCandidates) {
+  std::vector<OPCode> trace;
+  for (const auto last :
+       {OPCode::OP_STORE_SLOT, OPCode::OP_RETURN, OPCode::OP_BRANCH}) {
+    trace.insert(trace.end(),
+                 {OPCode::OP_LOAD_SLOT, OPCode::OP_PUSH, OPCode::OP_ADD, last});
+  }
+  auto candidates = mineFusionCandidates(trace, 3, 2);
+  ASSERT_EQ(candidates.size(), 2);
+  EXPECT_EQ(candidates[0].sequence_,
+            (std::vector<OPCode>{OPCode::OP_LOAD_SLOT, OPCode::OP_PUSH,
+                                 OPCode::OP_ADD}));
+  EXPECT_EQ(candidates[0].count_, 3);
+  EXPECT_EQ(candidates[0].savedDispatches(), 6);
+  // Sequences across OP_RETURN are never proposed.
+  for (const auto& candidate : mineFusionCandidates(trace, 3, 100)) {
+    for (size_t i = 0; i + 1 < candidate.sequence_.size(); ++i) {
+      EXPECT_NE(candidate.sequence_[i], OPCode::OP_RETURN);
+    }
+  }
+}
+
 class VMExecIntegration : public testing::Test {
  public:
   void prepare(std::string& code, std::function<void(Program&)> program_eval,
@@ -386,6 +798,18 @@ fn main() {}
       [&](VMImpl& vm) {}, true);
 }
 
+TEST_F(VMExecIntegration, CountInstructions) {
+  if (!VMImpl::countsInstructions()) {
+    GTEST_SKIP() << "VM is built without STARTEAR_VM_COUNT";
+  }
+  std::string code = R"(
+fn main() {}
+)";
+  prepare(
+      code, [&](Program& program) {},
+      [&](VMImpl& vm) { EXPECT_EQ(vm.executedInstructions(), 1); }, false);
+}
+
 TEST_F(VMExecIntegration, Cond) {
   std::string code = R"(
 fn main() {
@@ -400,29 +824,679 @@ fn main() {
   prepare(
       code, [&](Program& program) {},
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
-        const auto& entry_p = top_frame.lv_table_.find("p");
-        ASSERT_TRUE(entry_p != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_p->second.getDouble().value(), 1.0);
-        const auto& entry_q = top_frame.lv_table_.find("q");
-        ASSERT_TRUE(entry_q != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_q->second.getDouble().value(), 0.0);
-        const auto& entry_r = top_frame.lv_table_.find("r");
-        ASSERT_TRUE(entry_r != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_r->second.getDouble().value(), 1.0);
-        const auto& entry_s = top_frame.lv_table_.find("s");
-        ASSERT_TRUE(entry_s != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_s->second.getDouble().value(), 0.0);
-        const auto& entry_u = top_frame.lv_table_.find("u");
-        ASSERT_TRUE(entry_u != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_u->second.getDouble().value(), 0.0);
-        const auto& entry_t = top_frame.lv_table_.find("t");
-        ASSERT_TRUE(entry_t != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_t->second.getDouble().value(), 1.0);
+        const auto entry_p = vm.peekLocalVariable("p");
+        ASSERT_TRUE(entry_p.has_value());
+        ASSERT_EQ(entry_p->getDouble().value(), 1.0);
+        const auto entry_q = vm.peekLocalVariable("q");
+        ASSERT_TRUE(entry_q.has_value());
+        ASSERT_EQ(entry_q->getDouble().value(), 0.0);
+        const auto entry_r = vm.peekLocalVariable("r");
+        ASSERT_TRUE(entry_r.has_value());
+        ASSERT_EQ(entry_r->getDouble().value(), 1.0);
+        const auto entry_s = vm.peekLocalVariable("s");
+        ASSERT_TRUE(entry_s.has_value());
+        ASSERT_EQ(entry_s->getDouble().value(), 0.0);
+        const auto entry_u = vm.peekLocalVariable("u");
+        ASSERT_TRUE(entry_u.has_value());
+        ASSERT_EQ(entry_u->getDouble().value(), 0.0);
+        const auto entry_t = vm.peekLocalVariable("t");
+        ASSERT_TRUE(entry_t.has_value());
+        ASSERT_EQ(entry_t->getDouble().value(), 1.0);
       },
       true);
 }
 
+TEST(FlatASTTest, LowerMatchesTree) {
+  std::string code = R"(
+fn add(a, b) {
+  let c = a + b * 1;
+  return c;
+}
+fn main() {
+  let x = 1 + 2 * 3;
+  let y = x - 0;
+  if (x == 7) {
+    let z = add(x, y);
+  }
+  if (1 < 2) {
+    let w = (x + 1) / 2;
+  }
+  return 0;
+}
+)";
+  for (bool fold : {false, true}) {
+    Tokenizer tokenizer(code);
+    Parser p(tokenizer.scanTokens());
+    auto ast = p.parse();
+    ASSERT_NE(ast, nullptr);
+    if (fold) {
+      ConstantFoldingVisitor folder;
+      ast->accept(folder);
+    }
+    auto flat = FlatAST::build(*ast);
+    // Children precede their parent.
+    EXPECT_EQ(flat.root(), flat.size() - 1);
+    for (FlatAST::NodeIndex node = 0; node < flat.size(); ++node) {
+      for (auto child : flat.children(node)) {
+        EXPECT_LT(child, node);
+      }
+    }
+
+    StartearVMInstructionEmitter emitter;
+    ast->accept(emitter);
+    const auto& expected = emitter.emit();
+    Program lowered;
+    flat.lower(lowered);
+    lowered.link();
+    EXPECT_EQ(expected.code(), lowered.code());
+    EXPECT_EQ(expected.values().size(), lowered.values().size());
+  }
+}
+
+TEST(CompilerTest, SinglePassMatchesTree) {
+  std::string code = R"(
+fn add(a, b) {
+  // comment
+  let c = a + b * 2 - (a - b) / 4;
+  c = c + 1;
+  return c;
+}
+fn main() {
+  let x = 1 + 2 * 3;
+  let y = x < 10 && x >= 2 || x == 0;
+  if (x == 7) {
+    let z = add(x, y);
+  }
+  let w = -x;
+}
+)";
+  Tokenizer tokenizer(code);
+  const auto& tokens = tokenizer.scanTokens();
+  Compiler compiler(tokens);
+  ASSERT_TRUE(compiler.compile());
+
+  Parser p(tokens);
+  auto ast = p.parse();
+  ASSERT_NE(ast, nullptr);
+  StartearVMInstructionEmitter emitter;
+  ast->accept(emitter);
+  const auto& expected = emitter.emit();
+  EXPECT_EQ(expected.code(), compiler.program().code());
+  EXPECT_EQ(expected.values().size(), compiler.program().values().size());
+
+  Tokenizer broken("fn main() { let a = ; }");
+  Compiler broken_compiler(broken);
+  EXPECT_FALSE(broken_compiler.compile());
+}
+
+TEST(BytecodeFileTest, RoundTrip) {
+  std::string code = R"(
+fn add(a, b) {
+  let c = a + b;
+  return c;
+}
+fn main() {
+  let x = 3;
+  let y = 4;
+  let z = add(x, y);
+  let w = x < y && 2.5 > 1;
+}
+)";
+  Tokenizer tokenizer(code);
+  Compiler compiler(tokenizer.scanTokens());
+  ASSERT_TRUE(compiler.compile());
+  const auto& program = compiler.program();
+  auto hash = BytecodeFile::hashSource(code);
+  auto serialized = BytecodeFile::serialize(program, hash);
+  ASSERT_TRUE(serialized.has_value());
+  const auto& image = *serialized;
+
+  auto loaded = BytecodeFile::deserialize(image, hash);
+  ASSERT_TRUE(loaded.has_value());
+  EXPECT_TRUE(loaded->linked());
+  EXPECT_EQ(loaded->code(), program.code());
+  ASSERT_EQ(loaded->values().size(), program.values().size());
+  for (size_t i = 0; i < program.values().size(); ++i) {
+    EXPECT_EQ(loaded->values()[i].bits(), program.values()[i].bits());
+  }
+  auto add = loaded->functionRegistry().findByName("add");
+  ASSERT_TRUE(add.has_value());
+  EXPECT_EQ(add->get().arity_, 2);
+  EXPECT_EQ(add->get().pc_,
+            program.functionRegistry().findByName("add")->get().pc_);
+  EXPECT_EQ(add->get().locals_,
+            (std::vector<std::string>{"a", "b", "c"}));
+
+  VMImpl vm(*loaded);
+  vm.start();
+  const auto z = vm.peekLocalVariable("z");
+  ASSERT_TRUE(z.has_value());
+  EXPECT_EQ(z->getDouble().value(), 7.0);
+
+  // Stale or broken images are rejected.
+  EXPECT_FALSE(BytecodeFile::deserialize(image, hash + 1).has_value());
+  EXPECT_FALSE(BytecodeFile::deserialize(
+                   std::string_view(image).substr(0, image.size() - 8), hash)
+                   .has_value());
+  auto corrupted = image;
+  corrupted[sizeof(BytecodeFile::Header)] =
+      static_cast<char>(OPCode::OPCODE_SIZE);
+  EXPECT_FALSE(BytecodeFile::deserialize(corrupted, hash).has_value());
+
+  auto path = testing::TempDir() + "startear_round_trip.stbc";
+  ASSERT_TRUE(BytecodeFile::write(program, hash, path));
+  auto mapped = BytecodeFile::load(path, hash);
+  ASSERT_TRUE(mapped.has_value());
+  // Code and values are executed in place on the mapped image.
+  ASSERT_TRUE(mapped->mapped());
+  EXPECT_EQ(std::vector<uint8_t>(mapped->codeData(),
+                                 mapped->codeData() + mapped->codeSize()),
+            program.code());
+  EXPECT_EQ(mapped->valueCount(), program.values().size());
+  std::remove(path.c_str());
+  EXPECT_FALSE(BytecodeFile::load(path, hash).has_value());
+
+  // The mapping outlives the file and the original program object.
+  auto copied = *mapped;
+  mapped.reset();
+  VMImpl mapped_vm(copied);
+  mapped_vm.start();
+  const auto mapped_z = mapped_vm.peekLocalVariable("z");
+  ASSERT_TRUE(mapped_z.has_value());
+  EXPECT_EQ(mapped_z->getDouble().value(), 7.0);
+
+  // Program which failed to link is never cached.
+  Tokenizer undefined_tokenizer("fn main() { let b = nope(1); }");
+  Compiler undefined_compiler(undefined_tokenizer.scanTokens());
+  ASSERT_FALSE(undefined_compiler.compile());
+  const auto& unlinked = undefined_compiler.program();
+  EXPECT_FALSE(BytecodeFile::serialize(unlinked, hash).has_value());
+  EXPECT_FALSE(BytecodeFile::write(unlinked, hash, path));
+  EXPECT_FALSE(BytecodeFile::load(path, hash).has_value());
+}
+
+TEST(BytecodeFileTest, RejectCorruptOperands) {
+  std::string code = R"(
+fn one() {
+  return 1;
+}
+fn main() {
+  let x = 3;
+  let y = 4;
+  if (x < y) {
+    let z = x + 1;
+  }
+}
+)";
+  Tokenizer tokenizer(code);
+  Parser parser(tokenizer.scanTokens());
+  auto ast = parser.parse();
+  ASSERT_NE(ast, nullptr);
+  StartearVMInstructionEmitter emitter;
+  ast->accept(emitter);
+  const auto& program = emitter.emit(true);
+  ASSERT_TRUE(program.linked());
+  auto hash = BytecodeFile::hashSource(code);
+  auto serialized = BytecodeFile::serialize(program, hash);
+  ASSERT_TRUE(serialized.has_value());
+  const auto& image = *serialized;
+  ASSERT_TRUE(BytecodeFile::deserialize(image, hash).has_value());
+
+  std::optional<size_t> load_pc;
+  std::optional<size_t> branch_pc;
+  size_t pc = 0;
+  for (const auto& instr : program.instructions()) {
+    if (instr.opcode() == OPCode::OP_LOAD_SLOT && !load_pc) {
+      load_pc = pc;
+    } else if (instr.opcode() == OPCode::OP_COMPARE_BRANCH) {
+      branch_pc = pc;
+    }
+    pc += instr.length();
+  }
+  ASSERT_TRUE(load_pc.has_value());
+  ASSERT_TRUE(branch_pc.has_value());
+  const auto corrupt = [&](size_t pc, size_t i, operand_t operand) {
+    auto corrupted = image;
+    memcpy(corrupted.data() + sizeof(BytecodeFile::Header) + pc + 1 +
+               i * sizeof(operand_t),
+           &operand, sizeof(operand_t));
+    return BytecodeFile::deserialize(corrupted, hash).has_value();
+  };
+  // Slot outside of the frame.
+  EXPECT_FALSE(corrupt(*load_pc, 0, 100));
+  // Operand of OP_COMPARE_BRANCH which is not comparison.
+  EXPECT_FALSE(
+      corrupt(*branch_pc, 0, static_cast<operand_t>(OPCode::OP_ADD)));
+  // Target in the middle of instruction.
+  Instruction branch(program.codeData() + *branch_pc);
+  EXPECT_FALSE(corrupt(*branch_pc, 1, branch.operand(1) + 1));
+  // Target in other function, e.g. the entry of `one`.
+  EXPECT_FALSE(corrupt(*branch_pc, 1, 0));
+}
+
+TEST(JITTest, MatchesInterpreter) {
+  std::string code = R"(
+fn fib(n) {
+  if (n < 2) {
+    return n;
+  }
+  let a = fib(n - 1);
+  let b = fib(n - 2);
+  let c = a + b;
+  return c;
+}
+fn mix(x, y) {
+  let p = x * 3 - y / 2;
+  let q = p >= x;
+  let r = p != y;
+  if (p == 7) {
+    p = p + 1;
+  }
+  let s = q + r + p;
+  return s;
+}
+fn both(x, y) {
+  let z = x < y && y < 10;
+  return z;
+}
+fn callsBoth(x) {
+  let w = both(x, 3);
+  return w;
+}
+fn main() {
+  let f = fib(15);
+  let m = mix(4, 6);
+  let n = mix(3, 4);
+  let b = callsBoth(1);
+}
+)";
+  for (const bool fuse : {false, true}) {
+    Tokenizer tokenizer(code);
+    Parser parser(tokenizer.scanTokens());
+    auto ast = parser.parse();
+    ASSERT_NE(ast, nullptr);
+    StartearVMInstructionEmitter emitter;
+    ast->accept(emitter);
+    auto program = emitter.emit(fuse);
+
+#if defined(__x86_64__)
+    JIT jit(program);
+    const auto& registry = program.functionRegistry();
+    EXPECT_NE(jit.entry(registry.findByName("fib")->get().id_), nullptr);
+    EXPECT_NE(jit.entry(registry.findByName("mix")->get().id_), nullptr);
+    EXPECT_TRUE(jit.returnsValue(registry.findByName("fib")->get().id_));
+    // Short-circuit `&&` is compiled into conditional jumps as well.
+    EXPECT_NE(jit.entry(registry.findByName("both")->get().id_), nullptr);
+    EXPECT_NE(jit.entry(registry.findByName("callsBoth")->get().id_), nullptr);
+
+    // Native code can be called directly on the value stack.
+    std::vector<Value> stack(1024);
+    stack[0] = Value(Value::Category::Literal, 10);
+    auto fib = jit.entry(registry.findByName("fib")->get().id_);
+    EXPECT_EQ(fib(stack.data(), stack.data() + stack.size()).getDouble(),
+              55.0);
+#endif
+
+    VMImpl interpreter(program);
+    interpreter.useJIT(false);
+    interpreter.start();
+    VMImpl native(program);
+    native.start();
+    for (const auto name : {"f", "m", "n", "b"}) {
+      auto expected = interpreter.peekLocalVariable(name);
+      auto actual = native.peekLocalVariable(name);
+      ASSERT_TRUE(expected.has_value() && actual.has_value());
+      EXPECT_EQ(expected->bits(), actual->bits()) << name;
+    }
+    EXPECT_EQ(native.peekLocalVariable("f")->getDouble().value(), 610.0);
+  }
+}
+
+TEST(QuickeningTest, RewriteByTypeFeedback) {
+  std::string code = R"(
+fn sum(n, acc) {
+  if (n < 1) {
+    return acc;
+  }
+  let next = sum(n - 1, acc + n * 2);
+  return next;
+}
+fn main() {
+  let s = sum(10, 0);
+}
+)";
+  Tokenizer tokenizer(code);
+  Compiler compiler(tokenizer.scanTokens());
+  ASSERT_TRUE(compiler.compile());
+  auto program = compiler.program();
+  const auto generic = program.code();
+  const auto count = [&program](OPCode code) {
+    const auto instructions = program.instructions();
+    return std::count_if(
+        instructions.begin(), instructions.end(),
+        [code](const auto& instr) { return instr.opcode() == code; });
+  };
+
+  for (size_t i = 0; i < 2; ++i) {
+    VMImpl vm(program);
+    vm.useJIT(false);
+    vm.start();
+    EXPECT_EQ(vm.peekLocalVariable("s")->getDouble().value(), 110.0);
+  }
+  EXPECT_EQ(count(OPCode::OP_LESS), 0);
+  EXPECT_EQ(count(OPCode::OP_LESS_DOUBLE), 1);
+  EXPECT_EQ(count(OPCode::OP_MUL_DOUBLE), 1);
+  EXPECT_EQ(count(OPCode::OP_SUB_DOUBLE), 1);
+  EXPECT_EQ(count(OPCode::OP_ADD_DOUBLE), 1);
+  EXPECT_EQ(genericOpcode(OPCode::OP_LESS_DOUBLE), OPCode::OP_LESS);
+  EXPECT_FALSE(quickenedOpcode(OPCode::OP_AND).has_value());
+
+  // Cache holds generic instructions, and mapped program is never rewritten.
+  auto hash = BytecodeFile::hashSource(code);
+  auto path = testing::TempDir() + "startear_quickened.stbc";
+  ASSERT_TRUE(BytecodeFile::write(program, hash, path));
+  auto mapped = BytecodeFile::load(path, hash);
+  std::remove(path.c_str());
+  ASSERT_TRUE(mapped.has_value() && mapped->mapped());
+  ASSERT_EQ(mapped->codeSize(), generic.size());
+  EXPECT_TRUE(std::equal(generic.begin(), generic.end(), mapped->codeData()));
+  VMImpl vm(*mapped);
+  vm.useJIT(false);
+  vm.start();
+  EXPECT_EQ(vm.peekLocalVariable("s")->getDouble().value(), 110.0);
+  EXPECT_TRUE(std::equal(generic.begin(), generic.end(), mapped->codeData()));
+}
+
+TEST(TailCallTest, ReuseFrame) {
+  std::string code = R"(
+fn count(n, acc) {
+  if (n < 1) {
+    return acc;
+  }
+  let next = count(n - 1, acc + 1);
+  return next;
+}
+fn main() {
+  let c = count(100000, 0);
+}
+)";
+  Tokenizer tokenizer(code);
+  Compiler compiler(tokenizer.scanTokens());
+  ASSERT_TRUE(compiler.compile());
+  auto program = compiler.program();
+  const auto instructions = program.instructions();
+  const auto count = [&instructions](OPCode code) {
+    return std::count_if(
+        instructions.begin(), instructions.end(),
+        [code](const auto& instr) { return instr.opcode() == code; });
+  };
+  // The call from the entry function is not in tail position.
+  EXPECT_EQ(count(OPCode::OP_TAIL_CALL), 1);
+  EXPECT_EQ(count(OPCode::OP_CALL), 1);
+#if defined(__x86_64__)
+  JIT jit(program);
+  const auto id = program.functionRegistry().findByName("count")->get().id_;
+  EXPECT_NE(jit.entry(id), nullptr);
+#endif
+
+  // Recursion never grows the stack, which is too small for 100000 frames.
+  for (const bool jit : {false, true}) {
+    VMImpl vm(program, 64);
+    vm.useJIT(jit);
+    vm.start();
+    EXPECT_EQ(vm.peekLocalVariable("c")->getDouble().value(), 100000.0);
+  }
+}
+
+TEST(ShortCircuitTest, SkipRightOperand) {
+  std::string code = R"(
+fn main() {
+  let t = 1;
+  let f = 0;
+  let a = f && t;
+  let b = t && f;
+  let c = t && t;
+  let d = f || t;
+  let e = f || f;
+  let g = t || f && f;
+  let s = f && t * t + t * t + t * t + t * t == 4;
+  let u = t || t * t + t * t + t * t + t * t == 4;
+}
+)";
+  const std::pair<const char*, double> expected[] = {
+      {"a", 0}, {"b", 0}, {"c", 1}, {"d", 1},
+      {"e", 0}, {"g", 1}, {"s", 0}, {"u", 1}};
+  Tokenizer tokenizer(code);
+  const auto& tokens = tokenizer.scanTokens();
+  Parser parser(tokens);
+  auto ast = parser.parse();
+  ASSERT_NE(ast, nullptr);
+  StartearVMInstructionEmitter emitter;
+  ast->accept(emitter);
+  auto program = emitter.emit();
+  for (const auto& instr : program.instructions()) {
+    EXPECT_NE(instr.opcode(), OPCode::OP_AND);
+    EXPECT_NE(instr.opcode(), OPCode::OP_OR);
+  }
+  Compiler compiler(tokens);
+  ASSERT_TRUE(compiler.compile());
+  EXPECT_EQ(program.code(), compiler.program().code());
+
+  for (const bool jit : {false, true}) {
+    VMImpl vm(program);
+    vm.useJIT(jit);
+    vm.start();
+    for (const auto& [name, value] : expected) {
+      EXPECT_EQ(vm.peekLocalVariable(name)->getDouble().value(), value)
+          << name;
+    }
+    // Instructions are executed at most once, and long right operands are
+    // skipped.
+    if (VMImpl::countsInstructions()) {
+      EXPECT_LT(vm.executedInstructions() + 30,
+                program.instructions().size());
+    }
+  }
+
+  RegisterVMInstructionEmitter register_emitter;
+  ast->accept(register_emitter);
+  const auto& lowered = register_emitter.emit();
+  ASSERT_TRUE(lowered.lowered());
+  RegisterVM register_vm(lowered);
+  register_vm.start();
+  for (const auto& [name, value] : expected) {
+    EXPECT_EQ(register_vm.peekLocalVariable(name)->getDouble().value(), value)
+        << name;
+  }
+
+  // Left operand other than 0 or 1 terminates every backend, even if the
+  // right operand would be skipped.
+  for (const std::string invalid : {"&&", "||"}) {
+    std::string invalid_code =
+        "fn main() { let h = 3; let c = h " + invalid + " 1; }";
+    Tokenizer invalid_tokenizer(invalid_code);
+    Parser invalid_parser(invalid_tokenizer.scanTokens());
+    auto invalid_ast = invalid_parser.parse();
+    ASSERT_NE(invalid_ast, nullptr);
+    StartearVMInstructionEmitter invalid_emitter;
+    invalid_ast->accept(invalid_emitter);
+    auto invalid_program = invalid_emitter.emit();
+    for (const bool jit : {false, true}) {
+      EXPECT_DEATH(
+          {
+            VMImpl vm(invalid_program);
+            vm.useJIT(jit);
+            vm.start();
+          },
+          "")
+          << invalid;
+    }
+    RegisterVMInstructionEmitter invalid_register_emitter;
+    invalid_ast->accept(invalid_register_emitter);
+    const auto& invalid_lowered = invalid_register_emitter.emit();
+    ASSERT_TRUE(invalid_lowered.lowered());
+    EXPECT_DEATH(
+        {
+          RegisterVM vm(invalid_lowered);
+          vm.start();
+        },
+        "")
+        << invalid;
+  }
+}
+
+TEST(InlineTest, SpliceSmallFunctions) {
+  std::string code = R"(
+fn inc(x) {
+  let y = x + 1;
+  return y;
+}
+fn scale(x, k) {
+  let y = x * k;
+  return y;
+}
+fn large(x) {
+  let a = x + 1;
+  let b = a * 2;
+  let c = b - 3;
+  let d = c / 4;
+  return d;
+}
+fn down(n) {
+  if (n < 1) {
+    return 0;
+  }
+  let next = down(n - 1);
+  return next;
+}
+fn main() {
+  let a = inc(1);
+  let b = scale(a, 3);
+  let c = inc(b);
+  let d = large(c);
+  let e = down(2);
+}
+)";
+  const std::pair<const char*, double> expected[] = {
+      {"a", 2}, {"b", 6}, {"c", 7}, {"d", 3.25}, {"e", 0}};
+  const auto compile = [&code](std::optional<InlineOptions> inlining) {
+    Tokenizer tokenizer(code);
+    Compiler compiler(tokenizer.scanTokens());
+    EXPECT_TRUE(compiler.compile(false, inlining));
+    return compiler.program();
+  };
+  const auto calls = [](const Program& program) {
+    const auto instructions = program.instructions();
+    return std::count_if(instructions.begin(), instructions.end(),
+                         [](const auto& instr) {
+                           return instr.opcode() == OPCode::OP_CALL ||
+                                  instr.opcode() == OPCode::OP_TAIL_CALL;
+                         });
+  };
+  auto baseline = compile(std::nullopt);
+  EXPECT_EQ(calls(baseline), 6);
+  std::vector<uint64_t> counts;
+  VMImpl profiled(baseline);
+  profiled.useJIT(false);
+  profiled.recordCallCounts(&counts);
+  profiled.start();
+  const auto& registry = baseline.functionRegistry();
+  EXPECT_EQ(counts[registry.findByName("inc")->get().id_], 2);
+  EXPECT_EQ(counts[registry.findByName("scale")->get().id_], 1);
+  EXPECT_EQ(counts[registry.findByName("down")->get().id_], 3);
+
+  // Recursive down is never inlined, and large is over the default budget.
+  InlineOptions large;
+  large.budget_ = 32;
+  InlineOptions hot;
+  hot.call_counts_ = &counts;
+  hot.min_calls_ = 2;
+  for (const auto& [options, remained] :
+       {std::make_pair(large, 2), std::make_pair(InlineOptions(), 3),
+        std::make_pair(hot, 4)}) {
+    auto program = compile(options);
+    EXPECT_EQ(calls(program), remained);
+    VMImpl vm(program);
+    vm.useJIT(false);
+    vm.start();
+    for (const auto& [name, value] : expected) {
+      EXPECT_EQ(vm.peekLocalVariable(name)->getDouble().value(), value)
+          << name;
+    }
+    if (VMImpl::countsInstructions()) {
+      EXPECT_LT(vm.executedInstructions(), profiled.executedInstructions());
+    }
+  }
+
+  // Locals of callee are renamed into the frame of caller.
+  auto program = compile(InlineOptions());
+  const auto& main = program.functionRegistry().findByName("main")->get();
+  EXPECT_TRUE(main.findSlot("inc.x").has_value());
+  EXPECT_TRUE(main.findSlot("scale.k").has_value());
+  VMImpl vm(program);
+  vm.useJIT(false);
+  vm.start();
+  EXPECT_EQ(vm.peekLocalVariable("inc.y")->getDouble().value(), 7.0);
+}
+
+TEST(ArenaTest, Allocation) {
+  std::vector<int> destroyed;
+  struct Tracked {
+    Tracked(std::vector<int>& log, int id) : log_(log), id_(id) {}
+    ~Tracked() { log_.push_back(id_); }
+    std::vector<int>& log_;
+    int id_;
+  };
+  {
+    Arena arena(64);
+    auto c = arena.make<char>('c');
+    auto d = arena.make<double>(1.5);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(d.get()) % alignof(double), 0);
+    EXPECT_EQ(*d, 1.5);
+    auto first = arena.make<Tracked>(destroyed, 1);
+    auto second = arena.make<Tracked>(destroyed, 2);
+    // Larger object than block is placed on its own block.
+    auto large = arena.make<std::array<char, 256>>();
+    EXPECT_GE(arena.blockCount(), 2);
+    EXPECT_GE(arena.allocatedBytes(), 256 + sizeof(double) + 1);
+    EXPECT_TRUE(destroyed.empty());
+  }
+  EXPECT_EQ(destroyed, std::vector<int>({2, 1}));
+}
+
+TEST(Basic, ParserArena) {
+  Tokenizer tokenizer("fn main() { let a = 1 + 2 * 3; let b = a - 4; }");
+  Parser p(tokenizer.scanTokens());
+  auto ast = p.parse();
+  ASSERT_NE(ast, nullptr);
+  // All of nodes and tokens fit in a single block.
+  EXPECT_EQ(p.arena().blockCount(), 1);
+  EXPECT_GT(p.arena().allocatedBytes(), 0);
+}
+
+TEST(Basic, ParseFromStream) {
+  std::istringstream input(R"(
+fn main() {
+    // test comment
+    let a = 3;
+    let b = 4;
+    let c = a + b;
+}
+)");
+  Tokenizer tokenizer(input, 4);
+  Parser p(tokenizer);
+  auto ast = p.parse();
+  ASSERT_NE(ast, nullptr);
+  StartearVMInstructionEmitter emitter;
+  ast->accept(emitter);
+  auto program = emitter.emit();
+  VMImpl vm(program);
+  vm.start();
+  const auto entry_c = vm.peekLocalVariable("c");
+  ASSERT_TRUE(entry_c.has_value());
+  EXPECT_EQ(entry_c->getDouble().value(), 7.0);
+}
+
 TEST_F(VMExecIntegration, BasicCalc) {
   std::string code = R"(
 fn main() {
@@ -436,30 +1510,29 @@ fn main() {
       code,
       [&](Program& program) {
         EXPECT_EQ(program.instructions()[0].opcode(), OPCode::OP_PUSH);
-        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_LOCAL);
+        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_SLOT);
         EXPECT_EQ(program.instructions()[2].opcode(), OPCode::OP_PUSH);
-        EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_LOCAL);
-        EXPECT_EQ(program.instructions()[4].opcode(), OPCode::OP_LOAD_LOCAL);
-        EXPECT_EQ(program.instructions()[5].opcode(), OPCode::OP_LOAD_LOCAL);
+        EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_SLOT);
+        EXPECT_EQ(program.instructions()[4].opcode(), OPCode::OP_LOAD_SLOT);
+        EXPECT_EQ(program.instructions()[5].opcode(), OPCode::OP_LOAD_SLOT);
         EXPECT_EQ(program.instructions()[6].opcode(), OPCode::OP_ADD);
-        EXPECT_EQ(program.instructions()[7].opcode(), OPCode::OP_STORE_LOCAL);
+        EXPECT_EQ(program.instructions()[7].opcode(), OPCode::OP_STORE_SLOT);
       },
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
         // Variable State
-        ASSERT_EQ(top_frame.lv_table_.size(), 3);
+        ASSERT_EQ(vm.peekFunction().locals_.size(), 3);
 
-        const auto& entry_a = top_frame.lv_table_.find("a");
-        ASSERT_TRUE(entry_a != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_a->second.getDouble().value(), 3.0);
+        const auto entry_a = vm.peekLocalVariable("a");
+        ASSERT_TRUE(entry_a.has_value());
+        ASSERT_EQ(entry_a->getDouble().value(), 3.0);
 
-        const auto& entry_b = top_frame.lv_table_.find("b");
-        ASSERT_TRUE(entry_b != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_b->second.getDouble().value(), 4.0);
+        const auto entry_b = vm.peekLocalVariable("b");
+        ASSERT_TRUE(entry_b.has_value());
+        ASSERT_EQ(entry_b->getDouble().value(), 4.0);
 
-        const auto& entry_c = top_frame.lv_table_.find("c");
-        ASSERT_TRUE(entry_c != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_c->second.getDouble().value(), 7.0);
+        const auto entry_c = vm.peekLocalVariable("c");
+        ASSERT_TRUE(entry_c.has_value());
+        ASSERT_EQ(entry_c->getDouble().value(), 7.0);
       },
       true);
 }
@@ -475,18 +1548,17 @@ fn main() {
       code,
       [&](Program& program) {
         EXPECT_EQ(program.instructions()[0].opcode(), OPCode::OP_PUSH);
-        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_LOCAL);
+        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_SLOT);
         EXPECT_EQ(program.instructions()[2].opcode(), OPCode::OP_PUSH);
-        EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_LOCAL);
+        EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_SLOT);
       },
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
         // Variable State
-        ASSERT_EQ(top_frame.lv_table_.size(), 1);
+        ASSERT_EQ(vm.peekFunction().locals_.size(), 1);
 
-        const auto& entry_a = top_frame.lv_table_.find("a");
-        ASSERT_TRUE(entry_a != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_a->second.getDouble().value(), 4.0);
+        const auto entry_a = vm.peekLocalVariable("a");
+        ASSERT_TRUE(entry_a.has_value());
+        ASSERT_EQ(entry_a->getDouble().value(), 4.0);
       },
       true);
 }
@@ -504,22 +1576,21 @@ fn main() {
       code,
       [&](Program& program) {
         EXPECT_EQ(program.instructions()[0].opcode(), OPCode::OP_PUSH);
-        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_LOCAL);
-        EXPECT_EQ(program.instructions()[2].opcode(), OPCode::OP_LOAD_LOCAL);
+        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_STORE_SLOT);
+        EXPECT_EQ(program.instructions()[2].opcode(), OPCode::OP_LOAD_SLOT);
         EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_PUSH);
         EXPECT_EQ(program.instructions()[4].opcode(), OPCode::OP_BANG_EQUAL);
         EXPECT_EQ(program.instructions()[5].opcode(), OPCode::OP_BRANCH);
         EXPECT_EQ(program.instructions()[6].opcode(), OPCode::OP_PUSH);
-        EXPECT_EQ(program.instructions()[7].opcode(), OPCode::OP_STORE_LOCAL);
+        EXPECT_EQ(program.instructions()[7].opcode(), OPCode::OP_STORE_SLOT);
       },
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
         // Variable State
-        ASSERT_EQ(top_frame.lv_table_.size(), 1);
+        ASSERT_EQ(vm.peekFunction().locals_.size(), 1);
 
-        const auto& entry_a = top_frame.lv_table_.find("a");
-        ASSERT_TRUE(entry_a != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_a->second.getDouble().value(), 3.0);
+        const auto entry_a = vm.peekLocalVariable("a");
+        ASSERT_TRUE(entry_a.has_value());
+        ASSERT_EQ(entry_a->getDouble().value(), 3.0);
       },
       true);
 }
@@ -538,26 +1609,25 @@ fn main() {
   prepare(
       code,
       [&](Program& program) {
-        EXPECT_EQ(program.instructions()[0].opcode(), OPCode::OP_LOAD_LOCAL);
-        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_LOAD_LOCAL);
+        EXPECT_EQ(program.instructions()[0].opcode(), OPCode::OP_LOAD_SLOT);
+        EXPECT_EQ(program.instructions()[1].opcode(), OPCode::OP_LOAD_SLOT);
         // start function call
         EXPECT_EQ(program.instructions()[2].opcode(), OPCode::OP_ADD);
-        EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_LOCAL);
-        EXPECT_EQ(program.instructions()[4].opcode(), OPCode::OP_LOAD_LOCAL);
+        EXPECT_EQ(program.instructions()[3].opcode(), OPCode::OP_STORE_SLOT);
+        EXPECT_EQ(program.instructions()[4].opcode(), OPCode::OP_LOAD_SLOT);
         EXPECT_EQ(program.instructions()[5].opcode(), OPCode::OP_RETURN);
         EXPECT_EQ(program.instructions()[6].opcode(), OPCode::OP_PUSH);
         EXPECT_EQ(program.instructions()[7].opcode(), OPCode::OP_PUSH);
         EXPECT_EQ(program.instructions()[8].opcode(), OPCode::OP_CALL);
-        EXPECT_EQ(program.instructions()[9].opcode(), OPCode::OP_STORE_LOCAL);
+        EXPECT_EQ(program.instructions()[9].opcode(), OPCode::OP_STORE_SLOT);
       },
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
 
         // Variable state
-        ASSERT_EQ(top_frame.lv_table_.size(), 1);
-        const auto& entry_b = top_frame.lv_table_.find("b");
-        ASSERT_TRUE(entry_b != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_b->second.getDouble().value(), 19.0);
+        ASSERT_EQ(vm.peekFunction().locals_.size(), 1);
+        const auto entry_b = vm.peekLocalVariable("b");
+        ASSERT_TRUE(entry_b.has_value());
+        ASSERT_EQ(entry_b->getDouble().value(), 19.0);
       },
       true);
 }
@@ -578,16 +1648,47 @@ fn main() {
   prepare(
       code, [&](Program& program) {},
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
 
         // Variable state
-        const auto& entry_a = top_frame.lv_table_.find("a");
-        ASSERT_TRUE(entry_a != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_a->second.getDouble().value(), 1.0);
+        const auto entry_a = vm.peekLocalVariable("a");
+        ASSERT_TRUE(entry_a.has_value());
+        ASSERT_EQ(entry_a->getDouble().value(), 1.0);
       },
       true);
 }
 
+TEST_F(VMExecIntegration, DeepRecursion) {
+  std::string code = R"(
+fn down(num, acc) {
+  if (num == 0) {
+    return acc;
+  }
+  let next = num - 1;
+  let sum = acc + num;
+  let r = down(next, sum);
+  return r;
+}
+
+fn main() {
+  let a = down(1000, 0);
+  let b = 10 - 4;
+}
+)";
+  prepare(
+      code, [&](Program& program) {},
+      [&](VMImpl& vm) {
+        const auto entry_a = vm.peekLocalVariable("a");
+        ASSERT_TRUE(entry_a.has_value());
+        ASSERT_EQ(entry_a->getDouble().value(), 500500.0);
+        const auto entry_b = vm.peekLocalVariable("b");
+        ASSERT_TRUE(entry_b.has_value());
+        ASSERT_EQ(entry_b->getDouble().value(), 6.0);
+        // Only main frame is remained.
+        ASSERT_EQ(vm.peekFunction().name_, "main");
+      },
+      false);
+}
+
 TEST_F(VMExecIntegration, Fibonacchi) {
   std::string code = R"(
 fn calc(num) {
@@ -605,15 +1706,88 @@ fn main() {
   prepare(
       code, [&](Program& program) {},
       [&](VMImpl& vm) {
-        const auto& top_frame = vm.peekFrame();
 
         // Variable state
-        const auto& entry_a = top_frame.lv_table_.find("a");
-        ASSERT_TRUE(entry_a != top_frame.lv_table_.end());
-        ASSERT_EQ(entry_a->second.getDouble().value(), 2.0);
+        const auto entry_a = vm.peekLocalVariable("a");
+        ASSERT_TRUE(entry_a.has_value());
+        ASSERT_EQ(entry_a->getDouble().value(), 2.0);
       },
       true);
 }
 
+class RegisterVMTest : public testing::Test {
+ public:
+  void run(std::string code) {
+    Tokenizer t(code);
+    Parser p(t.scanTokens());
+    auto ast = p.parse();
+    ast->accept(stack_emitter_);
+    ast->accept(register_emitter_);
+  }
+
+  StartearVMInstructionEmitter stack_emitter_;
+  RegisterVMInstructionEmitter register_emitter_;
+};
+
+TEST_F(RegisterVMTest, ThreeAddress) {
+  run(R"(
+fn main() {
+  let a = 3;
+  let b = a + 4;
+  let c = a * b - 2;
+}
+)");
+  const auto& program = register_emitter_.emit();
+  ASSERT_TRUE(program.lowered());
+  disassemble(program);
+  // Operands are read from slots or constants directly, and results are
+  // written to the slot of variable.
+  const auto& code = program.code();
+  ASSERT_EQ(code[0].opcode_, RegisterOPCode::OP_MOVE);
+  EXPECT_EQ(code[0].a_, 0);
+  ASSERT_EQ(code[1].opcode_, RegisterOPCode::OP_ADD);
+  EXPECT_EQ(code[1].a_, 1);
+  EXPECT_EQ(code[1].b_, 0);
+  EXPECT_TRUE(RegisterProgram::isConstant(code[1].c_));
+  EXPECT_LT(program.code().size(),
+            stack_emitter_.emit().instructions().size());
+
+  RegisterVM vm(program);
+  vm.start();
+  EXPECT_EQ(vm.peekLocalVariable("b")->getDouble().value(), 7.0);
+  EXPECT_EQ(vm.peekLocalVariable("c")->getDouble().value(), 19.0);
+}
+
+TEST_F(RegisterVMTest, DeepRecursion) {
+  run(R"(
+fn down(num, acc) {
+  if (num == 0) {
+    return acc;
+  }
+  let next = num - 1;
+  let sum = acc + num;
+  let r = down(next, sum);
+  return r;
+}
+
+fn main() {
+  let a = down(1000, 0);
+  let b = 10 - 4;
+  let c = a > 100 || b == 7;
+}
+)");
+  const auto& program = register_emitter_.emit();
+  ASSERT_TRUE(program.lowered());
+  EXPECT_LT(program.code().size(),
+            stack_emitter_.emit().instructions().size());
+
+  RegisterVM vm(program);
+  vm.start();
+  EXPECT_EQ(vm.peekLocalVariable("a")->getDouble().value(), 500500.0);
+  EXPECT_EQ(vm.peekLocalVariable("b")->getDouble().value(), 6.0);
+  EXPECT_EQ(vm.peekLocalVariable("c")->getDouble().value(), 1.0);
+  EXPECT_EQ(vm.peekFunction().name_, "main");
+}
+
 }  // namespace
 }  // namespace Startear
@@ -0,0 +1,86 @@
+// MIT License
+//
+// Copyright (c) Rei Shimizu 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+//        of this software and associated documentation files (the "Software"),
+//        to deal
+// in the Software without restriction, including without limitation the rights
+//        to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//        sell copies of the Software, and to permit persons to whom the
+//        Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all
+//        copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//        AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Run the script with tracing VM, and propose the opcode sequences which are
+// worth to be fused into superinstructions.
+//
+// Usage: startear_mine_fusion [script] [max length = 3] [top n = 10]
+
+#include <fmt/format.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "parser.h"
+#include "tokenizer.h"
+#include "trace_miner.h"
+#include "vm_impl.h"
+
+using namespace Startear;
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 4) {
+    std::cout << "Usage: startear_mine_fusion [script] [max length] [top n]"
+              << std::endl;
+    return 1;
+  }
+  auto tokenizer = Tokenizer::fromFile(argv[1]);
+  if (!tokenizer.has_value()) {
+    return 1;
+  }
+  const size_t max_length = argc > 2 ? std::stoul(argv[2]) : 3;
+  const size_t top_n = argc > 3 ? std::stoul(argv[3]) : 10;
+
+  Parser parser(tokenizer->scanTokens());
+  auto ast = parser.parse();
+  StartearVMInstructionEmitter emitter;
+  ast->accept(emitter);
+  auto program = emitter.emit();
+  if (!program.linked()) {
+    return 1;
+  }
+
+  std::vector<OPCode> trace;
+  VMImpl vm(program);
+  vm.recordTrace(&trace);
+  vm.start();
+
+  std::cout << fmt::format("{} instructions are dispatched", trace.size())
+            << std::endl;
+  for (const auto& candidate :
+       mineFusionCandidates(trace, max_length, top_n)) {
+    std::string sequence;
+    for (const auto op : candidate.sequence_) {
+      sequence += sequence.empty() ? "" : " ";
+      sequence += opcodeToString(op);
+    }
+    std::cout << fmt::format("{:>10} {:>10} | {}", candidate.savedDispatches(),
+                             candidate.count_, sequence)
+              << std::endl;
+  }
+  return 0;
+}